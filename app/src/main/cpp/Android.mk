@@ -15,7 +15,7 @@ LOCAL_SRC_FILES := \
 	jdatadst.c jdatasrc.c jdcoefct.c jdcolor.c jddctmgr.c jdhuff.c \
 	jdinput.c jdmainct.c jdmarker.c jdmaster.c \
 	jdpostct.c jdsample.c jdtrans.c jerror.c \
-	jutils.c jmemmgr.c jcarith.c jdarith.c jaricom.c cdjpeg.c transupp.c rdswitch.c ajpegtran.c
+	jutils.c jmemmgr.c jcarith.c jdarith.c jaricom.c jstdhuff.c jhuffcache.c jcscans.c cdjpeg.c transupp.c rdswitch.c ajpegtran.c
 
 # Use the no backing store memory manager provided by
 # libjpeg. See install.txt
@@ -17,6 +17,7 @@
 #include <setjmp.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <jni.h>
 #include <android/log.h>
 #ifdef NDEBUG
@@ -29,17 +30,14 @@
 #include "cdjpeg.h"		/* Common decls for cjpeg/djpeg applications */
 #include "transupp.h"		/* Support routines for jpegtran */
 #include "jversion.h"		/* for version message */
+#ifdef C_PARALLEL_SUPPORTED
+#include <pthread.h>
+#endif
 
 /* Note for ajpegtran
  *  Error check for configuration.
  *  This code can not support all functions.
  */
-#ifdef C_PROGRESSIVE_SUPPORTED
-#error C_PROGRESSIVE_SUPPORTED is not supported.
-#endif
-#ifdef C_MULTISCAN_FILES_SUPPORTED
-#error C_MULTISCAN_FILES_SUPPORTED is not supported.
-#endif
 #if !TRANSFORMS_SUPPORTED
 #error TRANSFORMS_SUPPORTED must be supported.
 #endif
@@ -79,6 +77,55 @@ int coeff_adj;
 int coeff_offset[4];
 int monochrome;
 
+/* Added for ajpegtran
+ *  Upper limit for '-threads'.
+ */
+#define MAX_THREADS 64
+
+/* Added for ajpegtran
+ *  Flag for extension function, 'smallest'.
+ */
+static boolean smallest;
+
+/* Added for ajpegtran
+ *  Flag for extension function, 'baseline'.
+ */
+static boolean baseline;
+
+/* Added for ajpegtran
+ *  Set when '-restart' is given, even as '-restart 0', for '-baseline'.
+ */
+static boolean restart_given;
+
+/* Added for ajpegtran
+ *  Set by parse_switches() when the output will have more than one scan.
+ *  The streaming transcode (see below) writes a single scan only.
+ */
+static boolean multiscan_output;
+
+/* Added for ajpegtran
+ *  Quality of the standard tables for extension function, 'requant'.
+ *  0 when the option is not specified.
+ */
+static int requant_quality;
+
+/* Added for ajpegtran
+ *  Factors for extension functions, 'contrast' and 'saturation'.
+ *  color_adj is set when either of them is specified.
+ */
+static boolean color_adj;
+static double contrast_factor;
+static double saturation_factor;
+#define MAX_COLOR_FACTOR 10.0
+
+/* Added for ajpegtran
+ *  Tile size for extension function, 'tile', and flag for 'pyramid'.
+ *  tile_width is 0 when the option is not specified.
+ */
+static JDIMENSION tile_width;
+static JDIMENSION tile_height;
+static boolean tile_pyramid;
+
 LOCAL(void)
 select_transform (JXFORM_CODE transform)
 /* Silly little routine to detect multiple transform options,
@@ -127,6 +174,10 @@ parse_switches (j_compress_ptr cinfo, char *argstr,
   transformoption.trim = FALSE;
   transformoption.force_grayscale = FALSE;
   transformoption.crop = FALSE;
+  transformoption.downscale = 1;
+  transformoption.pixelize_size = 8;
+  transformoption.num_regions = 0;
+  transformoption.num_drops = 0;
   cinfo->err->trace_level = 0;
 
   /* Scan command line options, adjust parameters */
@@ -148,6 +199,10 @@ parse_switches (j_compress_ptr cinfo, char *argstr,
       return 0;
 #endif
 
+    } else if (keymatch(arg, "baseline", 1)) {
+      /* Force baseline output with restart markers. */
+      baseline = TRUE;
+
     } else if (keymatch(arg, "copy", 2)) {
       /* Select which extra markers to copy. */
       arg2 = strtok(NULL," ");
@@ -284,6 +339,7 @@ parse_switches (j_compress_ptr cinfo, char *argstr,
 	cinfo->restart_in_rows = (int) lval;
 	/* restart_interval will be computed during startup */
       }
+      restart_given = TRUE;
 
     } else if (keymatch(arg, "rotate", 2)) {
       /* Rotate 90, 180, or 270 degrees (measured clockwise). */
@@ -315,12 +371,43 @@ parse_switches (j_compress_ptr cinfo, char *argstr,
 	return 0;
       }
       scansarg = arg2;
-      /* We must postpone reading the file in case -progressive appears. */
+      /* We must postpone reading the script in case -progressive appears. */
 #else
       strcpy(errmsgbuffer,"Parse error:multi-scan output was not compiled");
       return 0;
 #endif
 
+    } else if (keymatch(arg, "smallest", 2)) {
+      /* Try several entropy coding modes and keep the smallest output. */
+#ifdef C_PARALLEL_SUPPORTED
+      smallest = TRUE;
+#else
+      strcpy(errmsgbuffer,"Parse error:parallel coding was not compiled");
+      return 0;
+#endif
+
+    } else if (keymatch(arg, "threads", 2)) {
+      /* Number of threads for entropy coding (with restart markers only). */
+#ifdef C_PARALLEL_SUPPORTED
+      int ival;
+
+      arg2 = strtok(NULL," ");
+      if (!arg2){	/* advance to next argument */
+	/* error */
+	strcpy(errmsgbuffer,"Parse error:missed parameter(threads)");
+	return 0;
+      }
+      if (sscanf(arg2, "%d", &ival) < 1 || ival < 1 || ival > MAX_THREADS){
+	/* error  */
+	strcpy(errmsgbuffer,"Parse error:argument(threads)");
+	return 0;
+      }
+      cinfo->num_threads = ival;
+#else
+      strcpy(errmsgbuffer,"Parse error:parallel coding was not compiled");
+      return 0;
+#endif
+
     } else if (keymatch(arg, "transpose", 1)) {
       /* Transpose (across UL-to-LR axis). */
       select_transform(JXFORM_TRANSPOSE);
@@ -353,12 +440,32 @@ parse_switches (j_compress_ptr cinfo, char *argstr,
 
     } else if (keymatch(arg, "pixelize", 1)) {
 #if TRANSFORMS_SUPPORTED
+      char * cellarg;
       arg2 = strtok(NULL," ");
       if (!arg2){	/* advance to next argument */
 	/* error */
 	strcpy(errmsgbuffer,"Parse error:missed parameter(pixelize)");
 	return 0;
       }
+      /* Added for ajpegtran
+       *  Cell size is given after the area, like 'WxH+X+Y:N'.
+       */
+      cellarg = strchr(arg2, ':');
+      if (cellarg != NULL) {
+	*cellarg++ = '\0';
+	if (strcmp(cellarg, "8") == 0)
+	  transformoption.pixelize_size = 8;
+	else if (strcmp(cellarg, "16") == 0)
+	  transformoption.pixelize_size = 16;
+	else if (strcmp(cellarg, "32") == 0)
+	  transformoption.pixelize_size = 32;
+	else if (strcmp(cellarg, "64") == 0)
+	  transformoption.pixelize_size = 64;
+	else {
+	  strcpy(errmsgbuffer,"Parse error:argument(pixelize)");
+	  return 0;
+	}
+      }
       if (transformoption.crop /* reject multiple crop/wipe/pixelize requests */ ||
 	  ! jtransform_parse_crop_spec(&transformoption, arg2)) {
 	strcpy(errmsgbuffer,"Parse error:argument(pixelize)");
@@ -368,6 +475,97 @@ parse_switches (j_compress_ptr cinfo, char *argstr,
 #else
       select_transform(JXFORM_NONE);	/* force an error */
 #endif
+    } else if (keymatch(arg, "redact", 3)) {
+      /* Added for ajpegtran
+       *  Wipe, flatten or pixelize a list of regions in one pass.
+       *  The option can be repeated to add more regions.
+       */
+#if TRANSFORMS_SUPPORTED
+      arg2 = strtok(NULL," ");
+      if (!arg2){	/* advance to next argument */
+	/* error */
+	strcpy(errmsgbuffer,"Parse error:missed parameter(redact)");
+	return 0;
+      }
+      if (transformoption.crop /* reject crop/wipe/pixelize requests */ ||
+	  ! jtransform_parse_region_list(&transformoption, arg2)) {
+	strcpy(errmsgbuffer,"Parse error:argument(redact)");
+	return 0;
+      }
+      select_transform(JXFORM_REDACT);
+#else
+      select_transform(JXFORM_NONE);	/* force an error */
+#endif
+    } else if (keymatch(arg, "drop", 2)) {
+      /* Added for ajpegtran
+       *  Drop other images, given by file descriptors, into the output.
+       *  It can be repeated, and combined with crop to make a larger canvas.
+       */
+#if TRANSFORMS_SUPPORTED
+      arg2 = strtok(NULL," ");
+      if (!arg2){	/* advance to next argument */
+	/* error */
+	strcpy(errmsgbuffer,"Parse error:missed parameter(drop)");
+	return 0;
+      }
+      if (! jtransform_parse_drop_list(&transformoption, arg2)) {
+	strcpy(errmsgbuffer,"Parse error:argument(drop)");
+	return 0;
+      }
+      select_transform(JXFORM_DROP);
+#else
+      select_transform(JXFORM_NONE);	/* force an error */
+#endif
+    } else if (keymatch(arg, "downscale", 1)) {
+      /* Added for ajpegtran
+       *  Downscale by 1/2, 1/4 or 1/8 in the DCT domain.
+       */
+#if TRANSFORMS_SUPPORTED
+      arg2 = strtok(NULL," ");
+      if (!arg2){	/* advance to next argument */
+	/* error */
+	strcpy(errmsgbuffer,"Parse error:missed parameter(downscale)");
+	return 0;
+      }
+      if (strcmp(arg2, "1/2") == 0)
+	transformoption.downscale = 2;
+      else if (strcmp(arg2, "1/4") == 0)
+	transformoption.downscale = 4;
+      else if (strcmp(arg2, "1/8") == 0)
+	transformoption.downscale = 8;
+      else {
+	strcpy(errmsgbuffer,"Parse error:argument(downscale)");
+	return 0;
+      }
+      select_transform(JXFORM_DOWNSCALE);
+#else
+      select_transform(JXFORM_NONE);	/* force an error */
+#endif
+    } else if (keymatch(arg, "tile", 2)) {
+      /* Added for ajpegtran
+       *  Split the image into tiles of the given size.
+       */
+      unsigned int w, h;
+      char c;
+
+      arg2 = strtok(NULL," ");
+      if (!arg2){	/* advance to next argument */
+	/* error */
+	strcpy(errmsgbuffer,"Parse error:missed parameter(tile)");
+	return 0;
+      }
+      if (sscanf(arg2, "%ux%u%c", &w, &h, &c) != 2 ||
+	  w < 1 || h < 1 || w > JPEG_MAX_DIMENSION || h > JPEG_MAX_DIMENSION) {
+	strcpy(errmsgbuffer,"Parse error:argument(tile)");
+	return 0;
+      }
+      tile_width = (JDIMENSION) w;
+      tile_height = (JDIMENSION) h;
+    } else if (keymatch(arg, "pyramid", 2)) {
+      /* Added for ajpegtran
+       *  Also make the tiles of the 1/2, 1/4 and 1/8 images.
+       */
+      tile_pyramid = TRUE;
     } else if (keymatch(arg, "offset", 3)) {
       arg2 = strtok(NULL," ");
       char * arg3 = strtok(NULL," ");
@@ -386,6 +584,53 @@ parse_switches (j_compress_ptr cinfo, char *argstr,
 	return 0;
       }
       coeff_adj = 1;
+    } else if (keymatch(arg, "contrast", 3)) {
+      /* Added for ajpegtran
+       *  Scale Y coefficients around the middle gray.
+       */
+      arg2 = strtok(NULL," ");
+      if (!arg2){	/* advance to next argument */
+	/* error */
+	strcpy(errmsgbuffer,"Parse error:missed parameter(contrast)");
+	return 0;
+      }
+      if (sscanf(arg2, "%lf", &contrast_factor) < 1 ||
+	  contrast_factor < 0.0 || contrast_factor > MAX_COLOR_FACTOR) {
+	strcpy(errmsgbuffer,"Parse error:argument(contrast)");
+	return 0;
+      }
+      color_adj = TRUE;
+    } else if (keymatch(arg, "saturation", 2)) {
+      /* Added for ajpegtran
+       *  Scale Cb and Cr coefficients.
+       */
+      arg2 = strtok(NULL," ");
+      if (!arg2){	/* advance to next argument */
+	/* error */
+	strcpy(errmsgbuffer,"Parse error:missed parameter(saturation)");
+	return 0;
+      }
+      if (sscanf(arg2, "%lf", &saturation_factor) < 1 ||
+	  saturation_factor < 0.0 || saturation_factor > MAX_COLOR_FACTOR) {
+	strcpy(errmsgbuffer,"Parse error:argument(saturation)");
+	return 0;
+      }
+      color_adj = TRUE;
+    } else if (keymatch(arg, "requant", 3)) {
+      /* Added for ajpegtran
+       *  Requantize to the standard tables of the given quality.
+       */
+      arg2 = strtok(NULL," ");
+      if (!arg2){	/* advance to next argument */
+	/* error */
+	strcpy(errmsgbuffer,"Parse error:missed parameter(requant)");
+	return 0;
+      }
+      if (sscanf(arg2, "%d", &requant_quality) < 1 ||
+	  requant_quality < 1 || requant_quality > 100) {
+	strcpy(errmsgbuffer,"Parse error:argument(requant)");
+	return 0;
+      }
     } else if (keymatch(arg, "monochrome", 4)) {
         /* Trim off any partial edge MCUs that the transform can't handle. */
       monochrome = 1;
@@ -398,6 +643,9 @@ parse_switches (j_compress_ptr cinfo, char *argstr,
     } else if (keymatch(arg, "rmgeotag", 3)) {
       /* Remove thumbnail */
       cinfo->remove_geotag = TRUE;
+    } else if (keymatch(arg, "rebuildthumbnail", 3)) {
+      /* Make new thumbnail from transformed image */
+      cinfo->rebuild_thumbnail = TRUE;
 
     } else {
       strcpy(errmsgbuffer,"Parse error:unknown switch");
@@ -407,6 +655,8 @@ parse_switches (j_compress_ptr cinfo, char *argstr,
 
   /* Post-switch-scanning cleanup */
 
+  multiscan_output = (simple_progressive || scansarg != NULL) && ! baseline;
+
   if (for_real) {
 
 #ifdef C_PROGRESSIVE_SUPPORTED
@@ -415,17 +665,53 @@ parse_switches (j_compress_ptr cinfo, char *argstr,
 #endif
 
 #ifdef C_MULTISCAN_FILES_SUPPORTED
+    /* Added for ajpegtran
+     *  '-scans auto' searches for the script of minimal size.
+     */
+    if (scansarg != NULL && strcmp(scansarg, "auto") == 0) {
+      jpeg_simple_progression(cinfo);
+      cinfo->optimize_scans = TRUE;
+    } else
     if (scansarg != NULL)	/* process -scans if it was present */
       if (! read_scan_script(cinfo, scansarg)){
 	strcpy(errmsgbuffer,"Parse error:argument error");
 	return 0;
       }
 #endif
+
+    /* Added for ajpegtran
+     *  '-baseline' overrides the options above that select a multi-scan
+     *  or arithmetic coded output.  A restart marker is put at every MCU row
+     *  unless '-restart' is given, so the entropy coded data can be split
+     *  for parallel coding ('-threads') and for parallel decoding later.
+     */
+    if (baseline) {
+      cinfo->arith_code = FALSE;
+      cinfo->scan_info = NULL;
+      cinfo->num_scans = 0;
+      cinfo->optimize_scans = FALSE;
+      if (! restart_given)
+	cinfo->restart_in_rows = 1;
+    }
   }
 
   return 1;			/* return index of next arg (file name) */
 }
 
+/* Added for ajpegtran
+ *  Rewind the input file for jpeg_write_coefficients_stream().
+ *  Each pass of the compressor ('-optimize' has two) decodes the file again.
+ */
+static int stream_fd;
+
+METHODDEF(void)
+rewind_source (j_decompress_ptr cinfo)
+{
+  if (lseek(stream_fd, 0, SEEK_SET) == (off_t) -1)
+    ERREXIT(cinfo, JERR_FILE_READ);
+  jpeg_stdio_src(cinfo, stream_fd);
+}
+
 /**
  * Clear 2nd, 3rd and 4th component for coverting to monochrome image.
  * 
@@ -495,108 +781,1519 @@ void brightnessControl(
   return;
 }
 
-#define OPTTEMP_SIZE 256
 /**
- * ajpegtran main entry.
- *
- * Execute Jpegtran.
+ * Scale coefficients for contrast and saturation.
+ * 
+ * Note for ajpegtran
+ *  This function is for extension functions, '-contrast' and '-saturation'.
+ *  The DC coefficient is level shifted, so scaling all coefficients of a
+ *  component scales the samples around the middle value (128).
+ *  For YCbCr and YCCK images, Y (and K) is scaled by 'contrast_factor',
+ *  Cb and Cr by 'saturation_factor'.  For grayscale, RGB and CMYK images,
+ *  all components are scaled by 'contrast_factor' and 'saturation_factor'
+ *  is ignored.
+ *  The results are limited to the range of the DCT of 8x8 samples,
+ *  so that the samples stay almost in the range after saturation.
  */
-JNIEXPORT jstring JNICALL
-Java_github_kamemak_ajpegtran_1example_MainActivity_ajpegtran( JNIEnv* env,
-                                         jobject thiz,
-                                         jint rfd,
-                                         jint wfd,
-                                         jstring jOptions
-                                                  )
-{
-  struct jpeg_decompress_struct srcinfo;
-  struct jpeg_compress_struct dstinfo;
-  struct jpeg_error_mgr jsrcerr, jdsterr;
-#ifdef PROGRESS_REPORT
-  struct cdjpeg_progress_mgr progress;
-#endif
-  jvirt_barray_ptr * src_coef_arrays;
-  jvirt_barray_ptr * dst_coef_arrays;
-  /* We assume all-in-memory processing and can therefore use only a
-   * single file pointer for sequential input and output operation. 
-   */
-  boolean simple_progressive = FALSE;
+void colorControl(
+	j_decompress_ptr cinfo,
+	jvirt_barray_ptr *src_coef_arrays
+){
+  int ci, k, offset_y;
+  jpeg_component_info *compptr;
+  JQUANT_TBL *qtbl;
+  JDIMENSION blk_x, blk_y;
+  JBLOCKARRAY buffer;
+  JCOEFPTR blkptr;
+  double factor;
+  long scale, value, limit[DCTSIZE2];
+  boolean ycc;
 
-  const char* filePath;
-  const char* optstr;
-  char opttemp[OPTTEMP_SIZE];
-  int parseResult;
+  ycc = (cinfo->jpeg_color_space == JCS_YCbCr ||
+	 cinfo->jpeg_color_space == JCS_YCCK);
 
-  /* Note for ajpegtran
-   *  Clear variables for extension functions.
-   */
-  monochrome = 0;
-  coeff_adj = 0;
-  coeff_offset[0] = 0;
-  coeff_offset[1] = 0;
-  coeff_offset[2] = 0;
-  coeff_offset[3] = 0;
-  errmsgbuffer[0]='\0';
+  for (ci = 0; ci < cinfo->num_components; ci++) {
+    compptr = cinfo->comp_info + ci;
+    qtbl = compptr->quant_table;
+    if (qtbl == NULL)
+      continue;
+    factor = (ycc && (ci == 1 || ci == 2)) ? saturation_factor : contrast_factor;
+    /* 16 bit fixed point */
+    scale = (long) (factor * 65536.0 + 0.5);
+    if (scale == 65536L)
+      continue;
+    for (k = 0; k < DCTSIZE2; k++)
+      limit[k] = ((long) (DCTSIZE << (cinfo->data_precision - 1)) - 1L) /
+		 (long) qtbl->quantval[k];
+    for (blk_y = 0; blk_y < compptr->height_in_blocks; blk_y += compptr->v_samp_factor) {
+      buffer = (*cinfo->mem->access_virt_barray)
+		((j_common_ptr) cinfo, src_coef_arrays[ci], blk_y,
+		(JDIMENSION) compptr->v_samp_factor, TRUE );
+      for (offset_y = 0; offset_y < compptr->v_samp_factor; offset_y++) {
+	for (blk_x = 0; blk_x < compptr->width_in_blocks; blk_x++) {
+	  blkptr = buffer[offset_y][blk_x];
+	  for (k = 0; k < DCTSIZE2; k++) {
+	    if (blkptr[k] == 0)
+	      continue;
+	    if (blkptr[k] > 0) {
+	      value = ((long) blkptr[k] * scale + 32768L) >> 16;
+	      if (value > limit[k]) value = limit[k];
+	    } else {
+	      value = -(((long) -blkptr[k] * scale + 32768L) >> 16);
+	      if (value < -limit[k]) value = -limit[k];
+	    }
+	    blkptr[k] = (JCOEF) value;
+	  }
+	}
+      }
+    }
+  }
+  return;
+}
 
-  /* Note for ajpegtran
-   *  Clear errno to get I/O error.
+/**
+ * Requantize all coefficients to coarser quantization tables.
+ * 
+ * Note for ajpegtran
+ *  This function is for extension function, '-requant'.
+ *  The standard tables of the quality 'requant_quality' are set to slot 0
+ *  (luminance) and 1 (chrominance) of dstinfo by jpeg_set_quality().
+ *  Each entry of the new table is the larger of the source entry and the
+ *  standard one, so the quantization never gets finer.  The coefficients
+ *  are rescaled with rounding, and the new tables are stored to srcinfo,
+ *  so jpeg_copy_critical_parameters() copies them to the output and the
+ *  transformations (and '-downscale') see consistent tables.
+ *  This must be called before jpeg_copy_critical_parameters().
+ */
+void requantize(
+	j_decompress_ptr srcinfo,
+	j_compress_ptr dstinfo,
+	jvirt_barray_ptr *src_coef_arrays
+){
+  int ci, tblno, k, offset_y;
+  boolean luma_tbl[NUM_QUANT_TBLS];
+  boolean used_tbl[NUM_QUANT_TBLS];
+  UINT16 newq[NUM_QUANT_TBLS][DCTSIZE2];
+  jpeg_component_info *compptr;
+  JQUANT_TBL *qtbl;
+  const UINT16 *target;
+  JDIMENSION blk_x, blk_y;
+  JBLOCKARRAY buffer;
+  JCOEFPTR blkptr;
+  long num, qo, qn;
+
+  jpeg_set_quality(dstinfo, requant_quality, TRUE);
+
+  /* A table shared by a luminance and a chrominance component is
+   * requantized to the luminance one.  For RGB and CMYK images, all
+   * components use the luminance table like cjpeg.
    */
-  errno = 0;
+  for (tblno = 0; tblno < NUM_QUANT_TBLS; tblno++) {
+    luma_tbl[tblno] = FALSE;
+    used_tbl[tblno] = FALSE;
+  }
+  for (ci = 0; ci < srcinfo->num_components; ci++) {
+    compptr = srcinfo->comp_info + ci;
+    if (compptr->quant_table == NULL)
+      continue;
+    used_tbl[compptr->quant_tbl_no] = TRUE;
+    if (! ((srcinfo->jpeg_color_space == JCS_YCbCr ||
+	    srcinfo->jpeg_color_space == JCS_YCCK) && (ci == 1 || ci == 2)))
+      luma_tbl[compptr->quant_tbl_no] = TRUE;
+  }
+  for (tblno = 0; tblno < NUM_QUANT_TBLS; tblno++) {
+    if (! used_tbl[tblno])
+      continue;
+    qtbl = srcinfo->quant_tbl_ptrs[tblno];
+    if (qtbl == NULL)
+      ERREXIT1(srcinfo, JERR_NO_QUANT_TABLE, tblno);
+    target = dstinfo->quant_tbl_ptrs[luma_tbl[tblno] ? 0 : 1]->quantval;
+    for (k = 0; k < DCTSIZE2; k++)
+      newq[tblno][k] = qtbl->quantval[k] > target[k] ?
+		       qtbl->quantval[k] : target[k];
+  }
 
-  /* To handle a error, setjmp is used. */
-  if ( setjmp( jbuf ) == 0 ) {
-    /* Initialize the JPEG decompression object with default error handling. */
-    srcinfo.err = jpeg_std_error(&jsrcerr);
-    jpeg_create_decompress(&srcinfo);
-    /* Initialize the JPEG compression object with default error handling. */
-    dstinfo.err = jpeg_std_error(&jdsterr);
-    jpeg_create_compress(&dstinfo);
+  /* Rescale the coefficients: round(coef * old / new) */
+  for (ci = 0; ci < srcinfo->num_components; ci++) {
+    compptr = srcinfo->comp_info + ci;
+    qtbl = compptr->quant_table;
+    if (qtbl == NULL)
+      continue;
+    target = newq[compptr->quant_tbl_no];
+    for (blk_y = 0; blk_y < compptr->height_in_blocks; blk_y += compptr->v_samp_factor) {
+      buffer = (*srcinfo->mem->access_virt_barray)
+		((j_common_ptr) srcinfo, src_coef_arrays[ci], blk_y,
+		(JDIMENSION) compptr->v_samp_factor, TRUE );
+      for (offset_y = 0; offset_y < compptr->v_samp_factor; offset_y++) {
+	for (blk_x = 0; blk_x < compptr->width_in_blocks; blk_x++) {
+	  blkptr = buffer[offset_y][blk_x];
+	  for (k = 0; k < DCTSIZE2; k++) {
+	    if (blkptr[k] == 0)
+	      continue;
+	    qo = qtbl->quantval[k];
+	    qn = target[k];
+	    if (qo == qn)
+	      continue;
+	    num = (long) blkptr[k] * qo;
+	    if (num >= 0)
+	      blkptr[k] = (JCOEF) ((num + (qn >> 1)) / qn);
+	    else
+	      blkptr[k] = (JCOEF) -((-num + (qn >> 1)) / qn);
+	  }
+	}
+      }
+    }
+  }
 
-    /* Now safe to enable signal catcher.
-     * Note: we assume only the decompression object will have virtual arrays.
-     */
-#ifdef NEED_SIGNAL_CATCHER
-    enable_signal_catcher((j_common_ptr) &srcinfo);
-#endif
+  /* Store the new tables, both to the slots and to the components */
+  for (ci = 0; ci < srcinfo->num_components; ci++) {
+    compptr = srcinfo->comp_info + ci;
+    if (compptr->quant_table != NULL)
+      MEMCOPY(compptr->quant_table->quantval, newq[compptr->quant_tbl_no],
+	      SIZEOF(newq[0]));
+  }
+  for (tblno = 0; tblno < NUM_QUANT_TBLS; tblno++) {
+    if (used_tbl[tblno])
+      MEMCOPY(srcinfo->quant_tbl_ptrs[tblno]->quantval, newq[tblno],
+	      SIZEOF(newq[0]));
+  }
+  return;
+}
 
-    /* Scan command line to find file names.
-     * It is convenient to use just one switch-parsing routine, but the switch
-     * values read here are mostly ignored; we will rescan the switches after
-     * opening the input file.  Also note that most of the switches affect the
-     * destination JPEG object, so we parse into that and then copy over what
-     * needs to affects the source too.
-     */
-    optstr = (*env)->GetStringUTFChars(env, jOptions, NULL);
-    if (!optstr||OPTTEMP_SIZE<=strlen(optstr)) {
-      (*env)->ReleaseStringUTFChars(env, jOptions, optstr);
-      strcpy(errmsgbuffer,"Argument error");
-      longjmp(jbuf,1);
-    }
-    strcpy(opttemp,optstr);
-    parseResult = parse_switches(&dstinfo, opttemp, 0, FALSE);
-    (*env)->ReleaseStringUTFChars(env, jOptions, optstr);
-    if ( !parseResult ){
-      longjmp(jbuf,1);
-    }
+/**
+ * Write preview pixels of an iMCU row from DC coefficients.
+ * 
+ * Note for ajpegtran
+ *  This function is for ajpegtranpreview().
+ *  rows[ci] points to the v_samp_factor block rows of component ci in
+ *  iMCU row 'row'. Each preview pixel is one block of the image
+ *  (1/8 scale), its value is the dequantized DC coefficient, that is
+ *  the average of the block. Output is RGBA, 4 bytes per pixel.
+ */
+#define PREVIEW_CLAMP(x)  ((x) < 0 ? 0 : (x) > MAXJSAMPLE ? MAXJSAMPLE : (x))
 
-    jsrcerr.trace_level = jdsterr.trace_level;
-    srcinfo.mem->max_memory_to_use = dstinfo.mem->max_memory_to_use;
-    LOGD("max_memory_to_use = %ld",srcinfo.mem->max_memory_to_use);
+void previewRow(
+	j_decompress_ptr cinfo,
+	JBLOCKARRAY *rows,
+	JDIMENSION row,
+	JDIMENSION width,
+	JDIMENSION height,
+	unsigned char *outbuf
+){
+  int ci, v[MAX_COMPONENTS], quantval[MAX_COMPONENTS];
+  int r, g, b, k;
+  double y, cb, cr;
+  jpeg_component_info *compptr;
+  JQUANT_TBL *qtbl;
+  JDIMENSION x, outrow, lastrow;
+  unsigned char *outptr;
 
-#ifdef PROGRESS_REPORT
-    start_progress_monitor((j_common_ptr) &dstinfo, &progress);
-#endif
+  /* The table of a component is latched at the start of its scan.
+   * A truncated file may end before the scan of a component, then the
+   * table is taken from the header, or the component is neutral (DC 0).
+   */
+  for (ci = 0; ci < cinfo->num_components; ci++) {
+    compptr = cinfo->comp_info + ci;
+    qtbl = compptr->quant_table;
+    if (qtbl == NULL)
+      qtbl = cinfo->quant_tbl_ptrs[compptr->quant_tbl_no];
+    quantval[ci] = (qtbl != NULL) ? qtbl->quantval[0] : 0;
+  }
 
-    /* Specify data source for decompression */
-    jpeg_stdio_src(&srcinfo, rfd);
+  outrow = row * cinfo->max_v_samp_factor;
+  lastrow = outrow + cinfo->max_v_samp_factor;
+  if (lastrow > height) lastrow = height;
+  for (; outrow < lastrow; outrow++) {
+    outptr = outbuf + (size_t) outrow * width * 4;
+    for (x = 0; x < width; x++) {
+      for (ci = 0; ci < cinfo->num_components; ci++) {
+	compptr = cinfo->comp_info + ci;
+	k = rows[ci][(outrow % cinfo->max_v_samp_factor) *
+		     compptr->v_samp_factor / cinfo->max_v_samp_factor]
+		    [x * compptr->h_samp_factor / cinfo->max_h_samp_factor][0]
+	    * quantval[ci];
+	/* DC is block_size times the average of level-shifted samples */
+	k = (k >= 0 ? k + cinfo->block_size / 2 : k - cinfo->block_size / 2)
+	    / cinfo->block_size;
+	v[ci] = PREVIEW_CLAMP(k + CENTERJSAMPLE);
+      }
+      switch (cinfo->jpeg_color_space) {
+      case JCS_YCbCr:
+      case JCS_YCCK:
+	y = v[0];
+	cb = v[1] - CENTERJSAMPLE;
+	cr = v[2] - CENTERJSAMPLE;
+	r = (int) (y + 1.40200 * cr + 0.5);
+	g = (int) (y - 0.34414 * cb - 0.71414 * cr + 0.5);
+	b = (int) (y + 1.77200 * cb + 0.5);
+	r = PREVIEW_CLAMP(r);
+	g = PREVIEW_CLAMP(g);
+	b = PREVIEW_CLAMP(b);
+	if (cinfo->jpeg_color_space == JCS_YCCK) {
+	  /* Adobe inverted CMYK, C = MAXJSAMPLE - R */
+	  r = (MAXJSAMPLE - r) * v[3] / MAXJSAMPLE;
+	  g = (MAXJSAMPLE - g) * v[3] / MAXJSAMPLE;
+	  b = (MAXJSAMPLE - b) * v[3] / MAXJSAMPLE;
+	}
+	break;
+      case JCS_CMYK:
+	/* Adobe inverted CMYK */
+	r = v[0] * v[3] / MAXJSAMPLE;
+	g = v[1] * v[3] / MAXJSAMPLE;
+	b = v[2] * v[3] / MAXJSAMPLE;
+	break;
+      case JCS_RGB:
+	r = v[0];
+	g = v[1];
+	b = v[2];
+	break;
+      default:			/* JCS_GRAYSCALE */
+	r = g = b = v[0];
+	break;
+      }
+      outptr[0] = (unsigned char) r;
+      outptr[1] = (unsigned char) g;
+      outptr[2] = (unsigned char) b;
+      outptr[3] = 0xFF;
+      outptr += 4;
+    }
+  }
+  return;
+}
 
-    /* Enable saving of extra markers that we want to copy */
-    jcopy_markers_setup(&srcinfo, copyoption);
+/* Added for ajpegtran
+ *  Perceptual hash from the DC coefficients, for ajpegtranhash() and
+ *  ajpegtranhashbatch().
+ *  The luminance of the blocks (the DC coefficients of the first component)
+ *  is reduced to HASH_SIZE x HASH_SIZE by area averaging, one block row at
+ *  a time.  The low frequencies of its DCT, except the first row and column,
+ *  are compared with their median to make the 64 bits of the hash (pHash).
+ */
+#define HASH_SIZE	32	/* size of the reduced image */
+#define HASH_FREQS	8	/* frequencies 1..8 of each direction */
+
+typedef struct {
+  JDIMENSION width, height;	/* luminance blocks */
+  double image[HASH_SIZE][HASH_SIZE]; /* reduced image */
+} dc_hash_state;
+
+/* cos(k*pi/64), k = 0..32 */
+static const double cos_64[33] = {
+  1.00000000000000000, 0.99879545620517241, 0.99518472667219693,
+  0.98917650996478101, 0.98078528040323043, 0.97003125319454397,
+  0.95694033573220882, 0.94154406518302081, 0.92387953251128674,
+  0.90398929312344334, 0.88192126434835505, 0.85772861000027212,
+  0.83146961230254524, 0.80320753148064494, 0.77301045336273699,
+  0.74095112535495911, 0.70710678118654757, 0.67155895484701833,
+  0.63439328416364549, 0.59569930449243347, 0.55557023301960229,
+  0.51410274419322166, 0.47139673682599781, 0.42755509343028220,
+  0.38268343236508984, 0.33688985339222005, 0.29028467725446233,
+  0.24298017990326398, 0.19509032201612833, 0.14673047445536175,
+  0.09801714032956077, 0.04906767432741813, 0.0
+};
+
+LOCAL(double)
+hash_cos (int k)
+/* cos(k*pi/64) for any k >= 0 */
+{
+  k &= 127;
+  if (k > 64)
+    k = 128 - k;
+  return (k > 32) ? -cos_64[64 - k] : cos_64[k];
+}
 
-    /* Read file header */
-    (void) jpeg_read_header(&srcinfo, TRUE);
+LOCAL(long)
+hash_overlap (JDIMENSION a0, JDIMENSION a1, JDIMENSION b0, JDIMENSION b1)
+/* Length of the intersection of [a0, a1) and [b0, b1) */
+{
+  return (long) (a1 < b1 ? a1 : b1) - (long) (a0 > b0 ? a0 : b0);
+}
 
-    /* Any space needed by a transform option must be requested before
+/**
+ * Add the luminance block rows of an iMCU row to the reduced image.
+ * rows points to the v_samp_factor block rows of the first component.
+ * A source block x covers [x*HASH_SIZE, (x+1)*HASH_SIZE) and a reduced
+ * pixel t covers [t*width, (t+1)*width), so the weights are integers.
+ * The quantization of DC is a common factor of all blocks, and not needed.
+ */
+LOCAL(void)
+hash_rows (dc_hash_state * state, j_decompress_ptr cinfo,
+	   JBLOCKARRAY rows, JDIMENSION row)
+{
+  jpeg_component_info *compptr = cinfo->comp_info;
+  double line[HASH_SIZE];
+  JDIMENSION x, y, t, last;
+  long overlap;
+  int offset_y, i;
+
+  for (offset_y = 0; offset_y < compptr->v_samp_factor; offset_y++) {
+    y = row * compptr->v_samp_factor + offset_y;
+    if (y >= state->height)
+      break;
+    for (i = 0; i < HASH_SIZE; i++)
+      line[i] = 0.0;
+    for (x = 0; x < state->width; x++) {
+      last = ((x + 1) * HASH_SIZE - 1) / state->width;
+      for (t = x * HASH_SIZE / state->width; t <= last; t++) {
+	overlap = hash_overlap(x * HASH_SIZE, (x + 1) * HASH_SIZE,
+			       t * state->width, (t + 1) * state->width);
+	line[t] += (double) rows[offset_y][x][0] * overlap;
+      }
+    }
+    last = ((y + 1) * HASH_SIZE - 1) / state->height;
+    for (t = y * HASH_SIZE / state->height; t <= last; t++) {
+      overlap = hash_overlap(y * HASH_SIZE, (y + 1) * HASH_SIZE,
+			     t * state->height, (t + 1) * state->height);
+      for (i = 0; i < HASH_SIZE; i++)
+	state->image[t][i] += line[i] * overlap;
+    }
+  }
+}
+
+/**
+ * Make the 64-bit hash from the reduced image.
+ * Bit 63 is frequency (1,1), then along the rows of the DCT.
+ */
+LOCAL(jlong)
+hash_finish (dc_hash_state * state)
+{
+  double tmp[HASH_FREQS][HASH_SIZE], freq[HASH_FREQS * HASH_FREQS];
+  double sorted[HASH_FREQS * HASH_FREQS], sum, median;
+  unsigned long long hash;
+  int u, v, i, j, n;
+
+  for (u = 0; u < HASH_FREQS; u++)
+    for (j = 0; j < HASH_SIZE; j++) {
+      sum = 0.0;
+      for (i = 0; i < HASH_SIZE; i++)
+	sum += hash_cos((2*i+1) * (u+1)) * state->image[i][j];
+      tmp[u][j] = sum;
+    }
+  for (u = 0; u < HASH_FREQS; u++)
+    for (v = 0; v < HASH_FREQS; v++) {
+      sum = 0.0;
+      for (j = 0; j < HASH_SIZE; j++)
+	sum += tmp[u][j] * hash_cos((2*j+1) * (v+1));
+      freq[u*HASH_FREQS+v] = sum;
+    }
+
+  /* Median by insertion sort, 64 values */
+  for (n = 0; n < HASH_FREQS * HASH_FREQS; n++) {
+    for (i = n; i > 0 && sorted[i-1] > freq[n]; i--)
+      sorted[i] = sorted[i-1];
+    sorted[i] = freq[n];
+  }
+  median = (sorted[n/2 - 1] + sorted[n/2]) / 2.0;
+
+  hash = 0;
+  for (n = 0; n < HASH_FREQS * HASH_FREQS; n++)
+    hash = (hash << 1) | (freq[n] > median ? 1 : 0);
+  return (jlong) hash;
+}
+
+/**
+ * Compute the perceptual hash of a JPEG file.
+ * cinfo is a created decompression object; errors are reported through
+ * its error manager.  Only the entropy decoding is done, and the AC values
+ * are skipped as ajpegtranpreview() does.  A single-scan file is decoded
+ * into a buffer of one iMCU row, and is not read after the last row.
+ * The object is aborted at the end, so it can be used for the next file.
+ */
+LOCAL(jlong)
+dc_hash (j_decompress_ptr cinfo, int fd)
+{
+  dc_hash_state state;
+  jvirt_barray_ptr * coef_arrays;
+  JBLOCKARRAY rows[MAX_COMPONENTS];
+  jpeg_component_info *compptr;
+  JDIMENSION row;
+  jlong hash;
+  int ci, i;
+
+  jpeg_stdio_src(cinfo, fd);
+  (void) jpeg_read_header(cinfo, TRUE);
+
+  /* The first component must be the luminance */
+  switch (cinfo->jpeg_color_space) {
+  case JCS_GRAYSCALE:
+  case JCS_YCbCr:
+  case JCS_BG_YCC:
+  case JCS_YCCK:
+    break;
+  default:
+    ERREXIT(cinfo, JERR_CONVERSION_NOTIMPL);
+  }
+
+  state.width = cinfo->comp_info[0].width_in_blocks;
+  state.height = cinfo->comp_info[0].height_in_blocks;
+  for (i = 0; i < HASH_SIZE; i++)
+    MEMZERO(state.image[i], SIZEOF(state.image[i]));
+
+  /* Only DC coefficients are needed */
+  for (ci = 0, compptr = cinfo->comp_info; ci < cinfo->num_components;
+       ci++, compptr++) {
+    compptr->DCT_h_scaled_size = 1;
+    compptr->DCT_v_scaled_size = 1;
+  }
+
+  if (! jpeg_has_multiple_scans(cinfo)) {
+    for (ci = 0, compptr = cinfo->comp_info; ci < cinfo->num_components;
+	 ci++, compptr++)
+      rows[ci] = (*cinfo->mem->alloc_barray)
+	((j_common_ptr) cinfo, JPOOL_IMAGE,
+	 (JDIMENSION) ((compptr->width_in_blocks + compptr->h_samp_factor - 1)
+		       / compptr->h_samp_factor * compptr->h_samp_factor),
+	 (JDIMENSION) compptr->v_samp_factor);
+    jpeg_start_coefficient_rows(cinfo, rows);
+    for (row = 0; row < cinfo->total_iMCU_rows; row++) {
+      if (jpeg_consume_input(cinfo) == JPEG_SUSPENDED)
+	ERREXIT(cinfo, JERR_INPUT_EOF);
+      hash_rows(&state, cinfo, rows[0], row);
+    }
+  } else {
+    /* A later scan may add to the coefficients of earlier ones */
+    coef_arrays = jpeg_read_coefficients(cinfo);
+    compptr = cinfo->comp_info;
+    for (row = 0; row < cinfo->total_iMCU_rows; row++)
+      hash_rows(&state, cinfo, (*cinfo->mem->access_virt_barray)
+		((j_common_ptr) cinfo, coef_arrays[0],
+		 row * compptr->v_samp_factor,
+		 (JDIMENSION) compptr->v_samp_factor, FALSE), row);
+  }
+
+  hash = hash_finish(&state);
+  jpeg_abort_decompress(cinfo);
+  return hash;
+}
+
+#define OPTTEMP_SIZE 1024	/* enough for a long '-scans' script */
+
+#ifdef C_PARALLEL_SUPPORTED
+/* Added for ajpegtran
+ *  Trial encoding for extension function, '-smallest'.
+ *  The transformed coefficient arrays are entropy coded with several
+ *  configurations in parallel, each into its own memory buffer, and only
+ *  the smallest result is written to the output file.  Decoding and
+ *  transformation are done only once; every trial is a separate compression
+ *  object reading the same (by then read-only) coefficient arrays.
+ *  Each trial has its own error manager, so a failed trial is just dropped.
+ */
+
+/* Entropy coding modes tried in addition to the requested one */
+#define TRIAL_REQUESTED		0	/* options as given */
+#define TRIAL_OPTIMIZE		1	/* sequential, optimized Huffman */
+#define TRIAL_PROGRESSIVE	2	/* jpeg_simple_progression, Huffman */
+#define TRIAL_SEARCH		3	/* searched script, Huffman */
+#define TRIAL_ARITH		4	/* sequential, arithmetic */
+#define TRIAL_ARITH_PROGRESSIVE	5	/* jpeg_simple_progression, arithmetic */
+
+static const int trial_modes[] = {
+  TRIAL_REQUESTED,
+#ifdef ENTROPY_OPT_SUPPORTED
+  TRIAL_OPTIMIZE,
+#endif
+#ifdef C_PROGRESSIVE_SUPPORTED
+  TRIAL_PROGRESSIVE,
+  TRIAL_SEARCH,
+#endif
+#ifdef C_ARITH_CODING_SUPPORTED
+  TRIAL_ARITH,
+#ifdef C_PROGRESSIVE_SUPPORTED
+  TRIAL_ARITH_PROGRESSIVE,
+#endif
+#endif
+};
+
+#define NUM_TRIALS  (SIZEOF(trial_modes) / SIZEOF(trial_modes[0]))
+
+typedef struct {
+  struct jpeg_error_mgr pub;	/* "public" fields */
+  jmp_buf setjmp_buffer;	/* for return from a failed trial */
+  char message[JMSG_LENGTH_MAX]; /* error message of the trial */
+} trial_error_mgr;
+
+typedef struct {
+  j_compress_ptr cinfo;		/* compression object of the trial */
+  trial_error_mgr err;		/* private error manager */
+  unsigned char * outbuffer;	/* output of jpeg_mem_dest */
+  unsigned long outsize;
+  boolean ready;		/* set up, ready for jpeg_finish_compress */
+  boolean ok;			/* finished without error */
+  boolean started;		/* running on its own thread */
+  pthread_t thread;
+} trial_info;
+
+/* Kept outside of the entry function so that they survive longjmp */
+static trial_info trials[NUM_TRIALS];
+static struct jpeg_compress_struct trialinfo[NUM_TRIALS];
+static int num_trials;
+
+METHODDEF(noreturn_t)
+trial_error_exit (j_common_ptr cinfo)
+{
+  trial_error_mgr * err = (trial_error_mgr *) cinfo->err;
+
+  /* Keep the message in the trial, errmsgbuffer is not touched */
+  (*cinfo->err->format_message) (cinfo, err->message);
+  longjmp(err->setjmp_buffer, 1);
+}
+
+METHODDEF(void)
+trial_output_message (j_common_ptr cinfo)
+{
+  /* Warnings of a trial are not reported */
+}
+
+LOCAL(void)
+trial_init_error (trial_info * trial)
+{
+  jpeg_std_error(&trial->err.pub);
+  trial->err.pub.error_exit = trial_error_exit;
+  trial->err.pub.output_message = trial_output_message;
+  trial->err.message[0] = '\0';
+}
+
+LOCAL(void)
+trial_select_mode (j_compress_ptr cinfo, int mode)
+/* Override the entropy coding parameters for one trial */
+{
+  switch (mode) {
+  case TRIAL_OPTIMIZE:
+    cinfo->arith_code = FALSE;
+    cinfo->optimize_coding = TRUE;
+    cinfo->scan_info = NULL;
+    cinfo->num_scans = 0;
+    break;
+#ifdef C_PROGRESSIVE_SUPPORTED
+  case TRIAL_PROGRESSIVE:
+    cinfo->arith_code = FALSE;
+    jpeg_simple_progression(cinfo);
+    cinfo->optimize_scans = FALSE;
+    break;
+  case TRIAL_SEARCH:
+    cinfo->arith_code = FALSE;
+    jpeg_simple_progression(cinfo);
+    cinfo->optimize_scans = TRUE;
+    break;
+#endif
+#ifdef C_ARITH_CODING_SUPPORTED
+  case TRIAL_ARITH:
+    cinfo->arith_code = TRUE;
+    cinfo->scan_info = NULL;
+    cinfo->num_scans = 0;
+    break;
+#ifdef C_PROGRESSIVE_SUPPORTED
+  case TRIAL_ARITH_PROGRESSIVE:
+    cinfo->arith_code = TRUE;
+    jpeg_simple_progression(cinfo);
+    break;
+#endif
+#endif
+  default:
+    break;
+  }
+}
+
+static void *
+trial_thread (void * arg)
+{
+  trial_info * trial = (trial_info *) arg;
+
+  if (setjmp(trial->err.setjmp_buffer) == 0) {
+    jpeg_finish_compress(trial->cinfo);
+    trial->ok = TRUE;
+  }
+  return NULL;
+}
+
+/**
+ * Set up the destination object as the first trial.
+ * This must be called instead of jpeg_stdio_dest.
+ */
+LOCAL(void)
+smallest_setup (j_compress_ptr dstinfo)
+{
+  trial_info * trial = &trials[0];
+
+  trial->cinfo = dstinfo;
+  trial->outbuffer = NULL;
+  trial->outsize = 0;
+  trial->ready = TRUE;
+  trial->ok = FALSE;
+  trial->started = FALSE;
+  num_trials = 1;
+  jpeg_mem_dest(dstinfo, &trial->outbuffer, &trial->outsize);
+}
+
+/**
+ * Run all trials and write the smallest output to wfd.
+ * This is called instead of jpeg_finish_compress, after the
+ * transformation has been executed.
+ */
+LOCAL(void)
+smallest_compress (j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+		   jvirt_barray_ptr * src_coef_arrays,
+		   const char * options, int wfd)
+{
+  char opttemp[OPTTEMP_SIZE];
+  jvirt_barray_ptr * coef_arrays;
+  struct jpeg_error_mgr * dsterr;
+  trial_info * trial;
+  j_compress_ptr cinfo;
+  unsigned char * data;
+  unsigned long left;
+  ssize_t written;
+  int i, best;
+
+  /* Create the other trials on this thread, since parse_switches uses strtok.
+   * They get the same parameters as the destination object before their
+   * entropy coding mode is overridden.
+   */
+  for (i = 1; i < (int) NUM_TRIALS; i++) {
+    trial = &trials[i];
+    cinfo = &trialinfo[i];
+    trial->cinfo = cinfo;
+    trial->outbuffer = NULL;
+    trial->outsize = 0;
+    trial->ready = FALSE;
+    trial->ok = FALSE;
+    trial->started = FALSE;
+    trial_init_error(trial);
+    cinfo->err = &trial->err.pub;
+    cinfo->mem = NULL;		/* so jpeg_destroy knows nothing to free */
+    num_trials = i + 1;
+    if (baseline && trial_modes[i] != TRIAL_OPTIMIZE)
+      continue;			/* not a baseline output */
+    if (setjmp(trial->err.setjmp_buffer)) {
+      LOGD("trial %d: %s", i, trial->err.message);
+      continue;			/* drop this trial */
+    }
+    jpeg_create_compress(cinfo);
+    jpeg_copy_critical_parameters(srcinfo, cinfo);
+    coef_arrays = jtransform_adjust_parameters(srcinfo, cinfo,
+					       src_coef_arrays,
+					       &transformoption);
+    strcpy(opttemp, options);
+    (void) parse_switches(cinfo, opttemp, 0, TRUE);
+    trial_select_mode(cinfo, trial_modes[i]);
+    jpeg_mem_dest(cinfo, &trial->outbuffer, &trial->outsize);
+    jpeg_write_coefficients(cinfo, coef_arrays);
+    jcopy_markers_execute(srcinfo, cinfo, copyoption);
+    trial->ready = TRUE;
+  }
+
+  /* Run the trials.  The destination object runs on this thread;
+   * a trial whose thread can't be created runs here too.
+   */
+  trial_init_error(&trials[0]);
+  dsterr = dstinfo->err;
+  dstinfo->err = &trials[0].err.pub;
+  for (i = 1; i < num_trials; i++) {
+    trial = &trials[i];
+    if (!trial->ready)
+      continue;
+    trial->started =
+      (pthread_create(&trial->thread, NULL, trial_thread, trial) == 0);
+  }
+  (void) trial_thread(&trials[0]);
+  for (i = 1; i < num_trials; i++) {
+    trial = &trials[i];
+    if (trial->started)
+      pthread_join(trial->thread, NULL);
+    else if (trial->ready)
+      (void) trial_thread(trial);
+  }
+  dstinfo->err = dsterr;
+
+  /* Pick the smallest output */
+  best = -1;
+  for (i = 0; i < num_trials; i++) {
+    trial = &trials[i];
+    LOGD("trial %d: %s %lu", i, trial->ok ? "OK" : "NG", trial->outsize);
+    if (trial->ok && (best < 0 || trial->outsize < trials[best].outsize))
+      best = i;
+  }
+  if (best < 0) {
+    /* Report the failure of the requested configuration */
+    strcpy(errmsgbuffer, trials[0].err.message);
+    longjmp(jbuf,1);
+  }
+
+  /* Write it out */
+  data = trials[best].outbuffer;
+  left = trials[best].outsize;
+  while (left > 0) {
+    written = write(wfd, data, left);
+    if (written <= 0)
+      ERREXIT(dstinfo, JERR_FILE_WRITE);
+    data += written;
+    left -= (unsigned long) written;
+  }
+}
+
+/**
+ * Release all trials and their output buffers.
+ */
+LOCAL(void)
+smallest_release (void)
+{
+  int i;
+
+  for (i = 0; i < num_trials; i++) {
+    if (i > 0)
+      jpeg_destroy_compress(&trialinfo[i]);
+    if (trials[i].outbuffer != NULL)
+      free(trials[i].outbuffer);
+    trials[i].outbuffer = NULL;
+  }
+  num_trials = 0;
+}
+#endif /* C_PARALLEL_SUPPORTED */
+
+/* Added for ajpegtran
+ *  Images for extension function, '-drop'.
+ *  An Android application can't pass a file path, so the images are given
+ *  by file descriptors in the option string.  Each image has a
+ *  decompression object and an error manager of its own, so that it can be
+ *  read on a thread while the source image is read.
+ */
+
+typedef struct {
+  struct jpeg_error_mgr pub;	/* "public" fields */
+  jmp_buf setjmp_buffer;	/* for return from a failed read */
+  char message[JMSG_LENGTH_MAX]; /* error message of the read */
+} drop_error_mgr;
+
+typedef struct {
+  struct jpeg_decompress_struct dinfo;
+  drop_error_mgr err;		/* private error manager */
+  jvirt_barray_ptr * coef_arrays; /* from jpeg_read_coefficients */
+  boolean ok;			/* coefficients read without error */
+#ifdef C_PARALLEL_SUPPORTED
+  boolean started;		/* reading on its own thread */
+  pthread_t thread;
+#endif
+} drop_source;
+
+/* Kept outside of the entry function so that they survive longjmp */
+static drop_source drop_sources[JMAX_DROP_IMAGES];
+static int num_drop_sources;
+
+METHODDEF(noreturn_t)
+drop_error_exit (j_common_ptr cinfo)
+{
+  drop_error_mgr * err = (drop_error_mgr *) cinfo->err;
+
+  /* Keep the message in the image, errmsgbuffer is not touched */
+  (*cinfo->err->format_message) (cinfo, err->message);
+  longjmp(err->setjmp_buffer, 1);
+}
+
+METHODDEF(void)
+drop_output_message (j_common_ptr cinfo)
+{
+  /* Warnings of a dropped image are not reported */
+}
+
+/**
+ * Open the images to drop and read their headers.
+ * This must be called before jtransform_request_workspace.
+ */
+LOCAL(void)
+drop_setup (j_decompress_ptr srcinfo)
+{
+  drop_source * drop;
+  int i;
+
+  for (i = 0; i < transformoption.num_drops; i++) {
+    drop = &drop_sources[i];
+    drop->coef_arrays = NULL;
+    drop->ok = FALSE;
+#ifdef C_PARALLEL_SUPPORTED
+    drop->started = FALSE;
+#endif
+    jpeg_std_error(&drop->err.pub);
+    drop->err.pub.error_exit = drop_error_exit;
+    drop->err.pub.output_message = drop_output_message;
+    drop->err.message[0] = '\0';
+    drop->dinfo.err = &drop->err.pub;
+    if (setjmp(drop->err.setjmp_buffer)) {
+      strcpy(errmsgbuffer, drop->err.message);
+      longjmp(jbuf, 1);
+    }
+    jpeg_create_decompress(&drop->dinfo);
+    num_drop_sources = i + 1;
+    drop->dinfo.mem->max_memory_to_use = srcinfo->mem->max_memory_to_use;
+    jpeg_stdio_src(&drop->dinfo, transformoption.drops[i].source);
+    (void) jpeg_read_header(&drop->dinfo, TRUE);
+    transformoption.drops[i].drop_ptr = &drop->dinfo;
+  }
+}
+
+static void *
+drop_read_thread (void * arg)
+{
+  drop_source * drop = (drop_source *) arg;
+
+  if (setjmp(drop->err.setjmp_buffer) == 0) {
+    drop->coef_arrays = jpeg_read_coefficients(&drop->dinfo);
+    drop->ok = TRUE;
+  }
+  return NULL;
+}
+
+/**
+ * Start reading the coefficients of the images to drop on threads.
+ * Without threads, they are read by drop_finish_read.
+ */
+LOCAL(void)
+drop_start_read (void)
+{
+#ifdef C_PARALLEL_SUPPORTED
+  drop_source * drop;
+  int i;
+
+  for (i = 0; i < num_drop_sources; i++) {
+    drop = &drop_sources[i];
+    drop->started =
+      (pthread_create(&drop->thread, NULL, drop_read_thread, drop) == 0);
+  }
+#endif
+}
+
+/**
+ * Wait for the images to drop, and pass their coefficients to the
+ * transformation.  An error of an image is reported as the error of
+ * the whole operation.
+ */
+LOCAL(void)
+drop_finish_read (void)
+{
+  drop_source * drop;
+  int i;
+
+  for (i = 0; i < num_drop_sources; i++) {
+    drop = &drop_sources[i];
+#ifdef C_PARALLEL_SUPPORTED
+    if (drop->started) {
+      pthread_join(drop->thread, NULL);
+      drop->started = FALSE;
+    } else
+#endif
+    (void) drop_read_thread(drop);
+  }
+  for (i = 0; i < num_drop_sources; i++) {
+    drop = &drop_sources[i];
+    if (!drop->ok) {
+      strcpy(errmsgbuffer, drop->err.message);
+      longjmp(jbuf, 1);
+    }
+    transformoption.drops[i].drop_coef_arrays = drop->coef_arrays;
+  }
+}
+
+/**
+ * Release the images to drop, and close all files given by '-drop'
+ * like the input and output files.
+ */
+LOCAL(void)
+drop_release (void)
+{
+  int i;
+
+  for (i = 0; i < num_drop_sources; i++) {
+#ifdef C_PARALLEL_SUPPORTED
+    if (drop_sources[i].started)
+      pthread_join(drop_sources[i].thread, NULL);
+#endif
+    jpeg_destroy_decompress(&drop_sources[i].dinfo);
+  }
+  num_drop_sources = 0;
+  for (i = 0; i < transformoption.num_drops; i++)
+    close(transformoption.drops[i].source);
+  transformoption.num_drops = 0;
+}
+
+/* Added for ajpegtran
+ *  Tiles for extension function, '-tile'.
+ *  The source image is read once, and each tile is coded by a compression
+ *  object into a file of the directory given by wfd.  The workers take the
+ *  next tile from a shared counter, so only one tile per worker is held in
+ *  memory.  Each worker has its own compression object and error manager;
+ *  the source arrays are only read by them.
+ */
+
+#define TILE_LEVELS		4	/* full size, 1/2, 1/4 and 1/8 */
+#define DEFAULT_TILE_THREADS	4	/* without '-threads' */
+
+/* jdiv_round_up for JDIMENSION, jpegint.h is not included here */
+#define TILE_DIV_ROUND_UP(a,b)	\
+  ((JDIMENSION) (((a) + (JDIMENSION) (b) - 1) / (JDIMENSION) (b)))
+
+typedef struct {
+  struct jpeg_error_mgr pub;	/* "public" fields */
+  jmp_buf setjmp_buffer;	/* for return from a failed tile */
+  char message[JMSG_LENGTH_MAX]; /* error message of the tile */
+} tile_error_mgr;
+
+typedef struct {
+  struct jpeg_compress_struct cinfo;
+  tile_error_mgr err;		/* private error manager */
+  int fd;			/* file of the current tile, or -1 */
+#ifdef C_PARALLEL_SUPPORTED
+  boolean started;		/* running on its own thread */
+  pthread_t thread;
+#endif
+} tile_worker;
+
+/* Kept outside of the entry function so that they survive longjmp */
+static tile_worker tile_workers[MAX_THREADS];
+static int num_tile_workers;
+
+/* Shared by the workers, read only while they run */
+static j_decompress_ptr tile_srcinfo;
+static j_compress_ptr tile_params;	/* parsed compression parameters */
+static jvirt_barray_ptr * tile_coef_arrays;
+static int tile_dir;
+static int tile_levels;
+static JDIMENSION tile_level_width[TILE_LEVELS];
+static JDIMENSION tile_level_height[TILE_LEVELS];
+static JDIMENSION tile_cols[TILE_LEVELS];
+static JDIMENSION tile_rows[TILE_LEVELS];
+
+/* Progress of the workers, under tile_mutex */
+static long tile_next;
+static long tile_count;
+static boolean tile_failed;
+static char tile_message[JMSG_LENGTH_MAX];
+#ifdef C_PARALLEL_SUPPORTED
+static pthread_mutex_t tile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+METHODDEF(noreturn_t)
+tile_error_exit (j_common_ptr cinfo)
+{
+  tile_error_mgr * err = (tile_error_mgr *) cinfo->err;
+
+  /* Keep the message in the worker, errmsgbuffer is not touched */
+  (*cinfo->err->format_message) (cinfo, err->message);
+  longjmp(err->setjmp_buffer, 1);
+}
+
+METHODDEF(void)
+tile_output_message (j_common_ptr cinfo)
+{
+  /* Warnings of a tile are not reported */
+}
+
+/**
+ * Code one tile into "<level>_<column>_<row>.jpg" of the directory.
+ * Level 0 is the full size image, level 1 is 1/2, and so on.
+ */
+LOCAL(void)
+tile_compress (tile_worker * worker, long index)
+{
+  j_compress_ptr cinfo = &worker->cinfo;
+  jvirt_barray_ptr coef_arrays[MAX_COMPONENTS];
+  jpeg_component_info *compptr;
+  JDIMENSION col, row, x, y, width_in_iMCUs, height_in_iMCUs;
+  char name[64];
+  int level, ci;
+
+  for (level = 0; index >= (long) tile_cols[level] * tile_rows[level];
+       level++)
+    index -= (long) tile_cols[level] * tile_rows[level];
+  col = (JDIMENSION) (index % tile_cols[level]);
+  row = (JDIMENSION) (index / tile_cols[level]);
+  x = col * tile_width;
+  y = row * tile_height;
+
+  /* Same parameters as the output of the whole image */
+  jpeg_copy_critical_parameters(tile_srcinfo, cinfo);
+  if (transformoption.num_components == 1) {
+    cinfo->comp_info[0].h_samp_factor = 1;
+    cinfo->comp_info[0].v_samp_factor = 1;
+  }
+  cinfo->jpeg_width = tile_level_width[level] - x;
+  if (cinfo->jpeg_width > tile_width)
+    cinfo->jpeg_width = tile_width;
+  cinfo->jpeg_height = tile_level_height[level] - y;
+  if (cinfo->jpeg_height > tile_height)
+    cinfo->jpeg_height = tile_height;
+  cinfo->write_JFIF_header = tile_params->write_JFIF_header;
+  cinfo->optimize_coding = tile_params->optimize_coding;
+  cinfo->arith_code = tile_params->arith_code;
+  cinfo->scan_info = tile_params->scan_info;
+  cinfo->num_scans = tile_params->num_scans;
+  cinfo->optimize_scans = tile_params->optimize_scans;
+  cinfo->restart_interval = tile_params->restart_interval;
+  cinfo->restart_in_rows = tile_params->restart_in_rows;
+
+  /* Arrays of the tile, in iMCUs like the workspace of a crop */
+  width_in_iMCUs = TILE_DIV_ROUND_UP(cinfo->jpeg_width,
+				     transformoption.iMCU_sample_width);
+  height_in_iMCUs = TILE_DIV_ROUND_UP(cinfo->jpeg_height,
+				      transformoption.iMCU_sample_height);
+  for (ci = 0; ci < cinfo->num_components; ci++) {
+    compptr = cinfo->comp_info + ci;
+    coef_arrays[ci] = (*cinfo->mem->request_virt_barray)
+      ((j_common_ptr) cinfo, JPOOL_IMAGE, FALSE,
+       width_in_iMCUs * (JDIMENSION) compptr->h_samp_factor,
+       height_in_iMCUs * (JDIMENSION) compptr->v_samp_factor,
+       (JDIMENSION) compptr->v_samp_factor);
+  }
+
+  sprintf(name, "%d_%u_%u.jpg", level, (unsigned int) col, (unsigned int) row);
+  worker->fd = openat(tile_dir, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (worker->fd < 0) {
+    sprintf(worker->err.message, "Write error:can't create %s", name);
+    longjmp(worker->err.setjmp_buffer, 1);
+  }
+  jpeg_stdio_dest(cinfo, worker->fd);
+  jpeg_write_coefficients(cinfo, coef_arrays);
+  jcopy_markers_execute(tile_srcinfo, cinfo, copyoption);
+  jtransform_execute_tile(tile_srcinfo, cinfo, tile_coef_arrays, coef_arrays,
+			  x / transformoption.iMCU_sample_width,
+			  y / transformoption.iMCU_sample_height, 1 << level);
+  jpeg_finish_compress(cinfo);
+  close(worker->fd);
+  worker->fd = -1;
+}
+
+static void *
+tile_thread (void * arg)
+{
+  tile_worker * worker = (tile_worker *) arg;
+  long index;
+
+  for (;;) {
+#ifdef C_PARALLEL_SUPPORTED
+    pthread_mutex_lock(&tile_mutex);
+#endif
+    index = (tile_failed || tile_next >= tile_count) ? -1 : tile_next++;
+#ifdef C_PARALLEL_SUPPORTED
+    pthread_mutex_unlock(&tile_mutex);
+#endif
+    if (index < 0)
+      break;
+    if (setjmp(worker->err.setjmp_buffer)) {
+      /* Stop all workers, and report the first error */
+      jpeg_abort_compress(&worker->cinfo);
+      if (worker->fd >= 0)
+	close(worker->fd);
+      worker->fd = -1;
+#ifdef C_PARALLEL_SUPPORTED
+      pthread_mutex_lock(&tile_mutex);
+#endif
+      if (!tile_failed)
+	strcpy(tile_message, worker->err.message);
+      tile_failed = TRUE;
+#ifdef C_PARALLEL_SUPPORTED
+      pthread_mutex_unlock(&tile_mutex);
+#endif
+      break;
+    }
+    tile_compress(worker, index);
+  }
+  return NULL;
+}
+
+/**
+ * Code all tiles of the transformed source arrays into the directory dirfd.
+ * dstinfo has the compression parameters given by the options.
+ * This is called instead of jpeg_write_coefficients and
+ * jpeg_finish_compress.
+ */
+LOCAL(void)
+tile_compress_all (j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+		   jvirt_barray_ptr * src_coef_arrays, int dirfd)
+{
+  tile_worker * worker;
+  int i, level, scale, num_workers;
+
+  tile_srcinfo = srcinfo;
+  tile_params = dstinfo;
+  tile_coef_arrays = src_coef_arrays;
+  tile_dir = dirfd;
+  tile_levels = tile_pyramid ? TILE_LEVELS : 1;
+  tile_count = 0;
+  for (level = 0; level < TILE_LEVELS; level++) {
+    scale = 1 << level;
+    tile_level_width[level] =
+      TILE_DIV_ROUND_UP(transformoption.output_width, scale);
+    tile_level_height[level] =
+      TILE_DIV_ROUND_UP(transformoption.output_height, scale);
+    tile_cols[level] = tile_rows[level] = 0;
+    if (level < tile_levels) {
+      tile_cols[level] = TILE_DIV_ROUND_UP(tile_level_width[level], tile_width);
+      tile_rows[level] = TILE_DIV_ROUND_UP(tile_level_height[level], tile_height);
+    }
+    tile_count += (long) tile_cols[level] * tile_rows[level];
+  }
+  tile_next = 0;
+  tile_failed = FALSE;
+  tile_message[0] = '\0';
+
+#ifdef C_PARALLEL_SUPPORTED
+  num_workers = dstinfo->num_threads > 1 ?
+		dstinfo->num_threads : DEFAULT_TILE_THREADS;
+  if ((long) num_workers > tile_count)
+    num_workers = (int) tile_count;
+#else
+  num_workers = 1;
+#endif
+
+  /* Create the workers on this thread */
+  for (i = 0; i < num_workers; i++) {
+    worker = &tile_workers[i];
+    worker->fd = -1;
+#ifdef C_PARALLEL_SUPPORTED
+    worker->started = FALSE;
+#endif
+    jpeg_std_error(&worker->err.pub);
+    worker->err.pub.error_exit = tile_error_exit;
+    worker->err.pub.output_message = tile_output_message;
+    worker->err.message[0] = '\0';
+    worker->cinfo.err = &worker->err.pub;
+    if (setjmp(worker->err.setjmp_buffer)) {
+      strcpy(errmsgbuffer, worker->err.message);
+      longjmp(jbuf, 1);
+    }
+    jpeg_create_compress(&worker->cinfo);
+    num_tile_workers = i + 1;
+    worker->cinfo.mem->max_memory_to_use = dstinfo->mem->max_memory_to_use;
+  }
+
+  /* Run the workers.  The first one runs on this thread;
+   * a worker whose thread can't be created is not used.
+   */
+#ifdef C_PARALLEL_SUPPORTED
+  for (i = 1; i < num_tile_workers; i++) {
+    worker = &tile_workers[i];
+    worker->started =
+      (pthread_create(&worker->thread, NULL, tile_thread, worker) == 0);
+  }
+#endif
+  (void) tile_thread(&tile_workers[0]);
+#ifdef C_PARALLEL_SUPPORTED
+  for (i = 1; i < num_tile_workers; i++) {
+    worker = &tile_workers[i];
+    if (worker->started)
+      pthread_join(worker->thread, NULL);
+    worker->started = FALSE;
+  }
+#endif
+
+  if (tile_failed) {
+    strcpy(errmsgbuffer, tile_message);
+    longjmp(jbuf, 1);
+  }
+}
+
+/**
+ * Release the workers of '-tile'.
+ */
+LOCAL(void)
+tile_release (void)
+{
+  int i;
+
+  for (i = 0; i < num_tile_workers; i++) {
+#ifdef C_PARALLEL_SUPPORTED
+    if (tile_workers[i].started)
+      pthread_join(tile_workers[i].thread, NULL);
+#endif
+    jpeg_destroy_compress(&tile_workers[i].cinfo);
+  }
+  num_tile_workers = 0;
+}
+
+/* Added for ajpegtran
+ *  Workers for ajpegtranhashbatch().
+ *  Each worker has a decompression object, used for one file after another,
+ *  with the error manager of the images to drop, so a failed file doesn't
+ *  stop the others.  The workers take the next file from a shared counter.
+ */
+
+#define DEFAULT_HASH_THREADS	4
+
+typedef struct {
+  struct jpeg_decompress_struct dinfo;
+  drop_error_mgr err;		/* private error manager */
+#ifdef C_PARALLEL_SUPPORTED
+  boolean started;		/* running on its own thread */
+  pthread_t thread;
+#endif
+} hash_worker;
+
+/* Kept outside of the entry function so that they survive longjmp */
+static hash_worker hash_workers[DEFAULT_HASH_THREADS];
+static int num_hash_workers;
+
+/* Shared by the workers */
+static const jint * hash_fds;
+static jlong * hash_values;
+static int hash_next;
+static int hash_count;
+static int hash_failed;		/* index of the first failed file, or -1 */
+static char hash_message[JMSG_LENGTH_MAX];
+#ifdef C_PARALLEL_SUPPORTED
+static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void *
+hash_thread (void * arg)
+{
+  hash_worker * worker = (hash_worker *) arg;
+  int index;
+
+  for (;;) {
+#ifdef C_PARALLEL_SUPPORTED
+    pthread_mutex_lock(&hash_mutex);
+#endif
+    index = (hash_next < hash_count) ? hash_next++ : -1;
+#ifdef C_PARALLEL_SUPPORTED
+    pthread_mutex_unlock(&hash_mutex);
+#endif
+    if (index < 0)
+      break;
+    if (setjmp(worker->err.setjmp_buffer)) {
+      /* Keep the message of the first failed file */
+      jpeg_abort_decompress(&worker->dinfo);
+      hash_values[index] = 0;
+#ifdef C_PARALLEL_SUPPORTED
+      pthread_mutex_lock(&hash_mutex);
+#endif
+      if (hash_failed < 0 || index < hash_failed) {
+	hash_failed = index;
+	strcpy(hash_message, worker->err.message);
+      }
+#ifdef C_PARALLEL_SUPPORTED
+      pthread_mutex_unlock(&hash_mutex);
+#endif
+    } else
+      hash_values[index] = dc_hash(&worker->dinfo, hash_fds[index]);
+    close(hash_fds[index]);
+  }
+  return NULL;
+}
+
+/**
+ * Compute the hashes of count files on the workers.
+ * Failed files get 0; the index and the message of the first one are
+ * set to errmsgbuffer, otherwise "OK".
+ */
+LOCAL(void)
+hash_compute_all (const jint * fds, jlong * values, int count)
+{
+  hash_worker * worker;
+  int i, num_workers;
+
+  hash_fds = fds;
+  hash_values = values;
+  hash_next = 0;
+  hash_count = count;
+  hash_failed = -1;
+  hash_message[0] = '\0';
+
+#ifdef C_PARALLEL_SUPPORTED
+  num_workers = DEFAULT_HASH_THREADS;
+  if (num_workers > count)
+    num_workers = count;
+#else
+  num_workers = 1;
+#endif
+
+  /* Create the workers on this thread */
+  for (i = 0; i < num_workers; i++) {
+    worker = &hash_workers[i];
+#ifdef C_PARALLEL_SUPPORTED
+    worker->started = FALSE;
+#endif
+    jpeg_std_error(&worker->err.pub);
+    worker->err.pub.error_exit = drop_error_exit;
+    worker->err.pub.output_message = drop_output_message;
+    worker->err.message[0] = '\0';
+    worker->dinfo.err = &worker->err.pub;
+    if (setjmp(worker->err.setjmp_buffer)) {
+      strcpy(errmsgbuffer, worker->err.message);
+      longjmp(jbuf, 1);
+    }
+    jpeg_create_decompress(&worker->dinfo);
+    num_hash_workers = i + 1;
+    worker->dinfo.mem->max_memory_to_use = 0;
+  }
+
+  /* Run the workers.  The first one runs on this thread;
+   * a worker whose thread can't be created is not used.
+   */
+#ifdef C_PARALLEL_SUPPORTED
+  for (i = 1; i < num_hash_workers; i++) {
+    worker = &hash_workers[i];
+    worker->started =
+      (pthread_create(&worker->thread, NULL, hash_thread, worker) == 0);
+  }
+#endif
+  (void) hash_thread(&hash_workers[0]);	/* returns at once for no file */
+#ifdef C_PARALLEL_SUPPORTED
+  for (i = 1; i < num_hash_workers; i++) {
+    worker = &hash_workers[i];
+    if (worker->started)
+      pthread_join(worker->thread, NULL);
+    worker->started = FALSE;
+  }
+#endif
+
+  if (hash_failed >= 0)
+    snprintf(errmsgbuffer, JMSG_LENGTH_MAX, "%d:%s", hash_failed,
+	     hash_message);
+  else
+    strcpy(errmsgbuffer, "OK");
+}
+
+/**
+ * Release the workers of ajpegtranhashbatch().
+ */
+LOCAL(void)
+hash_release (void)
+{
+  int i;
+
+  for (i = 0; i < num_hash_workers; i++) {
+#ifdef C_PARALLEL_SUPPORTED
+    if (hash_workers[i].started)
+      pthread_join(hash_workers[i].thread, NULL);
+#endif
+    jpeg_destroy_decompress(&hash_workers[i].dinfo);
+  }
+  num_hash_workers = 0;
+}
+
+/**
+ * ajpegtran main entry.
+ *
+ * Execute Jpegtran.
+ */
+JNIEXPORT jstring JNICALL
+Java_github_kamemak_ajpegtran_1example_MainActivity_ajpegtran( JNIEnv* env,
+                                         jobject thiz,
+                                         jint rfd,
+                                         jint wfd,
+                                         jstring jOptions
+                                                  )
+{
+  struct jpeg_decompress_struct srcinfo;
+  struct jpeg_compress_struct dstinfo;
+  struct jpeg_error_mgr jsrcerr, jdsterr;
+#ifdef PROGRESS_REPORT
+  struct cdjpeg_progress_mgr progress;
+#endif
+  jvirt_barray_ptr * src_coef_arrays;
+  jvirt_barray_ptr * dst_coef_arrays;
+  /* We assume all-in-memory processing and can therefore use only a
+   * single file pointer for sequential input and output operation. 
+   */
+  boolean simple_progressive = FALSE;
+  boolean stream;
+  struct stat rstat;
+
+  const char* filePath;
+  const char* optstr;
+  char opttemp[OPTTEMP_SIZE];
+  char optsaved[OPTTEMP_SIZE];
+  int parseResult;
+
+  /* Note for ajpegtran
+   *  Clear variables for extension functions.
+   */
+  monochrome = 0;
+  smallest = FALSE;
+  baseline = FALSE;
+  restart_given = FALSE;
+  coeff_adj = 0;
+  requant_quality = 0;
+  color_adj = FALSE;
+  contrast_factor = 1.0;
+  saturation_factor = 1.0;
+  tile_width = 0;
+  tile_height = 0;
+  tile_pyramid = FALSE;
+  coeff_offset[0] = 0;
+  coeff_offset[1] = 0;
+  coeff_offset[2] = 0;
+  coeff_offset[3] = 0;
+  errmsgbuffer[0]='\0';
+
+  /* Note for ajpegtran
+   *  Clear errno to get I/O error.
+   */
+  errno = 0;
+
+  /* To handle a error, setjmp is used. */
+  if ( setjmp( jbuf ) == 0 ) {
+    /* Initialize the JPEG decompression object with default error handling. */
+    srcinfo.err = jpeg_std_error(&jsrcerr);
+    jpeg_create_decompress(&srcinfo);
+    /* Initialize the JPEG compression object with default error handling. */
+    dstinfo.err = jpeg_std_error(&jdsterr);
+    jpeg_create_compress(&dstinfo);
+
+    /* Now safe to enable signal catcher.
+     * Note: we assume only the decompression object will have virtual arrays.
+     */
+#ifdef NEED_SIGNAL_CATCHER
+    enable_signal_catcher((j_common_ptr) &srcinfo);
+#endif
+
+    /* Scan command line to find file names.
+     * It is convenient to use just one switch-parsing routine, but the switch
+     * values read here are mostly ignored; we will rescan the switches after
+     * opening the input file.  Also note that most of the switches affect the
+     * destination JPEG object, so we parse into that and then copy over what
+     * needs to affects the source too.
+     */
+    optstr = (*env)->GetStringUTFChars(env, jOptions, NULL);
+    if (!optstr||OPTTEMP_SIZE<=strlen(optstr)) {
+      (*env)->ReleaseStringUTFChars(env, jOptions, optstr);
+      strcpy(errmsgbuffer,"Argument error");
+      longjmp(jbuf,1);
+    }
+    strcpy(opttemp,optstr);
+    strcpy(optsaved,optstr);	/* strtok destroys opttemp */
+    parseResult = parse_switches(&dstinfo, opttemp, 0, FALSE);
+    (*env)->ReleaseStringUTFChars(env, jOptions, optstr);
+    if ( !parseResult ){
+      longjmp(jbuf,1);
+    }
+
+    jsrcerr.trace_level = jdsterr.trace_level;
+    srcinfo.mem->max_memory_to_use = dstinfo.mem->max_memory_to_use;
+    /* Added for ajpegtran
+     *  '-threads' also decodes noninterleaved scans in parallel.
+     */
+    srcinfo.num_threads = dstinfo.num_threads;
+    LOGD("max_memory_to_use = %ld",srcinfo.mem->max_memory_to_use);
+
+#ifdef PROGRESS_REPORT
+    start_progress_monitor((j_common_ptr) &dstinfo, &progress);
+#endif
+
+    /* Specify data source for decompression */
+    jpeg_stdio_src(&srcinfo, rfd);
+
+    /* Enable saving of extra markers that we want to copy */
+    jcopy_markers_setup(&srcinfo, copyoption);
+
+    /* Read file header */
+    (void) jpeg_read_header(&srcinfo, TRUE);
+
+    /* Added for ajpegtran
+     *  Read the headers of the images to drop.
+     */
+    if (transformoption.transform == JXFORM_DROP)
+      drop_setup(&srcinfo);
+
+    /* Any space needed by a transform option must be requested before
      * jpeg_read_coefficients so that memory allocation will be done right.
      */
 #if TRANSFORMS_SUPPORTED
@@ -606,21 +2303,98 @@ Java_github_kamemak_ajpegtran_1example_MainActivity_ajpegtran( JNIEnv* env,
       strcpy(errmsgbuffer,"Setup error:perfect option can't be executed");
       longjmp(jbuf,1);
     }
+
+    /* Added for ajpegtran
+     *  A plain crop uses only the cropped area of the source image,
+     *  so restart intervals outside of it need not be decoded.
+     *  (A crop larger than the image places the whole image on a canvas.)
+     */
+    if (transformoption.transform == JXFORM_NONE && transformoption.crop &&
+	transformoption.output_width <= srcinfo.output_width &&
+	transformoption.output_height <= srcinfo.output_height) {
+      srcinfo.read_area_x =
+	transformoption.x_crop_offset * transformoption.iMCU_sample_width;
+      srcinfo.read_area_y =
+	transformoption.y_crop_offset * transformoption.iMCU_sample_height;
+      srcinfo.read_area_width = transformoption.output_width;
+      srcinfo.read_area_height = transformoption.output_height;
+    }
+
+    /* Added for ajpegtran
+     *  Tiles are cut from the whole image at iMCU boundaries.
+     */
+    if (tile_pyramid && ! tile_width) {
+      strcpy(errmsgbuffer,"Setup error:pyramid option needs tile option");
+      longjmp(jbuf,1);
+    }
+    if (tile_width) {
+      if (transformoption.transform != JXFORM_NONE || transformoption.crop ||
+	  transformoption.force_grayscale || smallest) {
+	strcpy(errmsgbuffer,"Setup error:tile option can't be combined");
+	longjmp(jbuf,1);
+      }
+      if (tile_width % (JDIMENSION) transformoption.iMCU_sample_width ||
+	  tile_height % (JDIMENSION) transformoption.iMCU_sample_height) {
+	strcpy(errmsgbuffer,"Setup error:tile size is not a multiple of MCU size");
+	longjmp(jbuf,1);
+      }
+    }
 #endif
 
+    /* Added for ajpegtran
+     *  Without transformation and coefficient changes, a single-scan file
+     *  is transcoded row by row into a single-scan output, and the whole
+     *  image is never held in memory.  '-optimize' reads the file twice,
+     *  so the input must be a regular file for it.  (A failed lseek probe
+     *  would leave errno set, which the destination manager reports as a
+     *  write error at the end.)
+     */
+    stream = (transformoption.transform == JXFORM_NONE &&
+	      ! transformoption.crop && ! transformoption.force_grayscale &&
+	      ! monochrome && ! coeff_adj && ! color_adj && ! requant_quality &&
+	      ! smallest && ! multiscan_output && ! tile_width &&
+	      ! dstinfo.rebuild_thumbnail &&
+	      dstinfo.num_threads <= 1 && ! jpeg_has_multiple_scans(&srcinfo) &&
+	      (! dstinfo.optimize_coding ||
+	       (fstat(rfd, &rstat) == 0 && S_ISREG(rstat.st_mode))));
+
     /* Read source file as DCT coefficients */
-    src_coef_arrays = jpeg_read_coefficients(&srcinfo);
+    if (stream)
+      src_coef_arrays = NULL;
+    else {
+      /* Added for ajpegtran
+       *  The images to drop are read on threads meanwhile.
+       */
+      drop_start_read();
+      src_coef_arrays = jpeg_read_coefficients(&srcinfo);
+      drop_finish_read();
+    }
 
     /* if monochrome option is specified, clear Cb and Cr coefficients */
     if (monochrome) {
       toMonochrome(&srcinfo,src_coef_arrays);
     }
 
+    /* Added for ajpegtran
+     *  if contrast or saturation option is specified, scale coefficients.
+     *  This is done before '-offset', so the offset is not scaled.
+     */
+    if (color_adj) {
+      colorControl(&srcinfo,src_coef_arrays);
+    }
+
     /* if brightness control option is specified, offset DC coefficient. */
     if (coeff_adj) {
       brightnessControl(&srcinfo,src_coef_arrays);
     }
 
+    /* Added for ajpegtran
+     *  if requant option is specified, requantize to coarser tables.
+     */
+    if (requant_quality) {
+      requantize(&srcinfo,&dstinfo,src_coef_arrays);
+    }
+
     /* Initialize destination compression parameters from source values */
     jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
 
@@ -635,34 +2409,83 @@ Java_github_kamemak_ajpegtran_1example_MainActivity_ajpegtran( JNIEnv* env,
     dst_coef_arrays = src_coef_arrays;
 #endif
 
+    /* Adjust default compression parameters by re-parsing the options.
+     * Note for ajpegtran
+     *  jpeg_copy_critical_parameters resets the compression parameters
+     *  (-optimize, -restart, ...), so the options must be parsed again here
+     *  as in the original jpegtran.
+     */
+    strcpy(opttemp,optsaved);
+    if ( !parse_switches(&dstinfo, opttemp, 0, TRUE) ){
+      longjmp(jbuf,1);
+    }
+
     /* Close input file, if we opened it.
      * Note: we assume that jpeg_read_coefficients consumed all input
      * until JPEG_REACHED_EOI, and that jpeg_finish_decompress will
      * only consume more while (! cinfo->inputctl->eoi_reached).
      * We cannot call jpeg_finish_decompress here since we still need the
      * virtual arrays allocated from the source object for processing.
+     * Note for ajpegtran
+     *  The streaming transcode reads the input while compressing.
      */
-    close(rfd);
-    rfd = -1;
-
-    /* Specify data destination for compression */
-    jpeg_stdio_dest(&dstinfo, wfd);
+    if (! stream) {
+      close(rfd);
+      rfd = -1;
+    }
 
-    /* Start compressor (note no image data is actually written here) */
-    jpeg_write_coefficients(&dstinfo, dst_coef_arrays);
+    /* Added for ajpegtran
+     *  With '-tile', the tiles are coded into files of the directory
+     *  given by wfd, instead of the output below.
+     */
+    if (tile_width)
+      tile_compress_all(&srcinfo, &dstinfo, src_coef_arrays, wfd);
+    else {
+      /* Specify data destination for compression */
+#ifdef C_PARALLEL_SUPPORTED
+      /* Added for ajpegtran
+       *  With '-smallest', the output goes to memory and is written later.
+       */
+      if (smallest)
+	smallest_setup(&dstinfo);
+      else
+#endif
+      jpeg_stdio_dest(&dstinfo, wfd);
 
-    /* Copy to the output file any extra markers that we want to preserve */
-    jcopy_markers_execute(&srcinfo, &dstinfo, copyoption);
+      /* Start compressor (note no image data is actually written here) */
+      if (stream) {
+	stream_fd = rfd;
+	jpeg_write_coefficients_stream(&dstinfo, &srcinfo, rewind_source);
+      } else
+      jpeg_write_coefficients(&dstinfo, dst_coef_arrays);
 
-    /* Execute image transformation, if any */
+      /* Execute image transformation, if any */
 #if TRANSFORMS_SUPPORTED
-    jtransform_execute_transformation(&srcinfo, &dstinfo,
-				    src_coef_arrays,
-				    &transformoption);
+      jtransform_execute_transformation(&srcinfo, &dstinfo,
+				      src_coef_arrays,
+				      &transformoption);
+
+      /* Added for ajpegtran
+       *  The thumbnail is made from the transformed coefficients.
+       */
+      if (dstinfo.rebuild_thumbnail && ! dstinfo.remove_thumbnail)
+	jtransform_rebuild_thumbnail(&srcinfo, &dstinfo, dst_coef_arrays);
 #endif
 
-    /* Finish compression and release memory */
-    jpeg_finish_compress(&dstinfo);
+      /* Copy to the output file any extra markers that we want to preserve */
+      /* Modified for ajpegtran
+       *  Moved after the transformation, for '-rebuildthumbnail'.
+       */
+      jcopy_markers_execute(&srcinfo, &dstinfo, copyoption);
+
+      /* Finish compression and release memory */
+#ifdef C_PARALLEL_SUPPORTED
+      if (smallest)
+	smallest_compress(&srcinfo, &dstinfo, src_coef_arrays, optsaved, wfd);
+      else
+#endif
+      jpeg_finish_compress(&dstinfo);
+    }
     (void) jpeg_finish_decompress(&srcinfo);
 
     /* Close output file, if we opened it */
@@ -676,6 +2499,11 @@ Java_github_kamemak_ajpegtran_1example_MainActivity_ajpegtran( JNIEnv* env,
   else{
     LOGD("longjmp was occured");
   }
+#ifdef C_PARALLEL_SUPPORTED
+  smallest_release();
+#endif
+  drop_release();
+  tile_release();
   jpeg_destroy_compress(&dstinfo);
   jpeg_destroy_decompress(&srcinfo);
   if (rfd != -1) close(rfd);
@@ -816,3 +2644,254 @@ Java_github_kamemak_ajpegtran_1example_MainActivity_ajpegtranhead( JNIEnv* env,
   }
   return (*env)->NewStringUTF(env, "Unknown Error");
 }
+
+/**
+ * ajpegtranpreview entry.
+ *
+ * Make a 1/8 scale RGBA preview of specified file from DC coefficients.
+ *
+ * Note for ajpegtran
+ *  Only entropy decoding is done, no IDCT, no upsampling.
+ *  The Huffman decoder is told that only the DC coefficient is needed
+ *  (DCT_scaled_size of 1), so it skips the AC values.
+ *  A single-scan file is decoded row by row (jpeg_start_coefficient_rows),
+ *  and the rest of the file is not read after the last row.
+ *  Other files are read into the coefficient arrays as usual.
+ *  The preview is (width+7)/8 x (height+7)/8 pixels, returned in
+ *  jSizeArray[0] and [1]. jBuffer is a direct buffer of 4 bytes per pixel,
+ *  in the order of Bitmap.Config.ARGB_8888 (R,G,B,A),
+ *  so Bitmap.copyPixelsFromBuffer() can be used.
+ */
+
+JNIEXPORT jstring JNICALL
+Java_github_kamemak_ajpegtran_1example_MainActivity_ajpegtranpreview( JNIEnv* env,
+                                         jobject thiz,
+                                         jint fd,
+                                         jobject jBuffer,
+                                         jintArray jSizeArray
+                                                  )
+{
+  struct jpeg_decompress_struct srcinfo;
+  struct jpeg_error_mgr jsrcerr;
+  jvirt_barray_ptr * coef_arrays;
+  JBLOCKARRAY rows[MAX_COMPONENTS];
+  JDIMENSION width, height, row;
+  jpeg_component_info *compptr;
+  unsigned char * outbuf;
+  jint *sizeArray;
+  int ci;
+
+  errno = 0;
+
+  errmsgbuffer[0]='\0';
+  if( setjmp( jbuf ) == 0 ) {
+    /* Initialize the JPEG decompression object with default error handling. */
+    srcinfo.err = jpeg_std_error(&jsrcerr);
+    jpeg_create_decompress(&srcinfo);
+
+    jsrcerr.trace_level = 0;
+    srcinfo.mem->max_memory_to_use = 0;
+
+    /* Specify data source for decompression */
+    jpeg_stdio_src(&srcinfo, fd);
+
+    /* Read file header, no markers are saved */
+    (void) jpeg_read_header(&srcinfo, TRUE);
+
+    switch (srcinfo.jpeg_color_space) {
+    case JCS_GRAYSCALE:
+      break;
+    case JCS_RGB:
+    case JCS_YCbCr:
+      if (srcinfo.num_components == 3) break;
+      /* FALLTHROUGH */
+    case JCS_CMYK:
+    case JCS_YCCK:
+      if (srcinfo.num_components == 4) break;
+      /* FALLTHROUGH */
+    default:
+      strcpy(errmsgbuffer,"JPEG Error:Unsupported color space");
+      longjmp(jbuf,1);
+    }
+
+    /* Check buffer size and return preview size */
+    width = (JDIMENSION) ((srcinfo.image_width + srcinfo.block_size - 1) /
+			  srcinfo.block_size);
+    height = (JDIMENSION) ((srcinfo.image_height + srcinfo.block_size - 1) /
+			   srcinfo.block_size);
+    outbuf = (unsigned char *) (*env)->GetDirectBufferAddress(env, jBuffer);
+    if( outbuf == NULL ||
+	(*env)->GetDirectBufferCapacity(env, jBuffer) < (jlong) width * height * 4 ){
+      strcpy(errmsgbuffer,"IF Error:Short buffer");
+      longjmp(jbuf,1);
+    }
+    if( (*env)->GetArrayLength(env,jSizeArray) < 2 ){
+      strcpy(errmsgbuffer,"IF Error:Short array");
+      longjmp(jbuf,1);
+    }
+    sizeArray = (*env)->GetIntArrayElements(env, jSizeArray, NULL);
+    sizeArray[0] = width;
+    sizeArray[1] = height;
+    (*env)->ReleaseIntArrayElements(env, jSizeArray, sizeArray, 0);
+
+    /* Only DC coefficients are needed.
+     * The entropy decoder discards AC values of 1x1 scaled blocks.
+     */
+    for (ci = 0, compptr = srcinfo.comp_info; ci < srcinfo.num_components;
+	 ci++, compptr++) {
+      compptr->DCT_h_scaled_size = 1;
+      compptr->DCT_v_scaled_size = 1;
+    }
+
+    if (! jpeg_has_multiple_scans(&srcinfo)) {
+      /* Decode row by row into the row buffer */
+      for (ci = 0, compptr = srcinfo.comp_info; ci < srcinfo.num_components;
+	   ci++, compptr++)
+	rows[ci] = (*srcinfo.mem->alloc_barray)
+	  ((j_common_ptr) &srcinfo, JPOOL_IMAGE,
+	   (JDIMENSION) ((compptr->width_in_blocks + compptr->h_samp_factor - 1)
+			 / compptr->h_samp_factor * compptr->h_samp_factor),
+	   (JDIMENSION) compptr->v_samp_factor);
+      jpeg_start_coefficient_rows(&srcinfo, rows);
+      for (row = 0; row < srcinfo.total_iMCU_rows; row++) {
+	if (jpeg_consume_input(&srcinfo) == JPEG_SUSPENDED)
+	  ERREXIT(&srcinfo, JERR_INPUT_EOF);
+	previewRow(&srcinfo, rows, row, width, height, outbuf);
+      }
+    } else {
+      /* A later scan may add to the coefficients of earlier ones */
+      coef_arrays = jpeg_read_coefficients(&srcinfo);
+      for (row = 0; row < srcinfo.total_iMCU_rows; row++) {
+	for (ci = 0, compptr = srcinfo.comp_info; ci < srcinfo.num_components;
+	     ci++, compptr++)
+	  rows[ci] = (*srcinfo.mem->access_virt_barray)
+	    ((j_common_ptr) &srcinfo, coef_arrays[ci],
+	     row * compptr->v_samp_factor,
+	     (JDIMENSION) compptr->v_samp_factor, FALSE);
+	previewRow(&srcinfo, rows, row, width, height, outbuf);
+      }
+    }
+
+    strcpy(errmsgbuffer,"OK");
+  }
+  else{
+    LOGD("longjmp was occured");
+  }
+  /* The rest of the file is not needed */
+  if( fd != -1 ) close(fd);
+  jpeg_destroy_decompress(&srcinfo);
+  if(*errmsgbuffer){
+    return (*env)->NewStringUTF(env, errmsgbuffer);
+  }
+  return (*env)->NewStringUTF(env, "Unknown Error");
+}
+
+/**
+ * ajpegtranhash entry.
+ *
+ * Compute a perceptual hash of specified file from DC coefficients.
+ *
+ * Note for ajpegtran
+ *  The 64-bit hash is returned in jHashArray[0].  Similar images have
+ *  hashes of a small Hamming distance (Long.bitCount(a ^ b) in Java).
+ *  Only the entropy decoding is done, like ajpegtranpreview().
+ */
+
+JNIEXPORT jstring JNICALL
+Java_github_kamemak_ajpegtran_1example_MainActivity_ajpegtranhash( JNIEnv* env,
+                                         jobject thiz,
+                                         jint fd,
+                                         jlongArray jHashArray
+                                                  )
+{
+  struct jpeg_decompress_struct srcinfo;
+  struct jpeg_error_mgr jsrcerr;
+  jlong hash;
+
+  errno = 0;
+
+  errmsgbuffer[0]='\0';
+  if( setjmp( jbuf ) == 0 ) {
+    /* Initialize the JPEG decompression object with default error handling. */
+    srcinfo.err = jpeg_std_error(&jsrcerr);
+    jpeg_create_decompress(&srcinfo);
+
+    jsrcerr.trace_level = 0;
+    srcinfo.mem->max_memory_to_use = 0;
+
+    if( (*env)->GetArrayLength(env,jHashArray) < 1 ){
+      strcpy(errmsgbuffer,"IF Error:Short array");
+      longjmp(jbuf,1);
+    }
+
+    hash = dc_hash(&srcinfo, fd);
+    (*env)->SetLongArrayRegion(env, jHashArray, 0, 1, &hash);
+
+    strcpy(errmsgbuffer,"OK");
+  }
+  else{
+    LOGD("longjmp was occured");
+  }
+  /* The rest of the file is not needed */
+  if( fd != -1 ) close(fd);
+  jpeg_destroy_decompress(&srcinfo);
+  if(*errmsgbuffer){
+    return (*env)->NewStringUTF(env, errmsgbuffer);
+  }
+  return (*env)->NewStringUTF(env, "Unknown Error");
+}
+
+/**
+ * ajpegtranhashbatch entry.
+ *
+ * Compute the perceptual hashes of many files, on threads.
+ *
+ * Note for ajpegtran
+ *  jHashArray[i] gets the hash of the file jFdArray[i], as ajpegtranhash().
+ *  All files are closed.  A failed file gets 0 and doesn't stop the others;
+ *  the return value is "OK", or "<index>:<message>" of the first failed file.
+ */
+
+JNIEXPORT jstring JNICALL
+Java_github_kamemak_ajpegtran_1example_MainActivity_ajpegtranhashbatch( JNIEnv* env,
+                                         jobject thiz,
+                                         jintArray jFdArray,
+                                         jlongArray jHashArray
+                                                  )
+{
+  jint *fds;
+  jlong *hashes;
+  jsize count;
+
+  errno = 0;
+
+  /* The arrays are taken before setjmp, so they are valid after longjmp */
+  errmsgbuffer[0]='\0';
+  count = (*env)->GetArrayLength(env,jFdArray);
+  fds = (*env)->GetIntArrayElements(env, jFdArray, NULL);
+  hashes = (*env)->GetLongArrayElements(env, jHashArray, NULL);
+  if( fds == NULL || hashes == NULL ){
+    strcpy(errmsgbuffer,"IF Error:Argument error");
+  }
+  else if( (*env)->GetArrayLength(env,jHashArray) < count ){
+    /* Close the files as the other entries do */
+    while (count > 0)
+      close(fds[--count]);
+    strcpy(errmsgbuffer,"IF Error:Short array");
+  }
+  else if( setjmp( jbuf ) == 0 ) {
+    hash_compute_all(fds, hashes, (int) count);
+  }
+  else{
+    LOGD("longjmp was occured");
+  }
+  hash_release();
+  if( hashes != NULL )
+    (*env)->ReleaseLongArrayElements(env, jHashArray, hashes, 0);
+  if( fds != NULL )
+    (*env)->ReleaseIntArrayElements(env, jFdArray, fds, JNI_ABORT);
+  if(*errmsgbuffer){
+    return (*env)->NewStringUTF(env, errmsgbuffer);
+  }
+  return (*env)->NewStringUTF(env, "Unknown Error");
+}
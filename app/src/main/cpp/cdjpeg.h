@@ -133,7 +133,7 @@ EXTERN(djpeg_dest_ptr) jinit_write_targa JPP((j_decompress_ptr cinfo));
 
 EXTERN(boolean) read_quant_tables JPP((j_compress_ptr cinfo, char * filename,
 				       boolean force_baseline));
-EXTERN(boolean) read_scan_script JPP((j_compress_ptr cinfo, char * filename));
+EXTERN(boolean) read_scan_script JPP((j_compress_ptr cinfo, char * script));
 EXTERN(boolean) set_quality_ratings JPP((j_compress_ptr cinfo, char *arg,
 					 boolean force_baseline));
 EXTERN(boolean) set_quant_slots JPP((j_compress_ptr cinfo, char *arg));
@@ -92,6 +92,9 @@ jpeg_CreateCompress (j_compress_ptr cinfo, int version, size_t structsize)
   cinfo->remove_orientation_info = FALSE;
   cinfo->remove_thumbnail = FALSE;
   cinfo->remove_geotag = FALSE;	
+  cinfo->rebuild_thumbnail = FALSE;
+  cinfo->num_threads = 1;
+  cinfo->optimize_scans = FALSE;
 
 }
 
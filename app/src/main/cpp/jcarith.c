@@ -932,6 +932,9 @@ jinit_arith_encoder (j_compress_ptr cinfo)
   cinfo->entropy = &entropy->pub;
   entropy->pub.start_pass = start_pass;
   entropy->pub.finish_pass = finish_pass;
+  /* Added for ajpegtran: no segment coding for arithmetic coding */
+  entropy->pub.encode_segment = NULL;
+  entropy->pub.replay_symbols = FALSE;
 
   /* Mark tables unallocated */
   for (i = 0; i < NUM_ARITH_TBLS; i++) {
@@ -46,6 +46,27 @@ typedef struct {
 } c_derived_tbl;
 
 
+/* Added for ajpegtran
+ *  Symbol stream recorded at the statistics-gathering pass of a sequential
+ *  scan, and coded with the new tables at the output pass of the scan.
+ *  Each entry is a Huffman symbol in the low 8 bits and its additional bits
+ *  above them, so an entry needs at most 8 + MAX_COEF_BITS+1 bits.
+ *  The entries of an MCU are never split between chunks.
+ */
+
+#define SYM_CHUNK_SIZE  32768	/* entries per chunk */
+#define SYM_PER_BLOCK   64	/* max entries per block: DC + 63 AC/ZRL/EOB */
+#define SYM_LIMIT_PER_BLOCK  16	/* give up recording beyond this average */
+
+typedef struct sym_chunk * sym_chunk_ptr;
+
+typedef struct sym_chunk {
+  sym_chunk_ptr next;		/* next chunk, or NULL */
+  long count;			/* # of entries used */
+  INT32 data[SYM_CHUNK_SIZE];
+} sym_chunk;
+
+
 /* Expanded entropy encoder object for Huffman encoding.
  *
  * The savable_state subrecord contains fields that change within an MCU,
@@ -95,6 +116,16 @@ typedef struct {
   long * dc_count_ptrs[NUM_HUFF_TBLS];
   long * ac_count_ptrs[NUM_HUFF_TBLS];
 
+  /* Added for ajpegtran
+   *  Recorded symbol stream, used in sequential mode only.
+   */
+  sym_chunk_ptr sym_head;	/* first chunk, or NULL */
+  sym_chunk_ptr sym_cur;	/* chunk being written or read */
+  long sym_pos;			/* read position in sym_cur */
+  long sym_chunks_left;		/* # of chunks we may still allocate */
+  boolean sym_recording;	/* gather pass records the symbols */
+  boolean sym_valid;		/* stream holds the whole current scan */
+
   /* Following fields used only in progressive mode */
 
   /* Mode flag: TRUE for optimization, FALSE for actual data output */
@@ -125,8 +156,19 @@ typedef struct {
   size_t free_in_buffer;	/* # of byte spaces remaining in buffer */
   savable_state cur;		/* Current bit buffer & DC state */
   j_compress_ptr cinfo;		/* dump_buffer needs access to this */
+  jpeg_mcu_segment_ptr seg;	/* segment being coded, or NULL */
 } working_state;
 
+/* Added for ajpegtran
+ *  Error exit for routines using working state.  A segment may be coded on
+ *  a worker thread, which must not longjmp; so in that case we record the
+ *  error in the segment and return FALSE, just like a suspension.
+ */
+
+#define ERREXIT_S(state,code)  \
+	{ if ((state)->seg == NULL) ERREXIT((state)->cinfo, code);  \
+	  (state)->seg->error_code = (code); return FALSE; }
+
 /* MAX_CORR_BITS is the number of bits the AC refinement correction-bit
  * buffer can hold.  Larger sizes may slightly improve compression, but
  * 1000 is already well into the realm of overkill.
@@ -186,6 +228,26 @@ jpeg_make_c_derived_tbl (j_compress_ptr cinfo, boolean isDC, int tblno,
       (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
 				  SIZEOF(c_derived_tbl));
   dtbl = *pdtbl;
+
+  /* Added for ajpegtran
+   *  Copy precomputed derived values for a standard table (jstdhuff.c).
+   *  These are known to be valid, so no checks are needed.
+   */
+  if ((i = jpeg_std_huff_index(htbl, isDC)) >= 0) {
+    for (p = 0; p < 256; p++)
+      dtbl->ehufco[p] = jpeg_std_c_ehufco[i][p];
+    MEMCOPY(dtbl->ehufsi, jpeg_std_c_ehufsi[i], SIZEOF(dtbl->ehufsi));
+    return;
+  }
+
+#ifdef HUFF_CACHE_SUPPORTED
+  /* Added for ajpegtran
+   *  Reuse the derived table built for the same table before (jhuffcache.c).
+   */
+  if (jpeg_huff_cache_get(htbl, isDC ? HUFF_CACHE_C_DC : HUFF_CACHE_C_AC,
+			  dtbl, SIZEOF(c_derived_tbl)))
+    return;
+#endif
   
   /* Figure C.1: make table of Huffman code length for each symbol */
 
@@ -243,6 +305,14 @@ jpeg_make_c_derived_tbl (j_compress_ptr cinfo, boolean isDC, int tblno,
     dtbl->ehufco[i] = huffcode[p];
     dtbl->ehufsi[i] = huffsize[p];
   }
+
+#ifdef HUFF_CACHE_SUPPORTED
+  /* Added for ajpegtran
+   *  Keep the validated table for later use.
+   */
+  jpeg_huff_cache_put(htbl, isDC ? HUFF_CACHE_C_DC : HUFF_CACHE_C_AC,
+		      dtbl, SIZEOF(c_derived_tbl));
+#endif
 }
 
 
@@ -271,6 +341,23 @@ dump_buffer_s (working_state * state)
 {
   struct jpeg_destination_mgr * dest = state->cinfo->dest;
 
+  /* Added for ajpegtran
+   *  When coding a segment, enlarge its private buffer instead.
+   */
+  if (state->seg != NULL) {
+    jpeg_mcu_segment_ptr seg = state->seg;
+    size_t used = seg->bufsize - state->free_in_buffer;
+    JOCTET * buffer = (JOCTET *) realloc(seg->buffer, seg->bufsize * 2);
+
+    if (buffer == NULL)
+      ERREXIT_S(state, JERR_OUT_OF_MEMORY);
+    seg->buffer = buffer;
+    seg->bufsize *= 2;
+    state->next_output_byte = buffer + used;
+    state->free_in_buffer = seg->bufsize - used;
+    return TRUE;
+  }
+
   if (! (*dest->empty_output_buffer) (state->cinfo))
     return FALSE;
   /* After a successful buffer dump, must reset buffer pointers */
@@ -313,7 +400,7 @@ emit_bits_s (working_state * state, unsigned int code, int size)
 
   /* if size is 0, caller used an invalid Huffman table entry */
   if (size == 0)
-    ERREXIT(state->cinfo, JERR_HUFF_MISSING_CODE);
+    ERREXIT_S(state, JERR_HUFF_MISSING_CODE);
 
   /* mask off any extra bits in code */
   put_buffer = ((INT32) code) & ((((INT32) 1) << size) - 1);
@@ -467,9 +554,7 @@ emit_eobrun (huff_entropy_ptr entropy)
 
   if (entropy->EOBRUN > 0) {	/* if there is any pending EOBRUN */
     temp = entropy->EOBRUN;
-    nbits = 0;
-    while ((temp >>= 1))
-      nbits++;
+    nbits = JPEG_NBITS_NONZERO(temp) - 1;
     /* safety check: shouldn't happen given limited correction-bit buffer */
     if (nbits > 14)
       ERREXIT(entropy->cinfo, JERR_HUFF_MISSING_CODE);
@@ -583,11 +668,7 @@ encode_mcu_DC_first (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
     }
 
     /* Find the number of bits needed for the magnitude of the coefficient */
-    nbits = 0;
-    while (temp) {
-      nbits++;
-      temp >>= 1;
-    }
+    nbits = JPEG_NBITS(temp);
     /* Check for out-of-range coefficient values.
      * Since we're encoding a difference, the range limit is twice as much.
      */
@@ -690,9 +771,7 @@ encode_mcu_AC_first (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
     }
 
     /* Find the number of bits needed for the magnitude of the coefficient */
-    nbits = 1;			/* there must be at least one 1 bit */
-    while ((temp >>= 1))
-      nbits++;
+    nbits = JPEG_NBITS_NONZERO(temp); /* at least one 1 bit */
     /* Check for out-of-range coefficient values */
     if (nbits > MAX_COEF_BITS)
       ERREXIT(cinfo, JERR_BAD_DCT_COEF);
@@ -931,16 +1010,12 @@ encode_one_block (working_state * state, JCOEFPTR block, int last_dc_val,
   }
 
   /* Find the number of bits needed for the magnitude of the coefficient */
-  nbits = 0;
-  while (temp) {
-    nbits++;
-    temp >>= 1;
-  }
+  nbits = JPEG_NBITS(temp);
   /* Check for out-of-range coefficient values.
    * Since we're encoding a difference, the range limit is twice as much.
    */
   if (nbits > MAX_COEF_BITS+1)
-    ERREXIT(state->cinfo, JERR_BAD_DCT_COEF);
+    ERREXIT_S(state, JERR_BAD_DCT_COEF);
 
   /* Emit the Huffman-coded symbol for the number of bits */
   if (! emit_bits_s(state, dctbl->ehufco[nbits], dctbl->ehufsi[nbits]))
@@ -975,12 +1050,10 @@ encode_one_block (working_state * state, JCOEFPTR block, int last_dc_val,
       }
 
       /* Find the number of bits needed for the magnitude of the coefficient */
-      nbits = 1;		/* there must be at least one 1 bit */
-      while ((temp >>= 1))
-	nbits++;
+      nbits = JPEG_NBITS_NONZERO(temp); /* at least one 1 bit */
       /* Check for out-of-range coefficient values */
       if (nbits > MAX_COEF_BITS)
-	ERREXIT(state->cinfo, JERR_BAD_DCT_COEF);
+	ERREXIT_S(state, JERR_BAD_DCT_COEF);
 
       /* Emit Huffman symbol for run length / number of bits */
       temp = (r << 4) + nbits;
@@ -1022,6 +1095,7 @@ encode_mcu_huff (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
   state.free_in_buffer = cinfo->dest->free_in_buffer;
   ASSIGN_STATE(state.cur, entropy->saved);
   state.cinfo = cinfo;
+  state.seg = NULL;
 
   /* Emit restart marker if needed */
   if (cinfo->restart_interval) {
@@ -1062,6 +1136,67 @@ encode_mcu_huff (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
 }
 
 
+/* Added for ajpegtran
+ *  Encode a run of whole restart intervals into the segment's own buffer.
+ *  This does the job of encode_mcu_huff for each MCU, but all coder state
+ *  lives in local working state, so that the segments of one scan can be
+ *  coded concurrently.  The caller must supply an initial buffer.
+ */
+
+METHODDEF(boolean)
+encode_segment_huff (j_compress_ptr cinfo, jpeg_mcu_segment_ptr seg)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  working_state state;
+  JBLOCKROW MCU_data[C_MAX_BLOCKS_IN_MCU];
+  JDIMENSION MCU_index, end_MCU;
+  int blkn, ci;
+  jpeg_component_info * compptr;
+
+  /* Load up working state for an empty segment */
+  state.next_output_byte = seg->buffer;
+  state.free_in_buffer = seg->bufsize;
+  state.cur.put_buffer = 0;
+  state.cur.put_bits = 0;
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++)
+    state.cur.last_dc_val[ci] = 0;
+  state.cinfo = cinfo;
+  state.seg = seg;
+  seg->error_code = 0;
+
+  end_MCU = seg->first_MCU + seg->num_MCUs;
+  for (MCU_index = seg->first_MCU; MCU_index < end_MCU; MCU_index++) {
+    /* Emit restart marker at each interval boundary */
+    if (MCU_index > 0 && MCU_index % cinfo->restart_interval == 0)
+      if (! emit_restart_s(&state,
+	    (int) ((MCU_index / cinfo->restart_interval - 1) & 7)))
+	return FALSE;
+
+    (*seg->get_MCU) (cinfo, seg, MCU_index, MCU_data);
+
+    /* Encode the MCU data blocks */
+    for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++) {
+      ci = cinfo->MCU_membership[blkn];
+      compptr = cinfo->cur_comp_info[ci];
+      if (! encode_one_block(&state,
+			     MCU_data[blkn][0], state.cur.last_dc_val[ci],
+			     entropy->dc_derived_tbls[compptr->dc_tbl_no],
+			     entropy->ac_derived_tbls[compptr->ac_tbl_no]))
+	return FALSE;
+      /* Update last_dc_val */
+      state.cur.last_dc_val[ci] = MCU_data[blkn][0][0];
+    }
+  }
+
+  /* Flush out the last data of the segment */
+  if (! flush_bits_s(&state))
+    return FALSE;
+
+  seg->datasize = seg->bufsize - state.free_in_buffer;
+  return TRUE;
+}
+
+
 /*
  * Finish up at the end of a Huffman-compressed scan.
  */
@@ -1088,6 +1223,7 @@ finish_pass_huff (j_compress_ptr cinfo)
     state.free_in_buffer = cinfo->dest->free_in_buffer;
     ASSIGN_STATE(state.cur, entropy->saved);
     state.cinfo = cinfo;
+    state.seg = NULL;
 
     /* Flush out the last data */
     if (! flush_bits_s(&state))
@@ -1132,11 +1268,7 @@ htest_one_block (j_compress_ptr cinfo, JCOEFPTR block, int last_dc_val,
     temp = -temp;
 
   /* Find the number of bits needed for the magnitude of the coefficient */
-  nbits = 0;
-  while (temp) {
-    nbits++;
-    temp >>= 1;
-  }
+  nbits = JPEG_NBITS(temp);
   /* Check for out-of-range coefficient values.
    * Since we're encoding a difference, the range limit is twice as much.
    */
@@ -1165,9 +1297,7 @@ htest_one_block (j_compress_ptr cinfo, JCOEFPTR block, int last_dc_val,
 	temp = -temp;
 
       /* Find the number of bits needed for the magnitude of the coefficient */
-      nbits = 1;		/* there must be at least one 1 bit */
-      while ((temp >>= 1))
-	nbits++;
+      nbits = JPEG_NBITS_NONZERO(temp); /* at least one 1 bit */
       /* Check for out-of-range coefficient values */
       if (nbits > MAX_COEF_BITS)
 	ERREXIT(cinfo, JERR_BAD_DCT_COEF);
@@ -1222,6 +1352,262 @@ encode_mcu_gather (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
 }
 
 
+/* Added for ajpegtran
+ *  Same as htest_one_block, but also appends the symbols and their
+ *  additional bits to the symbol stream at sym.  Returns the new end.
+ */
+
+LOCAL(INT32 *)
+hrecord_one_block (j_compress_ptr cinfo, JCOEFPTR block, int last_dc_val,
+		   long dc_counts[], long ac_counts[], INT32 * sym)
+{
+  register int temp, temp2;
+  register int nbits;
+  register int r, k;
+  int Se = cinfo->lim_Se;
+  const int * natural_order = cinfo->natural_order;
+
+  /* Encode the DC coefficient difference per section F.1.2.1 */
+
+  temp = temp2 = block[0] - last_dc_val;
+  if (temp < 0) {
+    temp = -temp;
+    temp2--;
+  }
+
+  /* Find the number of bits needed for the magnitude of the coefficient */
+  nbits = JPEG_NBITS(temp);
+  /* Check for out-of-range coefficient values.
+   * Since we're encoding a difference, the range limit is twice as much.
+   */
+  if (nbits > MAX_COEF_BITS+1)
+    ERREXIT(cinfo, JERR_BAD_DCT_COEF);
+
+  /* Count and record the Huffman symbol for the number of bits */
+  dc_counts[nbits]++;
+  *sym++ = ((((INT32) temp2) & ((((INT32) 1) << nbits) - 1)) << 8) + nbits;
+
+  /* Encode the AC coefficients per section F.1.2.2 */
+
+  r = 0;			/* r = run length of zeros */
+
+  for (k = 1; k <= Se; k++) {
+    if ((temp = temp2 = block[natural_order[k]]) == 0) {
+      r++;
+    } else {
+      /* if run length > 15, must emit special run-length-16 codes (0xF0) */
+      while (r > 15) {
+	ac_counts[0xF0]++;
+	*sym++ = 0xF0;
+	r -= 16;
+      }
+
+      if (temp < 0) {
+	temp = -temp;
+	temp2--;
+      }
+
+      /* Find the number of bits needed for the magnitude of the coefficient */
+      nbits = JPEG_NBITS_NONZERO(temp); /* at least one 1 bit */
+      /* Check for out-of-range coefficient values */
+      if (nbits > MAX_COEF_BITS)
+	ERREXIT(cinfo, JERR_BAD_DCT_COEF);
+
+      /* Count and record symbol for run length / number of bits */
+      temp = (r << 4) + nbits;
+      ac_counts[temp]++;
+      *sym++ = ((((INT32) temp2) & ((((INT32) 1) << nbits) - 1)) << 8) + temp;
+
+      r = 0;
+    }
+  }
+
+  /* If the last coef(s) were zero, emit an end-of-block code */
+  if (r > 0) {
+    ac_counts[0]++;
+    *sym++ = 0;
+  }
+
+  return sym;
+}
+
+
+/* Added for ajpegtran
+ *  Get room for the entries of one MCU in the symbol stream.
+ *  Returns NULL (and stops recording) when the stream gets too large.
+ */
+
+LOCAL(INT32 *)
+sym_reserve (j_compress_ptr cinfo)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  sym_chunk_ptr chunk = entropy->sym_cur;
+
+  if (chunk == NULL ||
+      chunk->count + cinfo->blocks_in_MCU * SYM_PER_BLOCK > SYM_CHUNK_SIZE) {
+    if (entropy->sym_chunks_left <= 0) {
+      entropy->sym_recording = FALSE;
+      return NULL;
+    }
+    entropy->sym_chunks_left--;
+    /* Move to the next chunk, reusing chunks of an earlier scan */
+    chunk = (chunk == NULL) ? entropy->sym_head : chunk->next;
+    if (chunk == NULL) {
+      chunk = (sym_chunk_ptr)
+	(*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				    SIZEOF(sym_chunk));
+      chunk->next = NULL;
+      if (entropy->sym_cur == NULL)
+	entropy->sym_head = chunk;
+      else
+	entropy->sym_cur->next = chunk;
+    }
+    chunk->count = 0;
+    entropy->sym_cur = chunk;
+  }
+  return chunk->data + chunk->count;
+}
+
+
+/* Added for ajpegtran
+ *  Same as encode_mcu_gather, but also records the symbol stream.
+ */
+
+METHODDEF(boolean)
+encode_mcu_gather_record (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  int blkn, ci;
+  jpeg_component_info * compptr;
+  INT32 * sym;
+
+  if ((sym = sym_reserve(cinfo)) == NULL) {
+    /* Too large, only count from now on */
+    entropy->pub.encode_mcu = encode_mcu_gather;
+    return encode_mcu_gather(cinfo, MCU_data);
+  }
+
+  /* Take care of restart intervals if needed */
+  if (cinfo->restart_interval) {
+    if (entropy->restarts_to_go == 0) {
+      /* Re-initialize DC predictions to 0 */
+      for (ci = 0; ci < cinfo->comps_in_scan; ci++)
+	entropy->saved.last_dc_val[ci] = 0;
+      /* Update restart state */
+      entropy->restarts_to_go = cinfo->restart_interval;
+    }
+    entropy->restarts_to_go--;
+  }
+
+  for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++) {
+    ci = cinfo->MCU_membership[blkn];
+    compptr = cinfo->cur_comp_info[ci];
+    sym = hrecord_one_block(cinfo, MCU_data[blkn][0],
+			    entropy->saved.last_dc_val[ci],
+			    entropy->dc_count_ptrs[compptr->dc_tbl_no],
+			    entropy->ac_count_ptrs[compptr->ac_tbl_no], sym);
+    entropy->saved.last_dc_val[ci] = MCU_data[blkn][0][0];
+  }
+  entropy->sym_cur->count = sym - entropy->sym_cur->data;
+
+  return TRUE;
+}
+
+
+/* Added for ajpegtran
+ *  Output pass after encode_mcu_gather_record: code one MCU from the
+ *  recorded symbol stream.  MCU_data is not used.
+ */
+
+METHODDEF(boolean)
+encode_mcu_replay (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  working_state state;
+  int blkn, k, symbol;
+  int Se = cinfo->lim_Se;
+  jpeg_component_info * compptr;
+  c_derived_tbl *dctbl, *actbl;
+  sym_chunk_ptr chunk;
+  INT32 * sym;
+
+  /* Load up working state */
+  state.next_output_byte = cinfo->dest->next_output_byte;
+  state.free_in_buffer = cinfo->dest->free_in_buffer;
+  ASSIGN_STATE(state.cur, entropy->saved);
+  state.cinfo = cinfo;
+  state.seg = NULL;
+
+  /* Emit restart marker if needed */
+  if (cinfo->restart_interval) {
+    if (entropy->restarts_to_go == 0)
+      if (! emit_restart_s(&state, entropy->next_restart_num))
+	return FALSE;
+  }
+
+  /* Find the entries of this MCU */
+  chunk = entropy->sym_cur;
+  if (entropy->sym_pos >= chunk->count) {
+    chunk = chunk->next;
+    entropy->sym_cur = chunk;
+    entropy->sym_pos = 0;
+  }
+  sym = chunk->data + entropy->sym_pos;
+
+  /* Code the MCU data blocks */
+  for (blkn = 0; blkn < cinfo->blocks_in_MCU; blkn++) {
+    compptr = cinfo->cur_comp_info[cinfo->MCU_membership[blkn]];
+    dctbl = entropy->dc_derived_tbls[compptr->dc_tbl_no];
+    actbl = entropy->ac_derived_tbls[compptr->ac_tbl_no];
+
+    /* DC symbol and its additional bits */
+    symbol = (int) (*sym & 0xFF);
+    if (! emit_bits_s(&state, dctbl->ehufco[symbol], dctbl->ehufsi[symbol]))
+      return FALSE;
+    if (symbol)
+      if (! emit_bits_s(&state, (unsigned int) (*sym >> 8), symbol))
+	return FALSE;
+    sym++;
+
+    /* AC symbols until EOB or the end of the block */
+    for (k = 1; k <= Se; sym++) {
+      symbol = (int) (*sym & 0xFF);
+      if (! emit_bits_s(&state, actbl->ehufco[symbol], actbl->ehufsi[symbol]))
+	return FALSE;
+      if (symbol == 0) {	/* EOB */
+	sym++;
+	break;
+      }
+      if (symbol == 0xF0) {	/* ZRL */
+	k += 16;
+	continue;
+      }
+      if (! emit_bits_s(&state, (unsigned int) (*sym >> 8), symbol & 15))
+	return FALSE;
+      k += (symbol >> 4) + 1;
+    }
+  }
+
+  /* Completed MCU, so update state */
+  cinfo->dest->next_output_byte = state.next_output_byte;
+  cinfo->dest->free_in_buffer = state.free_in_buffer;
+  ASSIGN_STATE(entropy->saved, state.cur);
+  entropy->sym_pos = sym - chunk->data;
+
+  /* Update restart-interval state too */
+  if (cinfo->restart_interval) {
+    if (entropy->restarts_to_go == 0) {
+      entropy->restarts_to_go = cinfo->restart_interval;
+      entropy->next_restart_num++;
+      entropy->next_restart_num &= 7;
+    }
+    entropy->restarts_to_go--;
+  }
+
+  return TRUE;
+}
+
+
 /*
  * Generate the best Huffman code table for the given counts, fill htbl.
  *
@@ -1249,7 +1635,10 @@ encode_mcu_gather (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
  * So the extra complexity of an optimal algorithm doesn't seem worthwhile.
  */
 
-LOCAL(void)
+/* Modified for ajpegtran
+ *  Made global, the scan script search in jcscans.c uses it too.
+ */
+GLOBAL(void)
 jpeg_gen_optimal_table (j_compress_ptr cinfo, JHUFF_TBL * htbl, long freq[])
 {
 #define MAX_CLEN 32		/* assumed maximum initial code length */
@@ -1407,6 +1796,11 @@ finish_pass_gather (j_compress_ptr cinfo)
     /* Flush out buffered data (all we care about is counting the EOB symbol) */
     emit_eobrun(entropy);
 
+  /* Added for ajpegtran
+   *  The output pass can code the recorded symbols if all were recorded.
+   */
+  entropy->sym_valid = entropy->sym_recording;
+
   MEMZERO(did_dc, SIZEOF(did_dc));
   MEMZERO(did_ac, SIZEOF(did_ac));
 
@@ -1456,6 +1850,45 @@ start_pass_huff (j_compress_ptr cinfo, boolean gather_statistics)
   else
     entropy->pub.finish_pass = finish_pass_huff;
 
+  /* Added for ajpegtran
+   *  A sequential gather pass records the symbols for the output pass,
+   *  unless the output pass will be coded in segments on several threads.
+   */
+  entropy->pub.replay_symbols = FALSE;
+  entropy->sym_recording = FALSE;
+  if (gather_statistics && ! cinfo->progressive_mode
+#ifdef C_PARALLEL_SUPPORTED
+      && (cinfo->num_threads <= 1 || cinfo->restart_interval == 0)
+#endif
+      ) {
+    long blocks = 0;
+    for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+      compptr = cinfo->cur_comp_info[ci];
+      blocks += (long) compptr->width_in_blocks *
+		(long) compptr->height_in_blocks;
+    }
+    /* Limit the stream to SYM_LIMIT_PER_BLOCK entries per block */
+    entropy->sym_chunks_left =
+      blocks * SYM_LIMIT_PER_BLOCK / SYM_CHUNK_SIZE + 1;
+    entropy->sym_cur = NULL;
+    entropy->sym_recording = TRUE;
+  } else if (! gather_statistics && entropy->sym_valid) {
+    /* Code the symbols recorded at the gather pass */
+    entropy->pub.replay_symbols = TRUE;
+    entropy->sym_cur = entropy->sym_head;
+    entropy->sym_pos = 0;
+  }
+  entropy->sym_valid = FALSE;
+
+  /* Added for ajpegtran
+   *  Only sequential output passes can be coded in segments.
+   */
+  if (gather_statistics || cinfo->progressive_mode ||
+      entropy->pub.replay_symbols)
+    entropy->pub.encode_segment = NULL;
+  else
+    entropy->pub.encode_segment = encode_segment_huff;
+
   if (cinfo->progressive_mode) {
     entropy->cinfo = cinfo;
     entropy->gather_statistics = gather_statistics;
@@ -1487,9 +1920,11 @@ start_pass_huff (j_compress_ptr cinfo, boolean gather_statistics)
     entropy->BE = 0;
   } else {
     if (gather_statistics)
-      entropy->pub.encode_mcu = encode_mcu_gather;
+      entropy->pub.encode_mcu = entropy->sym_recording ?
+	encode_mcu_gather_record : encode_mcu_gather;
     else
-      entropy->pub.encode_mcu = encode_mcu_huff;
+      entropy->pub.encode_mcu = entropy->pub.replay_symbols ?
+	encode_mcu_replay : encode_mcu_huff;
   }
 
   for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
@@ -1568,6 +2003,11 @@ jinit_huff_encoder (j_compress_ptr cinfo)
     entropy->dc_count_ptrs[i] = entropy->ac_count_ptrs[i] = NULL;
   }
 
+  /* Added for ajpegtran */
+  entropy->pub.replay_symbols = FALSE;
+  entropy->sym_head = NULL;
+  entropy->sym_valid = FALSE;
+
   if (cinfo->progressive_mode)
     entropy->bit_buffer = NULL;	/* needed only in AC refinement scan */
 }
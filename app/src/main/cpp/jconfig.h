@@ -70,6 +70,14 @@
  */
 #undef NEED_SYS_TYPES_H
 
+/* Added for ajpegtran
+ * Define this if your compiler has __builtin_clz (count leading zeros).
+ * The encoders use it to find the bit length of coefficients.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_BUILTIN_CLZ
+#endif
+
 /* For 80x86 machines, you need to define NEED_FAR_POINTERS,
  * unless you are using a large-data memory model or 80386 flat-memory mode.
  * On less brain-damaged CPUs this symbol must not be defined.
@@ -0,0 +1,477 @@
+/*
+ * jcscans.c
+ *
+ * Added for ajpegtran.
+ * This file is part of the ajpegtran extension of the Independent JPEG
+ * Group's software.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file contains a search for a progressive scan script of minimal
+ * coded size, for transcoding with optimized Huffman tables.
+ *
+ * In a progressive Huffman file every scan gets its own optimal tables,
+ * so the size of a scan does not depend on the other scans.  We therefore
+ * count the symbols each candidate scan would produce (exactly as jchuff.c
+ * does in its gathering pass), build the optimal table for the counts,
+ * and add up the resulting sizes.  For each component the best combination
+ * of successive approximation (Al = 0..MAX_SEARCH_AL, each refined by one
+ * scan over 1..63) and spectral split of the first AC scan is selected;
+ * for the DC coefficients, Al = 0 or 1.  All candidate scans of a component
+ * are counted in one pass over its coefficients.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+
+#ifdef C_PROGRESSIVE_SUPPORTED
+
+#define MAX_SEARCH_AL	2	/* largest point transform tried for AC */
+#define NUM_SPLITS	4	/* # of spectral splits tried */
+
+/* Last coefficient of the lower band for each split of 1..63 */
+static const int split_points[NUM_SPLITS] = { 2, 5, 8, 12 };
+
+/* Bands of a first AC scan: 1..63, then 1..k and k+1..63 for each split */
+#define NUM_BANDS	(1 + 2 * NUM_SPLITS)
+
+/* MAX_CORR_BITS must match jchuff.c, since it determines when an EOB run
+ * of a refinement scan is forced out.
+ */
+#define MAX_CORR_BITS  1000
+
+/* IRIGHT_SHIFT is like RIGHT_SHIFT, but works on int rather than INT32.
+ * Same as in jchuff.c.
+ */
+
+#ifdef RIGHT_SHIFT_IS_UNSIGNED
+#define ISHIFT_TEMPS	int ishift_temp;
+#define IRIGHT_SHIFT(x,shft)  \
+	((ishift_temp = (x)) < 0 ? \
+	 (ishift_temp >> (shft)) | ((~0) << (16-(shft))) : \
+	 (ishift_temp >> (shft)))
+#else
+#define ISHIFT_TEMPS
+#define IRIGHT_SHIFT(x,shft)	((x) >> (shft))
+#endif
+
+/* Statistics of one candidate scan of one component */
+
+typedef struct {
+  int Ss, Se, Ah, Al;		/* scan parameters */
+  unsigned int EOBRUN;		/* # of pending EOBs */
+  unsigned int BE;		/* # of pending correction bits */
+  long extra_bits;		/* bits output outside Huffman codes */
+  long count[257];		/* symbol counts for the Huffman table */
+} scan_stats;
+
+/* Statistics of all candidate scans of one component */
+
+typedef struct {
+  scan_stats first[MAX_SEARCH_AL+1][NUM_BANDS]; /* first AC scans */
+  scan_stats refine[MAX_SEARCH_AL+1];	/* refine[a]: Ah=a, Al=a-1 */
+  scan_stats dc[2];			/* DC first scans, Al = 0, 1 */
+  long restarts;		/* # of restart markers in each AC scan */
+} comp_stats;
+
+
+LOCAL(void)
+flush_eobrun (scan_stats * st)
+/* Same as emit_eobrun() in jchuff.c */
+{
+  int nbits;
+
+  if (st->EOBRUN > 0) {
+    nbits = JPEG_NBITS_NONZERO(st->EOBRUN) - 1;
+    st->count[nbits << 4]++;
+    st->extra_bits += nbits + st->BE;
+    st->EOBRUN = 0;
+    st->BE = 0;
+  }
+}
+
+
+LOCAL(void)
+count_AC_first (scan_stats * st, const int * absz, int last)
+/* Same as encode_mcu_AC_first() in jchuff.c, but only counting.
+ * absz[] holds the absolute values of the coefficients in zigzag order,
+ * last is the index of the last coefficient that is nonzero after the
+ * point transform.
+ */
+{
+  int Al = st->Al;
+  int Se = st->Se;
+  int end = MIN(Se, last);
+  int r = 0;
+  int k, temp, nbits;
+
+  for (k = st->Ss; k <= end; k++) {
+    if ((temp = absz[k] >> Al) == 0) {
+      r++;
+      continue;
+    }
+    flush_eobrun(st);
+    while (r > 15) {
+      st->count[0xF0]++;
+      r -= 16;
+    }
+    nbits = JPEG_NBITS(temp);
+    st->count[(r << 4) + nbits]++;
+    st->extra_bits += nbits;
+    r = 0;
+  }
+
+  if (end < Se) {		/* trailing zeroes */
+    st->EOBRUN++;
+    if (st->EOBRUN == 0x7FFF)
+      flush_eobrun(st);
+  }
+}
+
+
+LOCAL(void)
+count_AC_refine (scan_stats * st, const int * absz, int last, int eob)
+/* Same as encode_mcu_AC_refine() in jchuff.c, but only counting.
+ * last is as above, eob is the index of the last newly-nonzero coefficient.
+ */
+{
+  int Al = st->Al;
+  int Se = st->Se;
+  int end = MIN(Se, last);
+  int r = 0;
+  unsigned int BR = 0;
+  int k, temp;
+
+  for (k = st->Ss; k <= end; k++) {
+    if ((temp = absz[k] >> Al) == 0) {
+      r++;
+      continue;
+    }
+    while (r > 15 && k <= eob) {
+      flush_eobrun(st);
+      st->count[0xF0]++;
+      r -= 16;
+      st->extra_bits += BR;
+      BR = 0;
+    }
+    if (temp > 1) {		/* correction bit only */
+      BR++;
+      continue;
+    }
+    flush_eobrun(st);
+    st->count[(r << 4) + 1]++;
+    st->extra_bits += 1 + BR;	/* sign bit and correction bits */
+    BR = 0;
+    r = 0;
+  }
+
+  if (end < Se || r > 0 || BR > 0) {
+    st->EOBRUN++;
+    st->BE += BR;
+    if (st->EOBRUN == 0x7FFF || st->BE > (MAX_CORR_BITS-DCTSIZE2+1))
+      flush_eobrun(st);
+  }
+}
+
+
+LOCAL(long)
+scan_cost (j_compress_ptr cinfo, scan_stats * st, long restarts)
+/* Estimated size in bytes of a scan with the given statistics,
+ * including its optimized Huffman table and headers.
+ */
+{
+  JHUFF_TBL htbl;
+  long freq[257];
+  int codesize[256];
+  int len, i, p, nsymbols;
+  long bits;
+
+  flush_eobrun(st);
+
+  MEMCOPY(freq, st->count, SIZEOF(freq));
+  jpeg_gen_optimal_table(cinfo, &htbl, freq);
+
+  MEMZERO(codesize, SIZEOF(codesize));
+  p = 0;
+  for (len = 1; len <= 16; len++)
+    for (i = 0; i < (int) htbl.bits[len]; i++)
+      codesize[htbl.huffval[p++]] = len;
+  nsymbols = p;
+
+  bits = st->extra_bits;
+  for (i = 0; i < 256; i++)
+    bits += st->count[i] * codesize[i];
+
+  /* data, DHT marker, SOS marker (one component), RSTn markers */
+  return (bits + 7) / 8 + (4 + 17 + nsymbols) + 10 + restarts * 2;
+}
+
+
+LOCAL(void)
+init_stats (scan_stats * st, int Ss, int Se, int Ah, int Al)
+{
+  MEMZERO(st, SIZEOF(scan_stats));
+  st->Ss = Ss;
+  st->Se = Se;
+  st->Ah = Ah;
+  st->Al = Al;
+}
+
+
+LOCAL(void)
+restart_stats (comp_stats * cs)
+/* At a restart marker, pending EOB runs are emitted */
+{
+  int al, b;
+
+  for (al = 0; al <= MAX_SEARCH_AL; al++) {
+    for (b = 0; b < NUM_BANDS; b++)
+      flush_eobrun(&cs->first[al][b]);
+    flush_eobrun(&cs->refine[al]);
+  }
+}
+
+
+LOCAL(void)
+gather_component (j_compress_ptr cinfo, jpeg_component_info * compptr,
+		  jvirt_barray_ptr coef_array, comp_stats * cs)
+/* Count the symbols of all candidate scans of one component */
+{
+  const int * natural_order = cinfo->natural_order;
+  JBLOCKARRAY buffer;
+  JCOEFPTR block;
+  JDIMENSION blk_x, blk_y;
+  long interval, togo;
+  int absz[DCTSIZE2];
+  int last[MAX_SEARCH_AL+1];
+  int eob[MAX_SEARCH_AL+1];
+  int last_dc[2];
+  int al, b, k, temp, diff, nbits;
+  ISHIFT_TEMPS
+
+  /* Set up the candidate scans */
+  for (al = 0; al <= MAX_SEARCH_AL; al++) {
+    init_stats(&cs->first[al][0], 1, DCTSIZE2-1, 0, al);
+    for (b = 0; b < NUM_SPLITS; b++) {
+      init_stats(&cs->first[al][1 + 2*b], 1, split_points[b], 0, al);
+      init_stats(&cs->first[al][2 + 2*b], split_points[b] + 1, DCTSIZE2-1,
+		 0, al);
+    }
+    init_stats(&cs->refine[al], 1, DCTSIZE2-1, al, al - 1);
+  }
+  init_stats(&cs->dc[0], 0, 0, 0, 0);
+  init_stats(&cs->dc[1], 0, 0, 0, 1);
+
+  /* Restart interval of a noninterleaved scan, as in per_scan_setup() */
+  if (cinfo->restart_in_rows > 0)
+    interval = MIN((long) cinfo->restart_in_rows *
+		   (long) compptr->width_in_blocks, 65535L);
+  else
+    interval = (long) cinfo->restart_interval;
+  cs->restarts = 0;
+  togo = interval;
+
+  last_dc[0] = last_dc[1] = 0;
+  for (blk_y = 0; blk_y < compptr->height_in_blocks; blk_y++) {
+    buffer = (*cinfo->mem->access_virt_barray)
+      ((j_common_ptr) cinfo, coef_array, blk_y, (JDIMENSION) 1, FALSE);
+    for (blk_x = 0; blk_x < compptr->width_in_blocks; blk_x++) {
+      block = buffer[0][blk_x];
+
+      if (interval) {
+	if (togo == 0) {
+	  restart_stats(cs);
+	  last_dc[0] = last_dc[1] = 0;
+	  cs->restarts++;
+	  togo = interval;
+	}
+	togo--;
+      }
+
+      /* DC first scans */
+      for (al = 0; al < 2; al++) {
+	temp = IRIGHT_SHIFT((int) block[0], al);
+	diff = temp - last_dc[al];
+	last_dc[al] = temp;
+	if (diff < 0)
+	  diff = -diff;
+	nbits = JPEG_NBITS(diff);
+	cs->dc[al].count[nbits]++;
+	cs->dc[al].extra_bits += nbits;
+      }
+
+      /* Absolute values in zigzag order, and the last nonzero/newly-nonzero
+       * coefficient for each point transform.
+       */
+      for (al = 0; al <= MAX_SEARCH_AL; al++)
+	last[al] = eob[al] = 0;
+      for (k = 1; k < DCTSIZE2; k++) {
+	temp = block[natural_order[k]];
+	if (temp < 0)
+	  temp = -temp;
+	absz[k] = temp;
+	if (temp == 0)
+	  continue;
+	for (al = 0; al <= MAX_SEARCH_AL; al++) {
+	  if ((temp >> al) == 0)
+	    break;
+	  last[al] = k;
+	  if ((temp >> al) == 1)
+	    eob[al] = k;
+	}
+      }
+
+      for (al = 0; al <= MAX_SEARCH_AL; al++) {
+	for (b = 0; b < NUM_BANDS; b++)
+	  count_AC_first(&cs->first[al][b], absz, last[al]);
+	if (al > 0)
+	  count_AC_refine(&cs->refine[al], absz, last[al-1], eob[al-1]);
+      }
+    }
+  }
+}
+
+
+/*
+ * Replace the scan script of cinfo with the one of minimal estimated size
+ * for the given coefficient arrays.  The component dimensions must have been
+ * computed (by jinit_c_master_control); the caller must re-run master
+ * selection afterwards so that the new script is validated and counted.
+ */
+
+GLOBAL(void)
+jsearch_scan_script (j_compress_ptr cinfo, jvirt_barray_ptr * coef_arrays)
+{
+  int ncomps = cinfo->num_components;
+  jpeg_component_info * compptr;
+  comp_stats * cs;
+  jpeg_scan_info * scanptr;
+  int best_al[MAX_COMPONENTS];
+  int best_split[MAX_COMPONENTS]; /* -1 for 1..63 in one scan */
+  long dc_cost[2], cost, best_cost, first_cost, refine_cost, c;
+  int ci, al, b, a, dc_al, nscans;
+
+  /* Only for 8x8 blocks, like jpeg_simple_progression's scripts */
+  if (cinfo->block_size != DCTSIZE)
+    return;
+
+  cs = (comp_stats *)
+    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				SIZEOF(comp_stats));
+
+  dc_cost[0] = dc_cost[1] = 0;
+  for (ci = 0, compptr = cinfo->comp_info; ci < ncomps; ci++, compptr++) {
+    gather_component(cinfo, compptr, coef_arrays[ci], cs);
+
+    /* DC cost; the refinement scan costs one bit per block */
+    dc_cost[0] += scan_cost(cinfo, &cs->dc[0], 0L);
+    dc_cost[1] += scan_cost(cinfo, &cs->dc[1], 0L) +
+      ((long) compptr->width_in_blocks * compptr->height_in_blocks + 7) / 8;
+
+    /* Best point transform and split for the AC coefficients */
+    best_cost = 0;
+    refine_cost = 0;
+    for (al = 0; al <= MAX_SEARCH_AL; al++) {
+      if (al > 0)
+	refine_cost += scan_cost(cinfo, &cs->refine[al], cs->restarts);
+      first_cost = scan_cost(cinfo, &cs->first[al][0], cs->restarts);
+      b = -1;
+      for (a = 0; a < NUM_SPLITS; a++) {
+	c = scan_cost(cinfo, &cs->first[al][1 + 2*a], cs->restarts) +
+	    scan_cost(cinfo, &cs->first[al][2 + 2*a], cs->restarts);
+	if (c < first_cost) {
+	  first_cost = c;
+	  b = a;
+	}
+      }
+      cost = first_cost + refine_cost;
+      if (al == 0 || cost < best_cost) {
+	best_cost = cost;
+	best_al[ci] = al;
+	best_split[ci] = b;
+      }
+    }
+  }
+  dc_al = (dc_cost[1] < dc_cost[0]) ? 1 : 0;
+
+  /* Build the script: DC first, AC first scans, then the refinements */
+  nscans = 6 * ncomps;		/* upper bound */
+  scanptr = (jpeg_scan_info *)
+    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+				nscans * SIZEOF(jpeg_scan_info));
+  cinfo->scan_info = scanptr;
+
+  if (ncomps <= MAX_COMPS_IN_SCAN) {
+    scanptr->comps_in_scan = ncomps;
+    for (ci = 0; ci < ncomps; ci++)
+      scanptr->component_index[ci] = ci;
+    scanptr->Ss = scanptr->Se = scanptr->Ah = 0;
+    scanptr->Al = dc_al;
+    scanptr++;
+  } else {
+    for (ci = 0; ci < ncomps; ci++) {
+      scanptr->comps_in_scan = 1;
+      scanptr->component_index[0] = ci;
+      scanptr->Ss = scanptr->Se = scanptr->Ah = 0;
+      scanptr->Al = dc_al;
+      scanptr++;
+    }
+  }
+
+  for (ci = 0; ci < ncomps; ci++) {
+    scanptr->comps_in_scan = 1;
+    scanptr->component_index[0] = ci;
+    scanptr->Ss = 1;
+    scanptr->Se = DCTSIZE2-1;
+    scanptr->Ah = 0;
+    scanptr->Al = best_al[ci];
+    if (best_split[ci] >= 0) {
+      scanptr->Se = split_points[best_split[ci]];
+      scanptr++;
+      scanptr->comps_in_scan = 1;
+      scanptr->component_index[0] = ci;
+      scanptr->Ss = split_points[best_split[ci]] + 1;
+      scanptr->Se = DCTSIZE2-1;
+      scanptr->Ah = 0;
+      scanptr->Al = best_al[ci];
+    }
+    scanptr++;
+  }
+
+  if (dc_al) {
+    if (ncomps <= MAX_COMPS_IN_SCAN) {
+      scanptr->comps_in_scan = ncomps;
+      for (ci = 0; ci < ncomps; ci++)
+	scanptr->component_index[ci] = ci;
+      scanptr->Ss = scanptr->Se = scanptr->Al = 0;
+      scanptr->Ah = 1;
+      scanptr++;
+    } else {
+      for (ci = 0; ci < ncomps; ci++) {
+	scanptr->comps_in_scan = 1;
+	scanptr->component_index[0] = ci;
+	scanptr->Ss = scanptr->Se = scanptr->Al = 0;
+	scanptr->Ah = 1;
+	scanptr++;
+      }
+    }
+  }
+
+  for (a = MAX_SEARCH_AL; a > 0; a--) {
+    for (ci = 0; ci < ncomps; ci++) {
+      if (best_al[ci] < a)
+	continue;
+      scanptr->comps_in_scan = 1;
+      scanptr->component_index[0] = ci;
+      scanptr->Ss = 1;
+      scanptr->Se = DCTSIZE2-1;
+      scanptr->Ah = a;
+      scanptr->Al = a - 1;
+      scanptr++;
+    }
+  }
+
+  cinfo->num_scans = (int) (scanptr - cinfo->scan_info);
+}
+
+#endif /* C_PROGRESSIVE_SUPPORTED */
@@ -15,12 +15,19 @@
 #include "jinclude.h"
 #include "jpeglib.h"
 
+#ifdef C_PARALLEL_SUPPORTED
+#include <pthread.h>
+#endif
+
 
 /* Forward declarations */
 LOCAL(void) transencode_master_selection
 	JPP((j_compress_ptr cinfo, jvirt_barray_ptr * coef_arrays));
 LOCAL(void) transencode_coef_controller
 	JPP((j_compress_ptr cinfo, jvirt_barray_ptr * coef_arrays));
+#ifdef C_PROGRESSIVE_SUPPORTED
+METHODDEF(void) prepare_for_pass_search JPP((j_compress_ptr cinfo));
+#endif
 
 
 /*
@@ -197,6 +204,14 @@ transencode_master_selection (j_compress_ptr cinfo,
   /* We need a special coefficient buffer controller. */
   transencode_coef_controller(cinfo, coef_arrays);
 
+#ifdef C_PROGRESSIVE_SUPPORTED
+  /* Added for ajpegtran
+   *  Choose the scan script from the data at the first pass.
+   */
+  if (cinfo->optimize_scans && cinfo->progressive_mode && ! cinfo->arith_code)
+    cinfo->master->prepare_for_pass = prepare_for_pass_search;
+#endif
+
   jinit_marker_writer(cinfo);
 
   /* We can now tell the memory manager to allocate virtual arrays. */
@@ -233,11 +248,238 @@ typedef struct {
 
   /* Workspace for constructing dummy blocks at right/bottom edges. */
   JBLOCKROW dummy_buffer[C_MAX_BLOCKS_IN_MCU];
+
+#ifdef C_PARALLEL_SUPPORTED
+  /* Added for ajpegtran
+   *  Block rows of each component in the current scan, for worker threads.
+   */
+  JBLOCKARRAY scan_rows[MAX_COMPS_IN_SCAN];
+  boolean scan_done;		/* TRUE if whole scan was coded in parallel */
+#endif
+
+  /* Added for ajpegtran
+   *  Source of jpeg_write_coefficients_stream (NULL for virtual arrays).
+   */
+  j_decompress_ptr stream_src;
+  JMETHOD(void, rewind_src, (j_decompress_ptr srcinfo));
+  int stream_passes;		/* passes started so far */
+  JBLOCKARRAY stream_rows[MAX_COMPONENTS]; /* one iMCU row per component */
 } my_coef_controller;
 
 typedef my_coef_controller * my_coef_ptr;
 
 
+#ifdef C_PARALLEL_SUPPORTED
+
+/* Added for ajpegtran
+ *  Parallel entropy coding of restart intervals.
+ *
+ * Each restart interval is coded independently of the others, so when the
+ * output has restart markers, the MCUs of a scan can be split into runs of
+ * whole intervals and each run entropy-coded on its own thread into its own
+ * buffer.  The buffers are then written out in order; the RSTn markers are
+ * already in them.
+ *
+ * Worker threads must not call the memory manager or the error handler.
+ * So the block rows are looked up beforehand by the main thread.  This
+ * relies on all virtual arrays being kept in memory (jmemnobs.c), which
+ * keeps the row pointers valid.  Errors are reported in the segment and
+ * raised by the main thread after all workers have finished.
+ */
+
+typedef struct {
+  struct jpeg_mcu_segment seg;	/* the run of intervals to code */
+  j_compress_ptr cinfo;		/* owner of the coder */
+  pthread_t thread;		/* worker coding this segment */
+  boolean started;		/* TRUE if the worker was started */
+} my_segment_job;
+
+
+METHODDEF(void)
+get_segment_MCU (j_compress_ptr cinfo, jpeg_mcu_segment_ptr seg,
+		 JDIMENSION MCU_index, JBLOCKROW *MCU_data)
+/* Construct list of pointers to DCT blocks of the given MCU.
+ * Same as in compress_output, but addressed by MCU index within the scan.
+ */
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  JDIMENSION MCU_row = MCU_index / cinfo->MCUs_per_row;
+  JDIMENSION MCU_col_num = MCU_index % cinfo->MCUs_per_row;
+  JDIMENSION last_MCU_col = cinfo->MCUs_per_row - 1;
+  JDIMENSION start_col, blk_row;
+  int blkn, ci, xindex, yindex, blockcnt;
+  JBLOCKROW buffer_ptr;
+  jpeg_component_info *compptr;
+
+  blkn = 0;			/* index of current DCT block within MCU */
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+    compptr = cinfo->cur_comp_info[ci];
+    start_col = MCU_col_num * compptr->MCU_width;
+    blockcnt = (MCU_col_num < last_MCU_col) ? compptr->MCU_width
+					    : compptr->last_col_width;
+    for (yindex = 0; yindex < compptr->MCU_height; yindex++) {
+      blk_row = MCU_row * compptr->MCU_height + yindex;
+      if (blk_row < compptr->height_in_blocks) {
+	/* Fill in pointers to real blocks in this row */
+	buffer_ptr = coef->scan_rows[ci][blk_row] + start_col;
+	for (xindex = 0; xindex < blockcnt; xindex++)
+	  MCU_data[blkn++] = buffer_ptr++;
+      } else {
+	/* At bottom of image, need a whole row of dummy blocks */
+	xindex = 0;
+      }
+      /* Fill in any dummy blocks needed in this row, using the segment's
+       * own dummy blocks since other threads are doing the same.
+       */
+      for (; xindex < compptr->MCU_width; xindex++) {
+	MCU_data[blkn] = seg->dummy_buffer[blkn];
+	MCU_data[blkn][0][0] = MCU_data[blkn-1][0][0];
+	blkn++;
+      }
+    }
+  }
+}
+
+
+LOCAL(void *)
+segment_thread (void * arg)
+/* Worker thread body: code one segment */
+{
+  my_segment_job * job = (my_segment_job *) arg;
+
+  (void) (*job->cinfo->entropy->encode_segment) (job->cinfo, &job->seg);
+  return NULL;
+}
+
+
+LOCAL(void)
+emit_segment_data (j_compress_ptr cinfo, const JOCTET * data, size_t datasize)
+/* Copy coded data of a segment to the destination */
+{
+  struct jpeg_destination_mgr * dest = cinfo->dest;
+  size_t count;
+
+  while (datasize > 0) {
+    count = MIN(datasize, dest->free_in_buffer);
+    MEMCOPY(dest->next_output_byte, data, count);
+    dest->next_output_byte += count;
+    dest->free_in_buffer -= count;
+    data += count;
+    datasize -= count;
+    if (dest->free_in_buffer == 0)
+      if (! (*dest->empty_output_buffer) (cinfo))
+	ERREXIT(cinfo, JERR_CANT_SUSPEND);
+  }
+}
+
+
+LOCAL(void)
+compress_scan_parallel (j_compress_ptr cinfo)
+/* Code the whole current scan as runs of restart intervals in parallel */
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  my_segment_job * jobs;
+  JBLOCKARRAY buffer;
+  JBLOCKROW dummy;
+  JDIMENSION MCU_rows, total_MCUs, num_intervals, intervals_per_job;
+  JDIMENSION iMCU_row, first_MCU;
+  int ci, yindex, i, num_jobs, error_code;
+  jpeg_component_info *compptr;
+
+  /* Look up all block rows of the components in this scan */
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+    compptr = cinfo->cur_comp_info[ci];
+    coef->scan_rows[ci] = (JBLOCKARRAY)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+	(size_t) cinfo->total_iMCU_rows * compptr->v_samp_factor *
+	SIZEOF(JBLOCKROW));
+    for (iMCU_row = 0; iMCU_row < cinfo->total_iMCU_rows; iMCU_row++) {
+      buffer = (*cinfo->mem->access_virt_barray)
+	((j_common_ptr) cinfo, coef->whole_image[compptr->component_index],
+	 iMCU_row * compptr->v_samp_factor,
+	 (JDIMENSION) compptr->v_samp_factor, FALSE);
+      for (yindex = 0; yindex < compptr->v_samp_factor; yindex++)
+	coef->scan_rows[ci][iMCU_row * compptr->v_samp_factor + yindex] =
+	  buffer[yindex];
+    }
+  }
+
+  /* Split the scan into runs of whole restart intervals, one per thread */
+  if (cinfo->comps_in_scan > 1)
+    MCU_rows = cinfo->total_iMCU_rows;
+  else
+    MCU_rows = cinfo->cur_comp_info[0]->height_in_blocks;
+  total_MCUs = MCU_rows * cinfo->MCUs_per_row;
+  num_intervals = (JDIMENSION)
+    jdiv_round_up((long) total_MCUs, (long) cinfo->restart_interval);
+  num_jobs = (int) MIN((JDIMENSION) cinfo->num_threads, num_intervals);
+  intervals_per_job = (JDIMENSION)
+    jdiv_round_up((long) num_intervals, (long) num_jobs);
+  num_jobs = (int)
+    jdiv_round_up((long) num_intervals, (long) intervals_per_job);
+
+  jobs = (my_segment_job *)
+    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				num_jobs * SIZEOF(my_segment_job));
+  dummy = (JBLOCKROW)
+    (*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+      (size_t) num_jobs * C_MAX_BLOCKS_IN_MCU * SIZEOF(JBLOCK));
+  FMEMZERO((void FAR *) dummy,
+	   (size_t) num_jobs * C_MAX_BLOCKS_IN_MCU * SIZEOF(JBLOCK));
+
+  first_MCU = 0;
+  for (i = 0; i < num_jobs; i++) {
+    jobs[i].cinfo = cinfo;
+    jobs[i].started = FALSE;
+    jobs[i].seg.first_MCU = first_MCU;
+    jobs[i].seg.num_MCUs =
+      MIN(intervals_per_job * cinfo->restart_interval, total_MCUs - first_MCU);
+    jobs[i].seg.get_MCU = get_segment_MCU;
+    for (yindex = 0; yindex < C_MAX_BLOCKS_IN_MCU; yindex++)
+      jobs[i].seg.dummy_buffer[yindex] = dummy++;
+    /* Initial guess at the coded size; the coder enlarges as needed */
+    jobs[i].seg.bufsize = (size_t) jobs[i].seg.num_MCUs *
+			  cinfo->blocks_in_MCU * 16 + 256;
+    jobs[i].seg.buffer = (JOCTET *) malloc(jobs[i].seg.bufsize);
+    jobs[i].seg.datasize = 0;
+    jobs[i].seg.error_code = 0;
+    if (jobs[i].seg.buffer == NULL)
+      jobs[i].seg.error_code = JERR_OUT_OF_MEMORY;
+    first_MCU += jobs[i].seg.num_MCUs;
+  }
+
+  /* Start workers for all but the first segment, which we code ourselves.
+   * If a thread can't be started, its segment is coded here afterwards.
+   */
+  for (i = 1; i < num_jobs; i++) {
+    if (jobs[i].seg.error_code == 0)
+      jobs[i].started =
+	(pthread_create(&jobs[i].thread, NULL, segment_thread, &jobs[i]) == 0);
+  }
+  for (i = 0; i < num_jobs; i++) {
+    if (jobs[i].started)
+      pthread_join(jobs[i].thread, NULL);
+    else if (jobs[i].seg.error_code == 0)
+      (void) segment_thread(&jobs[i]);
+  }
+
+  /* Write out the coded data in order */
+  error_code = 0;
+  for (i = 0; i < num_jobs; i++) {
+    if (error_code == 0)
+      error_code = jobs[i].seg.error_code;
+    if (error_code == 0)
+      emit_segment_data(cinfo, jobs[i].seg.buffer, jobs[i].seg.datasize);
+  }
+  for (i = 0; i < num_jobs; i++)
+    free(jobs[i].seg.buffer);
+  if (error_code != 0)
+    ERREXIT(cinfo, error_code);
+}
+
+#endif /* C_PARALLEL_SUPPORTED */
+
+
 LOCAL(void)
 start_iMCU_row (j_compress_ptr cinfo)
 /* Reset within-iMCU-row counters for a new row */
@@ -274,8 +516,23 @@ start_pass_coef (j_compress_ptr cinfo, J_BUF_MODE pass_mode)
   if (pass_mode != JBUF_CRANK_DEST)
     ERREXIT(cinfo, JERR_BAD_BUFFER_MODE);
 
+  /* Added for ajpegtran
+   *  A streamed source is decoded again from the start for each pass,
+   *  unless the entropy encoder codes the symbols recorded at the last pass.
+   */
+  if (coef->stream_src != NULL && coef->stream_passes++ > 0 &&
+      ! cinfo->entropy->replay_symbols) {
+    jpeg_abort_decompress(coef->stream_src);
+    (*coef->rewind_src) (coef->stream_src);
+    (void) jpeg_read_header(coef->stream_src, TRUE);
+    jpeg_start_coefficient_rows(coef->stream_src, coef->stream_rows);
+  }
+
   coef->iMCU_row_num = 0;
   start_iMCU_row(cinfo);
+#ifdef C_PARALLEL_SUPPORTED
+  coef->scan_done = FALSE;
+#endif
 }
 
 
@@ -303,6 +560,60 @@ compress_output (j_compress_ptr cinfo, JSAMPIMAGE input_buf)
   JBLOCKROW buffer_ptr;
   jpeg_component_info *compptr;
 
+#ifdef C_PARALLEL_SUPPORTED
+  /* Added for ajpegtran
+   *  With restart markers and more than one thread, code the whole scan
+   *  at the first call and just count rows for the remaining calls.
+   */
+  if (coef->iMCU_row_num == 0 && cinfo->num_threads > 1 &&
+      cinfo->restart_interval > 0 && coef->whole_image != NULL &&
+      cinfo->entropy->encode_segment != NULL) {
+    compress_scan_parallel(cinfo);
+    coef->scan_done = TRUE;
+  }
+  if (coef->scan_done) {
+    coef->iMCU_row_num++;
+    return TRUE;
+  }
+#endif
+
+  /* Added for ajpegtran
+   *  When the entropy encoder codes recorded symbols, the coefficients
+   *  aren't needed at all.
+   */
+  if (cinfo->entropy->replay_symbols) {
+    for (yoffset = coef->MCU_vert_offset;
+	 yoffset < coef->MCU_rows_per_iMCU_row; yoffset++) {
+      for (MCU_col_num = coef->mcu_ctr; MCU_col_num < cinfo->MCUs_per_row;
+	   MCU_col_num++) {
+	if (! (*cinfo->entropy->encode_mcu) (cinfo, (JBLOCKROW *) NULL)) {
+	  /* Suspension forced; update state counters and exit */
+	  coef->MCU_vert_offset = yoffset;
+	  coef->mcu_ctr = MCU_col_num;
+	  return FALSE;
+	}
+      }
+      coef->mcu_ctr = 0;
+    }
+    coef->iMCU_row_num++;
+    start_iMCU_row(cinfo);
+    return TRUE;
+  }
+
+  /* Added for ajpegtran
+   *  A streamed source decodes the row into the row buffer now
+   *  (unless resuming after suspension).
+   */
+  if (coef->stream_src != NULL) {
+    if (coef->mcu_ctr == 0 && coef->MCU_vert_offset == 0)
+      if (jpeg_consume_input(coef->stream_src) == JPEG_SUSPENDED)
+	ERREXIT(cinfo, JERR_CANT_SUSPEND);
+    for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+      compptr = cinfo->cur_comp_info[ci];
+      buffer[ci] = coef->stream_rows[compptr->component_index];
+    }
+  } else
+
   /* Align the virtual buffers for the components used in this scan. */
   for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
     compptr = cinfo->cur_comp_info[ci];
@@ -366,6 +677,29 @@ compress_output (j_compress_ptr cinfo, JSAMPIMAGE input_buf)
 }
 
 
+#ifdef C_PROGRESSIVE_SUPPORTED
+
+/* Added for ajpegtran
+ *  Scan script search (cinfo->optimize_scans).
+ *  The coefficients may still change after jpeg_write_coefficients (the
+ *  transformations of transupp.c are executed after it), so the script is
+ *  chosen at the first pass of jpeg_finish_compress.  Master control is then
+ *  initialized again to validate the new script and count its passes.
+ */
+
+METHODDEF(void)
+prepare_for_pass_search (j_compress_ptr cinfo)
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+
+  jsearch_scan_script(cinfo, coef->whole_image);
+  jinit_c_master_control(cinfo, TRUE /* transcode only */);
+  (*cinfo->master->prepare_for_pass) (cinfo);
+}
+
+#endif /* C_PROGRESSIVE_SUPPORTED */
+
+
 /*
  * Initialize coefficient buffer controller.
  *
@@ -391,6 +725,7 @@ transencode_coef_controller (j_compress_ptr cinfo,
 
   /* Save pointer to virtual arrays */
   coef->whole_image = coef_arrays;
+  coef->stream_src = NULL;	/* Added for ajpegtran */
 
   /* Allocate and pre-zero space for dummy DCT blocks. */
   buffer = (JBLOCKROW)
@@ -401,3 +736,62 @@ transencode_coef_controller (j_compress_ptr cinfo,
     coef->dummy_buffer[i] = buffer + i;
   }
 }
+
+
+/* Added for ajpegtran
+ * Streaming alternative to jpeg_write_coefficients.
+ * The coefficients are pulled from srcinfo one iMCU row at a time
+ * (see jpeg_start_coefficient_rows in jdtrans.c), so no virtual arrays
+ * are needed.  srcinfo must be right after jpeg_read_header, and the
+ * output must have a single scan.  For each further pass (-optimize),
+ * srcinfo is aborted, rewind_src must reposition its data source to the
+ * start of the file, and the file is decoded again.
+ */
+
+GLOBAL(void)
+jpeg_write_coefficients_stream (j_compress_ptr cinfo, j_decompress_ptr srcinfo,
+				JMETHOD(void, rewind_src,
+					(j_decompress_ptr srcinfo)))
+{
+  my_coef_ptr coef;
+  jpeg_component_info *compptr, *srcptr;
+  int ci;
+
+  if (cinfo->global_state != CSTATE_START)
+    ERREXIT1(cinfo, JERR_BAD_STATE, cinfo->global_state);
+  /* Mark all tables to be written */
+  jpeg_suppress_tables(cinfo, FALSE);
+  /* (Re)initialize error mgr and destination modules */
+  (*cinfo->err->reset_error_mgr) ((j_common_ptr) cinfo);
+  (*cinfo->dest->init_destination) (cinfo);
+  /* Perform master selection of active modules */
+  transencode_master_selection(cinfo, (jvirt_barray_ptr *) NULL);
+
+  /* Rows are coded in the order they are decoded, in one interleaved scan */
+  if (cinfo->scan_info != NULL ||
+      srcinfo->num_components != cinfo->num_components)
+    ERREXIT(cinfo, JERR_NOTIMPL);
+
+  coef = (my_coef_ptr) cinfo->coef;
+  coef->stream_src = srcinfo;
+  coef->rewind_src = rewind_src;
+  coef->stream_passes = 0;
+  for (ci = 0, compptr = cinfo->comp_info, srcptr = srcinfo->comp_info;
+       ci < cinfo->num_components; ci++, compptr++, srcptr++) {
+    if (srcptr->h_samp_factor != compptr->h_samp_factor ||
+	srcptr->v_samp_factor != compptr->v_samp_factor ||
+	srcptr->width_in_blocks != compptr->width_in_blocks ||
+	srcptr->height_in_blocks != compptr->height_in_blocks)
+      ERREXIT(cinfo, JERR_NOTIMPL);
+    coef->stream_rows[ci] = (*cinfo->mem->alloc_barray)
+      ((j_common_ptr) cinfo, JPOOL_IMAGE,
+       (JDIMENSION) jround_up((long) compptr->width_in_blocks,
+			      (long) compptr->h_samp_factor),
+       (JDIMENSION) compptr->v_samp_factor);
+  }
+  jpeg_start_coefficient_rows(srcinfo, coef->stream_rows);
+
+  /* Wait for jpeg_finish_compress() call */
+  cinfo->next_scanline = 0;	/* so jpeg_write_marker works */
+  cinfo->global_state = CSTATE_WRCOEFS;
+}
@@ -102,6 +102,19 @@ get_byte (j_decompress_ptr cinfo)
  * derived from Markus Kuhn's JBIG implementation.
  */
 
+/* Modified for ajpegtran
+ *  Speed up renormalization.
+ *  - The coder registers are kept in local variables during the whole
+ *    renormalization and decision, and stored back once at the end.
+ *    Since the statistics bin is accessed through a char pointer, which
+ *    may alias anything, the compiler can't keep e->a, e->c and e->ct in
+ *    registers otherwise.
+ *  - Data bytes are read directly from the source buffer as long as it
+ *    is not empty and the byte is not 0xFF; get_byte and the source
+ *    manager are only used for refilling and for marker handling.
+ */
+
+INLINE
 LOCAL(int)
 arith_decode (j_decompress_ptr cinfo, unsigned char *st)
 {
@@ -109,14 +122,27 @@ arith_decode (j_decompress_ptr cinfo, unsigned char *st)
   register unsigned char nl, nm;
   register INT32 qe, temp;
   register int sv, data;
+  register INT32 a, c;
+  register int ct;
+  struct jpeg_source_mgr * src;
+
+  a = e->a;
+  c = e->c;
+  ct = e->ct;
 
   /* Renormalization & data input per section D.2.6 */
-  while (e->a < 0x8000L) {
-    if (--e->ct < 0) {
+  while (a < 0x8000L) {
+    if (--ct < 0) {
       /* Need to fetch next data byte */
+      src = cinfo->src;
       if (cinfo->unread_marker)
 	data = 0;		/* stuff zero data */
-      else {
+      else if (src->bytes_in_buffer > 0 &&
+	       (data = GETJOCTET(*src->next_input_byte)) != 0xFF) {
+	/* Fast path: take the byte directly from the source buffer */
+	src->next_input_byte++;
+	src->bytes_in_buffer--;
+      } else {
 	data = get_byte(cinfo);	/* read next input byte */
 	if (data == 0xFF) {	/* zero stuff or marker code */
 	  do data = get_byte(cinfo);
@@ -135,14 +161,14 @@ arith_decode (j_decompress_ptr cinfo, unsigned char *st)
 	  }
 	}
       }
-      e->c = (e->c << 8) | data; /* insert data into C register */
-      if ((e->ct += 8) < 0)	 /* update bit shift counter */
+      c = (c << 8) | data;	/* insert data into C register */
+      if ((ct += 8) < 0)	/* update bit shift counter */
 	/* Need more initial bytes */
-	if (++e->ct == 0)
+	if (++ct == 0)
 	  /* Got 2 initial bytes -> re-init A and exit loop */
-	  e->a = 0x8000L; /* => e->a = 0x10000L after loop exit */
+	  a = 0x8000L;		/* => a = 0x10000L after loop exit */
     }
-    e->a <<= 1;
+    a <<= 1;
   }
 
   /* Fetch values from our compact representation of Table D.3(D.2):
@@ -154,23 +180,23 @@ arith_decode (j_decompress_ptr cinfo, unsigned char *st)
   nm = qe & 0xFF; qe >>= 8;	/* Next_Index_MPS */
 
   /* Decode & estimation procedures per sections D.2.4 & D.2.5 */
-  temp = e->a - qe;
-  e->a = temp;
-  temp <<= e->ct;
-  if (e->c >= temp) {
-    e->c -= temp;
+  temp = a - qe;
+  a = temp;
+  temp <<= ct;
+  if (c >= temp) {
+    c -= temp;
     /* Conditional LPS (less probable symbol) exchange */
-    if (e->a < qe) {
-      e->a = qe;
+    if (a < qe) {
+      a = qe;
       *st = (sv & 0x80) ^ nm;	/* Estimate_after_MPS */
     } else {
-      e->a = qe;
+      a = qe;
       *st = (sv & 0x80) ^ nl;	/* Estimate_after_LPS */
       sv ^= 0x80;		/* Exchange LPS/MPS */
     }
-  } else if (e->a < 0x8000L) {
+  } else if (a < 0x8000L) {
     /* Conditional MPS (more probable symbol) exchange */
-    if (e->a < qe) {
+    if (a < qe) {
       *st = (sv & 0x80) ^ nl;	/* Estimate_after_LPS */
       sv ^= 0x80;		/* Exchange LPS/MPS */
     } else {
@@ -178,6 +204,9 @@ arith_decode (j_decompress_ptr cinfo, unsigned char *st)
     }
   }
 
+  e->a = a;
+  e->c = c;
+  e->ct = ct;
   return sv >> 7;
 }
 
@@ -635,6 +664,24 @@ decode_mcu (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
 }
 
 
+/* Added for ajpegtran
+ *  Allocate the DC and AC statistics areas of a table number together,
+ *  so that the bins used for one component are adjacent in memory.
+ */
+
+LOCAL(void)
+alloc_stats (j_decompress_ptr cinfo, int tbl)
+{
+  arith_entropy_ptr entropy = (arith_entropy_ptr) cinfo->entropy;
+  unsigned char * stats;
+
+  stats = (unsigned char *) (*cinfo->mem->alloc_small)
+    ((j_common_ptr) cinfo, JPOOL_IMAGE, DC_STAT_BINS + AC_STAT_BINS);
+  entropy->dc_stats[tbl] = stats;
+  entropy->ac_stats[tbl] = stats + DC_STAT_BINS;
+}
+
+
 /*
  * Initialize for an arithmetic-compressed scan.
  */
@@ -716,8 +763,7 @@ start_pass (j_decompress_ptr cinfo)
       if (tbl < 0 || tbl >= NUM_ARITH_TBLS)
 	ERREXIT1(cinfo, JERR_NO_ARITH_TABLE, tbl);
       if (entropy->dc_stats[tbl] == NULL)
-	entropy->dc_stats[tbl] = (unsigned char *) (*cinfo->mem->alloc_small)
-	  ((j_common_ptr) cinfo, JPOOL_IMAGE, DC_STAT_BINS);
+	alloc_stats(cinfo, tbl);
       MEMZERO(entropy->dc_stats[tbl], DC_STAT_BINS);
       /* Initialize DC predictions to 0 */
       entropy->last_dc_val[ci] = 0;
@@ -729,8 +775,7 @@ start_pass (j_decompress_ptr cinfo)
       if (tbl < 0 || tbl >= NUM_ARITH_TBLS)
 	ERREXIT1(cinfo, JERR_NO_ARITH_TABLE, tbl);
       if (entropy->ac_stats[tbl] == NULL)
-	entropy->ac_stats[tbl] = (unsigned char *) (*cinfo->mem->alloc_small)
-	  ((j_common_ptr) cinfo, JPOOL_IMAGE, AC_STAT_BINS);
+	alloc_stats(cinfo, tbl);
       MEMZERO(entropy->ac_stats[tbl], AC_STAT_BINS);
     }
   }
@@ -772,6 +817,7 @@ jinit_arith_decoder (j_decompress_ptr cinfo)
   cinfo->entropy = &entropy->pub;
   entropy->pub.start_pass = start_pass;
   entropy->pub.finish_pass = finish_pass;
+  entropy->pub.skip_interval = NULL;	/* Added for ajpegtran */
 
   /* Mark tables unallocated */
   for (i = 0; i < NUM_ARITH_TBLS; i++) {
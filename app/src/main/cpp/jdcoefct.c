@@ -24,6 +24,67 @@
 #undef BLOCK_SMOOTHING_SUPPORTED
 #endif
 
+/* Parallel decoding of scans needs the full-image buffer */
+#ifndef D_MULTISCAN_FILES_SUPPORTED
+#undef D_PARALLEL_SUPPORTED
+#endif
+
+#ifdef D_PARALLEL_SUPPORTED
+#include <setjmp.h>
+#include <pthread.h>
+
+/* Added for ajpegtran
+ *  Parallel decoding of noninterleaved scans.
+ *  In a sequential multi-scan file, a scan of a single component can be
+ *  decoded independently of the other scans.  While reading the file, the
+ *  entropy-coded data of such a scan is only copied into memory, and a
+ *  private copy of the decompressor is set up for it (with its own entropy
+ *  decoder, Huffman tables, source, marker state and error handler).
+ *  At EOI the stored scans are decoded on threads, each into the virtual
+ *  array of its own component.
+ */
+
+#define SCAN_CHUNK_SIZE  65536	/* bytes per chunk of stored scan data */
+
+typedef struct scan_chunk * scan_chunk_ptr;
+
+typedef struct scan_chunk {
+  scan_chunk_ptr next;		/* next chunk, or NULL */
+  size_t size;			/* # of bytes used */
+  JOCTET data[SCAN_CHUNK_SIZE];
+} scan_chunk;
+
+typedef struct {
+  struct jpeg_error_mgr pub;	/* "public" fields */
+  jmp_buf setjmp_buffer;	/* for return from a failed scan */
+  boolean failed;		/* error_exit was called */
+  struct jpeg_error_mgr warning; /* state at the first warning */
+} scan_error_mgr;
+
+typedef struct {
+  struct jpeg_source_mgr pub;	/* public fields */
+  scan_chunk_ptr next_chunk;	/* chunk to be read next */
+} scan_source_mgr;
+
+typedef struct scan_job * scan_job_ptr;
+
+typedef struct scan_job {
+  scan_job_ptr next;		/* next stored scan, or NULL */
+  struct jpeg_decompress_struct info; /* private copy of the decompressor */
+  struct jpeg_marker_reader marker; /* private restart marker state */
+  scan_error_mgr err;		/* private error handler */
+  scan_source_mgr src;		/* reads the stored data */
+  scan_chunk_ptr first_chunk, last_chunk; /* stored entropy-coded data */
+  int ci;			/* index of the scan's component */
+  JDIMENSION width_in_blocks;	/* size of the component */
+  JDIMENSION height_in_blocks;
+  JBLOCKARRAY rows;		/* block rows, looked up by the main thread */
+  pthread_t thread;		/* worker decoding this scan */
+  boolean started;		/* TRUE if the worker was started */
+} scan_job;
+
+#endif /* D_PARALLEL_SUPPORTED */
+
 /* Private buffer controller object */
 
 typedef struct {
@@ -57,6 +118,26 @@ typedef struct {
   /* When doing block smoothing, we latch coefficient Al values here */
   int * coef_bits_latch;
 #define SAVED_COEFS  6		/* we save coef_bits[0..5] */
+#endif
+
+  /* Added for ajpegtran
+   *  Skipping restart intervals outside of the read area.
+   *  The area is converted to MCUs of the current scan.
+   */
+  boolean skip_intervals;	/* TRUE if skipping is possible in this scan */
+  JDIMENSION area_x0, area_x1;	/* MCU columns in the area */
+  JDIMENSION area_y0, area_y1;	/* MCU rows in the area */
+  unsigned int skip_MCUs;	/* MCUs left in the interval being skipped */
+  JDIMENSION stop_iMCU_row;	/* iMCU rows needed from a single-scan file */
+
+#ifdef D_PARALLEL_SUPPORTED
+  /* Added for ajpegtran
+   *  Scans stored for parallel decoding.
+   */
+  scan_job_ptr jobs;		/* stored scans not decoded yet */
+  scan_job_ptr cur_job;		/* scan being stored */
+  boolean stored_ff;		/* last stored byte was 0xFF */
+  boolean stored[MAX_COMPONENTS]; /* component has a stored scan */
 #endif
 } my_coef_controller;
 
@@ -66,9 +147,15 @@ typedef my_coef_controller * my_coef_ptr;
 METHODDEF(int) decompress_onepass
 	JPP((j_decompress_ptr cinfo, JSAMPIMAGE output_buf));
 #ifdef D_MULTISCAN_FILES_SUPPORTED
+METHODDEF(int) consume_data JPP((j_decompress_ptr cinfo));
 METHODDEF(int) decompress_data
 	JPP((j_decompress_ptr cinfo, JSAMPIMAGE output_buf));
 #endif
+#ifdef D_PARALLEL_SUPPORTED
+LOCAL(boolean) start_store JPP((j_decompress_ptr cinfo));
+METHODDEF(int) store_data JPP((j_decompress_ptr cinfo));
+METHODDEF(void) decode_pending JPP((j_decompress_ptr cinfo));
+#endif
 #ifdef BLOCK_SMOOTHING_SUPPORTED
 LOCAL(boolean) smoothing_ok JPP((j_decompress_ptr cinfo));
 METHODDEF(int) decompress_smooth_data
@@ -107,6 +194,58 @@ start_iMCU_row (j_decompress_ptr cinfo)
 METHODDEF(void)
 start_input_pass (j_decompress_ptr cinfo)
 {
+#ifdef D_MULTISCAN_FILES_SUPPORTED
+  /* Added for ajpegtran
+   *  Set up skipping of restart intervals outside of the read area.
+   *  In an interleaved scan, an MCU spans the max sampling factors;
+   *  in a noninterleaved scan, it is one block of the component.
+   *  If the file has only this scan, decoding stops below the area.
+   */
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  long h_units, v_units;
+
+  coef->skip_intervals = FALSE;
+  coef->skip_MCUs = 0;
+  coef->stop_iMCU_row = cinfo->total_iMCU_rows;
+  if (coef->pub.coef_arrays != NULL && cinfo->read_area_width != 0 &&
+      cinfo->read_area_height != 0 &&
+      ! cinfo->inputctl->has_multiple_scans) {
+    coef->stop_iMCU_row = (JDIMENSION)
+      jdiv_round_up((long) cinfo->read_area_y + (long) cinfo->read_area_height,
+		    (long) cinfo->max_v_samp_factor * cinfo->block_size);
+    if (coef->stop_iMCU_row > cinfo->total_iMCU_rows)
+      coef->stop_iMCU_row = cinfo->total_iMCU_rows;
+  }
+  if (coef->pub.coef_arrays != NULL && cinfo->read_area_width != 0 &&
+      cinfo->read_area_height != 0 && cinfo->restart_interval != 0 &&
+      cinfo->entropy->skip_interval != NULL) {
+    h_units = (long) cinfo->max_h_samp_factor * cinfo->block_size;
+    v_units = (long) cinfo->max_v_samp_factor * cinfo->block_size;
+    if (cinfo->comps_in_scan == 1) {
+      h_units /= cinfo->cur_comp_info[0]->h_samp_factor;
+      v_units /= cinfo->cur_comp_info[0]->v_samp_factor;
+    }
+    coef->area_x0 = (JDIMENSION) (cinfo->read_area_x / h_units);
+    coef->area_y0 = (JDIMENSION) (cinfo->read_area_y / v_units);
+    coef->area_x1 = (JDIMENSION) jdiv_round_up((long) cinfo->read_area_x +
+				   (long) cinfo->read_area_width, h_units);
+    coef->area_y1 = (JDIMENSION) jdiv_round_up((long) cinfo->read_area_y +
+				   (long) cinfo->read_area_height, v_units);
+    coef->skip_intervals = TRUE;
+  }
+#endif
+
+#ifdef D_PARALLEL_SUPPORTED
+  /* Added for ajpegtran
+   *  Store the scan for parallel decoding if possible.
+   */
+  if (coef->pub.coef_arrays != NULL) {
+    coef->pub.consume_data = consume_data;
+    if (start_store(cinfo))
+      coef->pub.consume_data = store_data;
+  }
+#endif
+
   cinfo->input_iMCU_row = 0;
   start_iMCU_row(cinfo);
 }
@@ -235,6 +374,37 @@ dummy_consume_data (j_decompress_ptr cinfo)
 
 #ifdef D_MULTISCAN_FILES_SUPPORTED
 
+/* Added for ajpegtran
+ *  Check whether the restart interval beginning at the given MCU of the
+ *  current scan lies entirely outside of the read area.
+ */
+
+LOCAL(boolean)
+interval_outside_area (j_decompress_ptr cinfo, JDIMENSION MCU_row,
+		       JDIMENSION MCU_col_num)
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  JDIMENSION MCUs_per_row = cinfo->MCUs_per_row;
+  JDIMENSION first_row, last_row, last_col, row, col0, col1;
+  long last;
+
+  last = (long) MCU_row * MCUs_per_row + MCU_col_num +
+	 cinfo->restart_interval - 1;
+  first_row = MCU_row;
+  last_row = (JDIMENSION) (last / MCUs_per_row);
+  last_col = (JDIMENSION) (last % MCUs_per_row);
+
+  for (row = MAX(first_row, coef->area_y0);
+       row <= last_row && row < coef->area_y1; row++) {
+    col0 = (row == first_row) ? MCU_col_num : 0;
+    col1 = (row == last_row) ? last_col : MCUs_per_row - 1;
+    if (col0 < coef->area_x1 && col1 >= coef->area_x0)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+
 /*
  * Consume input data and store it in the full-image coefficient buffer.
  * We read as much as one fully interleaved MCU row ("iMCU" row) per call,
@@ -247,6 +417,7 @@ consume_data (j_decompress_ptr cinfo)
 {
   my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
   JDIMENSION MCU_col_num;	/* index of current MCU within row */
+  JDIMENSION MCU_row;		/* index of current MCU row within scan */
   int blkn, ci, xindex, yindex, yoffset;
   JDIMENSION start_col;
   JBLOCKARRAY buffer[MAX_COMPS_IN_SCAN];
@@ -271,6 +442,30 @@ consume_data (j_decompress_ptr cinfo)
        yoffset++) {
     for (MCU_col_num = coef->MCU_ctr; MCU_col_num < cinfo->MCUs_per_row;
 	 MCU_col_num++) {
+      /* Added for ajpegtran
+       *  Skip restart intervals outside of the read area.
+       */
+      if (coef->skip_intervals) {
+	if (coef->skip_MCUs) {
+	  coef->skip_MCUs--;
+	  continue;
+	}
+	MCU_row = cinfo->input_iMCU_row *
+	  (cinfo->comps_in_scan > 1 ? 1 : cinfo->cur_comp_info[0]->v_samp_factor)
+	  + (JDIMENSION) yoffset;
+	if (((long) MCU_row * cinfo->MCUs_per_row + MCU_col_num) %
+	    cinfo->restart_interval == 0 &&
+	    interval_outside_area(cinfo, MCU_row, MCU_col_num)) {
+	  if (! (*cinfo->entropy->skip_interval) (cinfo)) {
+	    /* Suspension forced; update state counters and exit */
+	    coef->MCU_vert_offset = yoffset;
+	    coef->MCU_ctr = MCU_col_num;
+	    return JPEG_SUSPENDED;
+	  }
+	  coef->skip_MCUs = cinfo->restart_interval - 1;
+	  continue;
+	}
+      }
       /* Construct list of pointers to DCT blocks belonging to this MCU */
       blkn = 0;			/* index of current DCT block within MCU */
       for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
@@ -296,6 +491,15 @@ consume_data (j_decompress_ptr cinfo)
   }
   /* Completed the iMCU row, advance counters for next one */
   if (++(cinfo->input_iMCU_row) < cinfo->total_iMCU_rows) {
+    /* Added for ajpegtran
+     *  Nothing below the read area is needed from a single-scan file,
+     *  so the rest of the file is not read at all.
+     */
+    if (cinfo->input_iMCU_row >= coef->stop_iMCU_row) {
+      (*cinfo->inputctl->finish_input_pass) (cinfo);
+      cinfo->inputctl->eoi_reached = TRUE;
+      return JPEG_REACHED_EOI;
+    }
     start_iMCU_row(cinfo);
     return JPEG_ROW_COMPLETED;
   }
@@ -305,6 +509,351 @@ consume_data (j_decompress_ptr cinfo)
 }
 
 
+#ifdef D_PARALLEL_SUPPORTED
+
+/* Added for ajpegtran
+ *  Data source and error handler of a stored scan.
+ *  The source returns the stored chunks, followed by a fake EOI marker.
+ *  Warnings and errors of a worker are kept in its job and reported
+ *  by the main thread, because errmsgbuffer is shared.
+ */
+
+METHODDEF(void)
+init_scan_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+METHODDEF(boolean)
+fill_scan_input_buffer (j_decompress_ptr cinfo)
+{
+  scan_source_mgr * src = (scan_source_mgr *) cinfo->src;
+  static const JOCTET fake_eoi[2] = { (JOCTET) 0xFF, (JOCTET) JPEG_EOI };
+
+  if (src->next_chunk != NULL) {
+    src->pub.next_input_byte = src->next_chunk->data;
+    src->pub.bytes_in_buffer = src->next_chunk->size;
+    src->next_chunk = src->next_chunk->next;
+  } else {
+    src->pub.next_input_byte = fake_eoi;
+    src->pub.bytes_in_buffer = 2;
+  }
+  return TRUE;
+}
+
+METHODDEF(void)
+skip_scan_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  struct jpeg_source_mgr * src = cinfo->src;
+
+  if (num_bytes > 0) {
+    while (num_bytes > (long) src->bytes_in_buffer) {
+      num_bytes -= (long) src->bytes_in_buffer;
+      (void) (*src->fill_input_buffer) (cinfo);
+    }
+    src->next_input_byte += (size_t) num_bytes;
+    src->bytes_in_buffer -= (size_t) num_bytes;
+  }
+}
+
+METHODDEF(void)
+term_scan_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+METHODDEF(noreturn_t)
+scan_error_exit (j_common_ptr cinfo)
+{
+  scan_error_mgr * err = (scan_error_mgr *) cinfo->err;
+
+  err->failed = TRUE;
+  longjmp(err->setjmp_buffer, 1);
+}
+
+METHODDEF(void)
+scan_output_message (j_common_ptr cinfo)
+{
+  scan_error_mgr * err = (scan_error_mgr *) cinfo->err;
+
+  /* Called for the first warning only (trace_level is 0) */
+  if (err->pub.num_warnings == 0)
+    MEMCOPY(&err->warning, &err->pub, SIZEOF(struct jpeg_error_mgr));
+}
+
+
+/* Added for ajpegtran
+ *  Set up storing of the current scan, if it can be decoded in parallel.
+ *  This is done for noninterleaved scans of a sequential Huffman coded
+ *  file with multiple scans, read by jpeg_read_coefficients.
+ *  The private decompressor gets its own copies of the Huffman tables,
+ *  because a later DHT marker may redefine them in place.
+ */
+
+LOCAL(boolean)
+start_store (j_decompress_ptr cinfo)
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  jpeg_component_info *compptr;
+  scan_job_ptr job, *prev;
+  JHUFF_TBL *htbl;
+  int i;
+
+  coef->cur_job = NULL;
+  if (cinfo->num_threads <= 1 || cinfo->global_state != DSTATE_RDCOEFS ||
+      ! cinfo->inputctl->has_multiple_scans || cinfo->progressive_mode ||
+      cinfo->arith_code || cinfo->comps_in_scan != 1 || coef->skip_intervals)
+    return FALSE;
+
+  compptr = cinfo->cur_comp_info[0];
+  /* Decode the stored scan first if this component was stored before */
+  if (coef->stored[compptr->component_index])
+    decode_pending(cinfo);
+
+  job = (scan_job_ptr)
+    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				SIZEOF(scan_job));
+  MEMCOPY(&job->info, cinfo, SIZEOF(struct jpeg_decompress_struct));
+  for (i = 0; i < NUM_HUFF_TBLS; i++) {
+    job->info.dc_huff_tbl_ptrs[i] = NULL;
+    job->info.ac_huff_tbl_ptrs[i] = NULL;
+  }
+  if ((htbl = cinfo->dc_huff_tbl_ptrs[compptr->dc_tbl_no]) != NULL) {
+    job->info.dc_huff_tbl_ptrs[compptr->dc_tbl_no] =
+      jpeg_alloc_huff_table((j_common_ptr) cinfo);
+    MEMCOPY(job->info.dc_huff_tbl_ptrs[compptr->dc_tbl_no], htbl,
+	    SIZEOF(JHUFF_TBL));
+  }
+  if ((htbl = cinfo->ac_huff_tbl_ptrs[compptr->ac_tbl_no]) != NULL) {
+    job->info.ac_huff_tbl_ptrs[compptr->ac_tbl_no] =
+      jpeg_alloc_huff_table((j_common_ptr) cinfo);
+    MEMCOPY(job->info.ac_huff_tbl_ptrs[compptr->ac_tbl_no], htbl,
+	    SIZEOF(JHUFF_TBL));
+  }
+  MEMCOPY(&job->marker, cinfo->marker, SIZEOF(struct jpeg_marker_reader));
+  job->marker.next_restart_num = 0;
+  job->marker.discarded_bytes = 0;
+  job->info.marker = &job->marker;
+  job->info.unread_marker = 0;
+  job->src.pub.init_source = init_scan_source;
+  job->src.pub.fill_input_buffer = fill_scan_input_buffer;
+  job->src.pub.skip_input_data = skip_scan_input_data;
+  job->src.pub.resync_to_restart = jpeg_resync_to_restart;
+  job->src.pub.term_source = term_scan_source;
+  job->src.pub.bytes_in_buffer = 0;
+  job->src.pub.next_input_byte = NULL;
+  job->src.next_chunk = NULL;
+  job->info.src = &job->src.pub;
+  /* The entropy decoder is set up here, with the shared error handler */
+  jinit_huff_decoder(&job->info);
+  (*job->info.entropy->start_pass) (&job->info);
+
+  job->first_chunk = job->last_chunk = NULL;
+  job->ci = compptr->component_index;
+  job->width_in_blocks = compptr->width_in_blocks;
+  job->height_in_blocks = compptr->height_in_blocks;
+  job->rows = NULL;
+  job->started = FALSE;
+  job->next = NULL;
+  for (prev = &coef->jobs; *prev != NULL; prev = &(*prev)->next)
+    ;
+  *prev = job;
+  coef->stored[job->ci] = TRUE;
+  coef->cur_job = job;
+  coef->stored_ff = FALSE;
+  return TRUE;
+}
+
+
+LOCAL(void)
+store_bytes (j_decompress_ptr cinfo, const JOCTET * data, size_t count)
+/* Append data to the scan being stored */
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  scan_job_ptr job = coef->cur_job;
+  scan_chunk_ptr chunk;
+  size_t n;
+
+  while (count > 0) {
+    chunk = job->last_chunk;
+    if (chunk == NULL || chunk->size == SCAN_CHUNK_SIZE) {
+      chunk = (scan_chunk_ptr)
+	(*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				    SIZEOF(scan_chunk));
+      chunk->next = NULL;
+      chunk->size = 0;
+      if (job->last_chunk == NULL)
+	job->first_chunk = chunk;
+      else
+	job->last_chunk->next = chunk;
+      job->last_chunk = chunk;
+    }
+    n = MIN(count, SCAN_CHUNK_SIZE - chunk->size);
+    MEMCOPY(chunk->data + chunk->size, data, n);
+    chunk->size += n;
+    data += n;
+    count -= n;
+  }
+}
+
+
+/* Added for ajpegtran
+ *  Consume-input routine for a stored scan.
+ *  The entropy-coded data is copied until a marker other than RSTn is
+ *  found, which is left in unread_marker for the input controller.
+ *  A 0xFF before the marker is stored too; it is read as a fill byte.
+ * Return value is JPEG_SCAN_COMPLETED or JPEG_SUSPENDED.
+ */
+
+METHODDEF(int)
+store_data (j_decompress_ptr cinfo)
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  struct jpeg_source_mgr * src = cinfo->src;
+  const JOCTET * ptr;
+  size_t count;
+  int c;
+
+  for (;;) {
+    if (src->bytes_in_buffer == 0)
+      if (! (*src->fill_input_buffer) (cinfo))
+	return JPEG_SUSPENDED;
+    if (coef->stored_ff) {
+      c = GETJOCTET(*src->next_input_byte);
+      if (c != 0 && c != 0xFF && (c < JPEG_RST0 || c > JPEG_RST0 + 7)) {
+	src->next_input_byte++;
+	src->bytes_in_buffer--;
+	cinfo->unread_marker = c;
+	break;
+      }
+      coef->stored_ff = FALSE;
+    }
+    /* Store the bytes up to and including the next 0xFF */
+    ptr = (const JOCTET *)
+      memchr(src->next_input_byte, 0xFF, src->bytes_in_buffer);
+    count = (ptr != NULL) ? (size_t) (ptr - src->next_input_byte) + 1 :
+			    src->bytes_in_buffer;
+    store_bytes(cinfo, src->next_input_byte, count);
+    src->next_input_byte += count;
+    src->bytes_in_buffer -= count;
+    coef->stored_ff = (ptr != NULL);
+  }
+
+  /* Completed the scan */
+  coef->cur_job = NULL;
+  cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+  (*cinfo->inputctl->finish_input_pass) (cinfo);
+  return JPEG_SCAN_COMPLETED;
+}
+
+
+LOCAL(void *)
+scan_thread (void * arg)
+/* Worker thread body: decode one stored scan */
+{
+  scan_job_ptr job = (scan_job_ptr) arg;
+  j_decompress_ptr cinfo = &job->info;
+  JBLOCKROW MCU_buffer[1];
+  JDIMENSION row, col;
+
+  if (setjmp(job->err.setjmp_buffer))
+    return NULL;
+  for (row = 0; row < job->height_in_blocks; row++) {
+    for (col = 0; col < job->width_in_blocks; col++) {
+      MCU_buffer[0] = job->rows[row] + col;
+      (void) (*cinfo->entropy->decode_mcu) (cinfo, MCU_buffer);
+    }
+  }
+  return NULL;
+}
+
+
+/* Added for ajpegtran
+ *  Decode the stored scans, up to num_threads at a time.
+ *  Worker threads must not call the memory manager, so the block rows
+ *  are looked up beforehand by the main thread.  This relies on all
+ *  virtual arrays being kept in memory (jmemnobs.c), which keeps the row
+ *  pointers valid.  The pre-zeroed rows are needed by the entropy decoder.
+ */
+
+METHODDEF(void)
+decode_pending (j_decompress_ptr cinfo)
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  scan_job_ptr job, wave;
+  jpeg_component_info *compptr;
+  JBLOCKARRAY buffer;
+  JDIMENSION iMCU_row;
+  int yindex, i;
+
+  /* Set up all jobs */
+  for (job = coef->jobs; job != NULL; job = job->next) {
+    compptr = cinfo->comp_info + job->ci;
+    job->rows = (JBLOCKARRAY)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+	(size_t) cinfo->total_iMCU_rows * compptr->v_samp_factor *
+	SIZEOF(JBLOCKROW));
+    for (iMCU_row = 0; iMCU_row < cinfo->total_iMCU_rows; iMCU_row++) {
+      buffer = (*cinfo->mem->access_virt_barray)
+	((j_common_ptr) cinfo, coef->whole_image[job->ci],
+	 iMCU_row * compptr->v_samp_factor,
+	 (JDIMENSION) compptr->v_samp_factor, TRUE);
+      for (yindex = 0; yindex < compptr->v_samp_factor; yindex++)
+	job->rows[iMCU_row * compptr->v_samp_factor + yindex] =
+	  buffer[yindex];
+    }
+    jpeg_std_error(&job->err.pub);
+    job->err.pub.error_exit = scan_error_exit;
+    job->err.pub.output_message = scan_output_message;
+    job->err.failed = FALSE;
+    job->info.err = &job->err.pub;
+    job->src.next_chunk = job->first_chunk;
+  }
+
+  /* Run the jobs in waves of num_threads; the first job of each wave
+   * is decoded here.  If a thread can't be started, its job is decoded
+   * here afterwards.
+   */
+  for (wave = coef->jobs; wave != NULL; wave = job) {
+    for (job = wave->next, i = 1; job != NULL && i < cinfo->num_threads;
+	 job = job->next, i++)
+      job->started =
+	(pthread_create(&job->thread, NULL, scan_thread, job) == 0);
+    (void) scan_thread(wave);
+    for (job = wave->next, i = 1; job != NULL && i < cinfo->num_threads;
+	 job = job->next, i++) {
+      if (job->started)
+	pthread_join(job->thread, NULL);
+      else
+	(void) scan_thread(job);
+    }
+  }
+
+  /* Report the warnings and errors of the jobs */
+  job = coef->jobs;
+  coef->jobs = NULL;
+  for (i = 0; i < MAX_COMPONENTS; i++)
+    coef->stored[i] = FALSE;
+  for (; job != NULL; job = job->next) {
+    if (job->err.pub.num_warnings != 0) {
+      cinfo->err->msg_code = job->err.warning.msg_code;
+      MEMCOPY(&cinfo->err->msg_parm, &job->err.warning.msg_parm,
+	      SIZEOF(cinfo->err->msg_parm));
+      (*cinfo->err->emit_message) ((j_common_ptr) cinfo, -1);
+      cinfo->err->num_warnings += job->err.pub.num_warnings - 1;
+    }
+    if (job->err.failed) {
+      cinfo->err->msg_code = job->err.pub.msg_code;
+      MEMCOPY(&cinfo->err->msg_parm, &job->err.pub.msg_parm,
+	      SIZEOF(cinfo->err->msg_parm));
+      (*cinfo->err->error_exit) ((j_common_ptr) cinfo);
+    }
+  }
+}
+
+#endif /* D_PARALLEL_SUPPORTED */
+
+
 /*
  * Decompress and return some data in the multi-pass case.
  * Always attempts to emit one fully interleaved MCU row ("iMCU" row).
@@ -717,6 +1266,15 @@ jinit_d_coef_controller (j_decompress_ptr cinfo, boolean need_full_buffer)
     coef->pub.consume_data = consume_data;
     coef->pub.decompress_data = decompress_data;
     coef->pub.coef_arrays = coef->whole_image; /* link to virtual arrays */
+#ifdef D_PARALLEL_SUPPORTED
+    coef->pub.decode_pending = decode_pending;
+    coef->jobs = NULL;
+    coef->cur_job = NULL;
+    for (ci = 0; ci < MAX_COMPONENTS; ci++)
+      coef->stored[ci] = FALSE;
+#else
+    coef->pub.decode_pending = NULL;
+#endif
 #else
     ERREXIT(cinfo, JERR_NOT_COMPILED);
 #endif
@@ -737,5 +1295,6 @@ jinit_d_coef_controller (j_decompress_ptr cinfo, boolean need_full_buffer)
     coef->pub.consume_data = dummy_consume_data;
     coef->pub.decompress_data = decompress_onepass;
     coef->pub.coef_arrays = NULL; /* flag for no virtual arrays */
+    coef->pub.decode_pending = NULL;
   }
 }
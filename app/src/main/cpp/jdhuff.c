@@ -231,6 +231,7 @@ typedef struct {
   /* These fields are NOT loaded into local working state. */
   boolean insufficient_data;	/* set TRUE after emitting warning */
   unsigned int restarts_to_go;	/* MCUs left in this restart interval */
+  boolean skip_ff;		/* skip_interval saw 0xFF (Added for ajpegtran) */
 
   /* Following two fields used only in progressive mode */
 
@@ -350,6 +351,33 @@ jpeg_make_d_derived_tbl (j_decompress_ptr cinfo, boolean isDC, int tblno,
 				  SIZEOF(d_derived_tbl));
   dtbl = *pdtbl;
   dtbl->pub = htbl;		/* fill in back link */
+
+#if HUFF_LOOKAHEAD == 8
+  /* Added for ajpegtran
+   *  Copy precomputed derived values for a standard table (jstdhuff.c).
+   *  These are known to be valid, so no checks are needed.
+   */
+  if ((i = jpeg_std_huff_index(htbl, isDC)) >= 0) {
+    MEMCOPY(dtbl->maxcode, jpeg_std_d_maxcode[i], SIZEOF(dtbl->maxcode));
+    MEMCOPY(dtbl->valoffset, jpeg_std_d_valoffset[i],
+	    SIZEOF(dtbl->valoffset));
+    for (lookbits = 0; lookbits < (1<<HUFF_LOOKAHEAD); lookbits++)
+      dtbl->look_nbits[lookbits] = jpeg_std_d_look_nbits[i][lookbits];
+    MEMCOPY(dtbl->look_sym, jpeg_std_d_look_sym[i], SIZEOF(dtbl->look_sym));
+    return;
+  }
+#endif
+
+#ifdef HUFF_CACHE_SUPPORTED
+  /* Added for ajpegtran
+   *  Reuse the derived table built for the same table before (jhuffcache.c).
+   */
+  if (jpeg_huff_cache_get(htbl, isDC ? HUFF_CACHE_D_DC : HUFF_CACHE_D_AC,
+			  dtbl, SIZEOF(d_derived_tbl))) {
+    dtbl->pub = htbl;		/* fill in back link again */
+    return;
+  }
+#endif
   
   /* Figure C.1: make table of Huffman code length for each symbol */
 
@@ -437,6 +465,14 @@ jpeg_make_d_derived_tbl (j_decompress_ptr cinfo, boolean isDC, int tblno,
 	ERREXIT(cinfo, JERR_BAD_HUFF_TABLE);
     }
   }
+
+#ifdef HUFF_CACHE_SUPPORTED
+  /* Added for ajpegtran
+   *  Keep the validated table for later use.
+   */
+  jpeg_huff_cache_put(htbl, isDC ? HUFF_CACHE_D_DC : HUFF_CACHE_D_AC,
+		      dtbl, SIZEOF(d_derived_tbl));
+#endif
 }
 
 
@@ -681,6 +717,64 @@ process_restart (j_decompress_ptr cinfo)
 }
 
 
+/* Added for ajpegtran
+ *  Skip the restart interval at which the decoder stands.
+ *  The entropy-coded data are only searched for the next marker, which is
+ *  left in unread_marker; then the decoder is set up to process a restart
+ *  (or the end of the scan) at the next decode_mcu call.  The caller must
+ *  not call decode_mcu for the remaining MCUs of the interval.
+ *  Returns FALSE if must suspend; calling again resumes the search.
+ */
+
+METHODDEF(boolean)
+skip_interval_huff (j_decompress_ptr cinfo)
+{
+  huff_entropy_ptr entropy = (huff_entropy_ptr) cinfo->entropy;
+  struct jpeg_source_mgr * datasrc = cinfo->src;
+  const JOCTET * ptr;
+  int c;
+
+  /* Advance past the RSTn marker ahead of the interval, if any */
+  if (entropy->restarts_to_go == 0)
+    if (! process_restart(cinfo))
+      return FALSE;
+
+  /* Drop the buffered bits, they belong to the skipped interval */
+  entropy->bitstate.bits_left = 0;
+
+  while (cinfo->unread_marker == 0) {
+    if (datasrc->bytes_in_buffer == 0)
+      if (! (*datasrc->fill_input_buffer) (cinfo))
+	return FALSE;
+    if (! entropy->skip_ff) {
+      ptr = (const JOCTET *) memchr(datasrc->next_input_byte, 0xFF,
+				    datasrc->bytes_in_buffer);
+      if (ptr == NULL) {
+	datasrc->next_input_byte += datasrc->bytes_in_buffer;
+	datasrc->bytes_in_buffer = 0;
+	continue;
+      }
+      ptr++;
+      datasrc->bytes_in_buffer -= (size_t) (ptr - datasrc->next_input_byte);
+      datasrc->next_input_byte = ptr;
+      entropy->skip_ff = TRUE;
+    } else {
+      c = GETJOCTET(*datasrc->next_input_byte++);
+      datasrc->bytes_in_buffer--;
+      if (c != 0xFF) {		/* FF/FF is fill, FF/00 is stuffed data */
+	entropy->skip_ff = FALSE;
+	if (c != 0)
+	  cinfo->unread_marker = c;
+      }
+    }
+  }
+
+  /* The next decode_mcu call processes the restart */
+  entropy->restarts_to_go = 0;
+  return TRUE;
+}
+
+
 /*
  * Huffman MCU decoding.
  * Each of these routines decodes and returns one MCU's worth of
@@ -1506,6 +1600,7 @@ start_pass_huff_decoder (j_decompress_ptr cinfo)
   entropy->bitstate.bits_left = 0;
   entropy->bitstate.get_buffer = 0; /* unnecessary, but keeps Purify quiet */
   entropy->insufficient_data = FALSE;
+  entropy->skip_ff = FALSE;
 
   /* Initialize restart counter */
   entropy->restarts_to_go = cinfo->restart_interval;
@@ -1528,6 +1623,7 @@ jinit_huff_decoder (j_decompress_ptr cinfo)
   cinfo->entropy = &entropy->pub;
   entropy->pub.start_pass = start_pass_huff_decoder;
   entropy->pub.finish_pass = finish_pass_huff;
+  entropy->pub.skip_interval = skip_interval_huff; /* Added for ajpegtran */
 
   if (cinfo->progressive_mode) {
     /* Create progression status table */
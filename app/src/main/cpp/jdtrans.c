@@ -18,6 +18,8 @@
 
 /* Forward declarations */
 LOCAL(void) transdecode_master_selection JPP((j_decompress_ptr cinfo));
+LOCAL(void) row_coef_controller JPP((j_decompress_ptr cinfo,
+				     JBLOCKARRAY * rows));
 
 
 /*
@@ -72,6 +74,9 @@ jpeg_read_coefficients (j_decompress_ptr cinfo)
 	}
       }
     }
+    /* Added for ajpegtran: decode the scans left for parallel decoding */
+    if (cinfo->coef->decode_pending != NULL)
+      (*cinfo->coef->decode_pending) (cinfo);
     /* Set state so that jpeg_finish_decompress does the right thing */
     cinfo->global_state = DSTATE_STOPPING;
   }
@@ -89,6 +94,46 @@ jpeg_read_coefficients (j_decompress_ptr cinfo)
 }
 
 
+/* Added for ajpegtran
+ * Streaming alternative to jpeg_read_coefficients for single-scan files.
+ * Instead of absorbing the whole file into virtual arrays, each call of
+ * jpeg_consume_input decodes the next iMCU row into the caller's row buffer
+ * and returns JPEG_ROW_COMPLETED (JPEG_SCAN_COMPLETED for the last row).
+ * rows[ci] must have v_samp_factor block rows, each width_in_blocks
+ * rounded up to h_samp_factor.  It is overwritten at every row.
+ * Call this after jpeg_read_header; jpeg_finish_decompress reads the rest.
+ */
+
+GLOBAL(void)
+jpeg_start_coefficient_rows (j_decompress_ptr cinfo, JBLOCKARRAY * rows)
+{
+  if (cinfo->global_state != DSTATE_READY)
+    ERREXIT1(cinfo, JERR_BAD_STATE, cinfo->global_state);
+  /* A later scan would need the coefficients of the earlier ones */
+  if (cinfo->inputctl->has_multiple_scans)
+    ERREXIT(cinfo, JERR_NOTIMPL);
+
+  /* Compute output image dimensions and related values. */
+  jpeg_core_output_dimensions(cinfo);
+
+  /* Entropy decoding: either Huffman or arithmetic coding. */
+  if (cinfo->arith_code)
+    jinit_arith_decoder(cinfo);
+  else {
+    jinit_huff_decoder(cinfo);
+  }
+
+  /* Coefficient controller writing into the row buffer. */
+  row_coef_controller(cinfo, rows);
+
+  /* Initialize input side of decompressor to consume the scan. */
+  (*cinfo->inputctl->start_input_pass) (cinfo);
+
+  /* Rows are read by jpeg_consume_input, the rest by jpeg_finish_decompress */
+  cinfo->global_state = DSTATE_STOPPING;
+}
+
+
 /*
  * Master selection of decompression modules for transcoding.
  * This substitutes for jdmaster.c's initialization of the full decompressor.
@@ -138,3 +183,152 @@ transdecode_master_selection (j_decompress_ptr cinfo)
     cinfo->progress->total_passes = 1;
   }
 }
+
+
+/* Added for ajpegtran
+ * The rest of this file is a special implementation of the coefficient
+ * buffer controller for jpeg_start_coefficient_rows.  This is similar to
+ * consume_data in jdcoefct.c, but it stores one iMCU row at a time into
+ * the caller's row buffer instead of the virtual arrays.
+ */
+
+/* Private buffer controller object */
+
+typedef struct {
+  struct jpeg_d_coef_controller pub; /* public fields */
+
+  JDIMENSION MCU_ctr;		/* counts MCUs processed in current row */
+  int MCU_vert_offset;		/* counts MCU rows within iMCU row */
+  int MCU_rows_per_iMCU_row;	/* number of such rows needed */
+
+  JBLOCKROW MCU_buffer[D_MAX_BLOCKS_IN_MCU];
+
+  JBLOCKARRAY * rows;		/* caller's row buffer for each component */
+} my_row_controller;
+
+typedef my_row_controller * my_row_ptr;
+
+
+LOCAL(void)
+start_row (j_decompress_ptr cinfo)
+/* Reset within-iMCU-row counters and clear the row buffer */
+{
+  my_row_ptr coef = (my_row_ptr) cinfo->coef;
+  jpeg_component_info *compptr;
+  int ci, yindex;
+
+  /* In an interleaved scan, an MCU row is the same as an iMCU row.
+   * In a noninterleaved scan, an iMCU row has v_samp_factor MCU rows.
+   * But at the bottom of the image, process only what's left.
+   */
+  if (cinfo->comps_in_scan > 1) {
+    coef->MCU_rows_per_iMCU_row = 1;
+  } else {
+    if (cinfo->input_iMCU_row < (cinfo->total_iMCU_rows-1))
+      coef->MCU_rows_per_iMCU_row = cinfo->cur_comp_info[0]->v_samp_factor;
+    else
+      coef->MCU_rows_per_iMCU_row = cinfo->cur_comp_info[0]->last_row_height;
+  }
+
+  coef->MCU_ctr = 0;
+  coef->MCU_vert_offset = 0;
+
+  /* The entropy decoder expects zeroed blocks */
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+    compptr = cinfo->cur_comp_info[ci];
+    for (yindex = 0; yindex < compptr->v_samp_factor; yindex++)
+      FMEMZERO((void FAR *) coef->rows[compptr->component_index][yindex],
+	       (size_t) jround_up((long) compptr->width_in_blocks,
+				  (long) compptr->h_samp_factor)
+	       * SIZEOF(JBLOCK));
+  }
+}
+
+
+METHODDEF(void)
+start_input_pass_rows (j_decompress_ptr cinfo)
+{
+  cinfo->input_iMCU_row = 0;
+  start_row(cinfo);
+}
+
+
+/*
+ * Decode one iMCU row into the row buffer.
+ * Return value is JPEG_ROW_COMPLETED, JPEG_SCAN_COMPLETED, or JPEG_SUSPENDED.
+ */
+
+METHODDEF(int)
+consume_row (j_decompress_ptr cinfo)
+{
+  my_row_ptr coef = (my_row_ptr) cinfo->coef;
+  JDIMENSION MCU_col_num;	/* index of current MCU within row */
+  int blkn, ci, xindex, yindex, yoffset;
+  JDIMENSION start_col;
+  JBLOCKROW buffer_ptr;
+  jpeg_component_info *compptr;
+
+  /* Start a new row only now, the buffer holds the previous one till here */
+  if (coef->MCU_vert_offset >= coef->MCU_rows_per_iMCU_row)
+    start_row(cinfo);
+
+  /* Loop to process one whole iMCU row */
+  for (yoffset = coef->MCU_vert_offset; yoffset < coef->MCU_rows_per_iMCU_row;
+       yoffset++) {
+    for (MCU_col_num = coef->MCU_ctr; MCU_col_num < cinfo->MCUs_per_row;
+	 MCU_col_num++) {
+      /* Construct list of pointers to DCT blocks belonging to this MCU */
+      blkn = 0;			/* index of current DCT block within MCU */
+      for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+	compptr = cinfo->cur_comp_info[ci];
+	start_col = MCU_col_num * compptr->MCU_width;
+	for (yindex = 0; yindex < compptr->MCU_height; yindex++) {
+	  buffer_ptr = coef->rows[compptr->component_index][yindex+yoffset]
+		       + start_col;
+	  for (xindex = 0; xindex < compptr->MCU_width; xindex++) {
+	    coef->MCU_buffer[blkn++] = buffer_ptr++;
+	  }
+	}
+      }
+      /* Try to fetch the MCU. */
+      if (! (*cinfo->entropy->decode_mcu) (cinfo, coef->MCU_buffer)) {
+	/* Suspension forced; update state counters and exit */
+	coef->MCU_vert_offset = yoffset;
+	coef->MCU_ctr = MCU_col_num;
+	return JPEG_SUSPENDED;
+      }
+    }
+    /* Completed an MCU row, but perhaps not an iMCU row */
+    coef->MCU_ctr = 0;
+  }
+  /* Completed the iMCU row; the next call starts a new one */
+  coef->MCU_vert_offset = coef->MCU_rows_per_iMCU_row;
+  if (++(cinfo->input_iMCU_row) < cinfo->total_iMCU_rows)
+    return JPEG_ROW_COMPLETED;
+  /* Completed the scan */
+  (*cinfo->inputctl->finish_input_pass) (cinfo);
+  return JPEG_SCAN_COMPLETED;
+}
+
+
+/*
+ * Initialize the row buffer controller.
+ */
+
+LOCAL(void)
+row_coef_controller (j_decompress_ptr cinfo, JBLOCKARRAY * rows)
+{
+  my_row_ptr coef;
+
+  coef = (my_row_ptr)
+    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				SIZEOF(my_row_controller));
+  cinfo->coef = &coef->pub;
+  coef->pub.start_input_pass = start_input_pass_rows;
+  coef->pub.consume_data = consume_row;
+  coef->pub.start_output_pass = NULL;	/* no output side */
+  coef->pub.decompress_data = NULL;
+  coef->pub.coef_arrays = NULL;
+  coef->pub.decode_pending = NULL;
+  coef->rows = rows;
+}
@@ -0,0 +1,168 @@
+/*
+ * jhuffcache.c
+ *
+ * Added for ajpegtran.
+ * This file is part of the ajpegtran extension of the Independent JPEG
+ * Group's software.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file contains a process-wide cache of derived Huffman tables.
+ *
+ * A camera or phone usually writes the same custom Huffman tables into
+ * every image.  Building the derived tables for them again for each image
+ * is a waste, so jdhuff.c and jchuff.c keep the derived tables here,
+ * keyed by the contents of the bits[] and huffval[] arrays, and reuse them
+ * in later transcodes.  Standard tables never get here (see jstdhuff.c).
+ *
+ * The cache is shared by all JPEG objects of the process and is protected
+ * by a mutex, so it may be used from several threads at once.  The derived
+ * data are opaque to this module; it just stores and returns copies.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+
+#ifdef HUFF_CACHE_SUPPORTED
+
+#include <pthread.h>
+
+#define HUFF_CACHE_SIZE 32	/* # of derived tables kept */
+
+typedef struct {
+  unsigned int hash;		/* hash of kind, bits[] and huffval[] */
+  int kind;			/* HUFF_CACHE_xxx, or -1 if entry is unused */
+  UINT8 bits[17];		/* copy of the key table */
+  UINT8 huffval[256];
+  size_t size;			/* size of derived data */
+  void * data;			/* derived data (malloc'd, never freed) */
+} huff_cache_entry;
+
+static huff_cache_entry huff_cache[HUFF_CACHE_SIZE];
+static int huff_cache_used = 0;	/* # of entries filled */
+static int huff_cache_next = 0;	/* entry to be replaced next when full */
+static pthread_mutex_t huff_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+LOCAL(int)
+count_symbols (JHUFF_TBL * htbl)
+/* Returns # of symbols in the table, or -1 if the counts are bogus */
+{
+  int len, nsymbols = 0;
+
+  for (len = 1; len <= 16; len++)
+    nsymbols += htbl->bits[len];
+  return (nsymbols > 256) ? -1 : nsymbols;
+}
+
+
+LOCAL(unsigned int)
+hash_table (JHUFF_TBL * htbl, int kind, int nsymbols)
+/* FNV-1a hash of the table contents */
+{
+  unsigned int hash = 2166136261U;
+  int i;
+
+  hash = (hash ^ (unsigned int) kind) * 16777619U;
+  for (i = 1; i <= 16; i++)
+    hash = (hash ^ htbl->bits[i]) * 16777619U;
+  for (i = 0; i < nsymbols; i++)
+    hash = (hash ^ htbl->huffval[i]) * 16777619U;
+  return hash;
+}
+
+
+LOCAL(huff_cache_entry *)
+find_entry (JHUFF_TBL * htbl, int kind, int nsymbols, unsigned int hash)
+/* Find the entry for the table; caller must hold the mutex */
+{
+  huff_cache_entry * entry;
+  int i;
+
+  for (i = 0; i < huff_cache_used; i++) {
+    entry = &huff_cache[i];
+    if (entry->hash == hash && entry->kind == kind &&
+	memcmp(entry->bits + 1, htbl->bits + 1, 16) == 0 &&
+	memcmp(entry->huffval, htbl->huffval, nsymbols) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+
+/*
+ * Look up the derived table for htbl.
+ * If found, the derived data are copied to dtbl and TRUE is returned.
+ */
+
+GLOBAL(boolean)
+jpeg_huff_cache_get (JHUFF_TBL * htbl, int kind, void * dtbl, size_t size)
+{
+  huff_cache_entry * entry;
+  int nsymbols;
+  unsigned int hash;
+  boolean found = FALSE;
+
+  if ((nsymbols = count_symbols(htbl)) < 0)
+    return FALSE;
+  hash = hash_table(htbl, kind, nsymbols);
+
+  pthread_mutex_lock(&huff_cache_mutex);
+  entry = find_entry(htbl, kind, nsymbols, hash);
+  if (entry != NULL && entry->size == size) {
+    MEMCOPY(dtbl, entry->data, size);
+    found = TRUE;
+  }
+  pthread_mutex_unlock(&huff_cache_mutex);
+  return found;
+}
+
+
+/*
+ * Store the derived table built for htbl.
+ * When the cache is full, the oldest entry is replaced.
+ * If memory runs out, the table is just not cached.
+ */
+
+GLOBAL(void)
+jpeg_huff_cache_put (JHUFF_TBL * htbl, int kind, const void * dtbl,
+		     size_t size)
+{
+  huff_cache_entry * entry;
+  int nsymbols;
+  unsigned int hash;
+
+  if ((nsymbols = count_symbols(htbl)) < 0)
+    return;
+  hash = hash_table(htbl, kind, nsymbols);
+
+  pthread_mutex_lock(&huff_cache_mutex);
+  if (find_entry(htbl, kind, nsymbols, hash) == NULL) {
+    if (huff_cache_used < HUFF_CACHE_SIZE)
+      entry = &huff_cache[huff_cache_used++];
+    else {
+      entry = &huff_cache[huff_cache_next];
+      huff_cache_next = (huff_cache_next + 1) % HUFF_CACHE_SIZE;
+    }
+    if (entry->data != NULL && entry->size != size) {
+      free(entry->data);
+      entry->data = NULL;
+    }
+    if (entry->data == NULL)
+      entry->data = malloc(size);
+    if (entry->data == NULL) {
+      entry->kind = -1;		/* can't use this entry */
+      entry->hash = 0;
+    } else {
+      entry->hash = hash;
+      entry->kind = kind;
+      MEMCOPY(entry->bits, htbl->bits, SIZEOF(entry->bits));
+      MEMCOPY(entry->huffval, htbl->huffval, nsymbols);
+      entry->size = size;
+      MEMCOPY(entry->data, dtbl, size);
+    }
+  }
+  pthread_mutex_unlock(&huff_cache_mutex);
+}
+
+#endif /* HUFF_CACHE_SUPPORTED */
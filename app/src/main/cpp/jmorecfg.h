@@ -349,12 +349,13 @@ typedef enum { FALSE = 0, TRUE = 1 } boolean;
 //#define DCT_ISLOW_SUPPORTED	/* slow but accurate integer algorithm */
 //#define DCT_IFAST_SUPPORTED	/* faster, less accurate integer method */
 //#define DCT_FLOAT_SUPPORTED	/* floating-point: accurate, fast on fast HW */
+#define HUFF_CACHE_SUPPORTED	/* Process-wide cache of Huffman tables? */
 
 /* Encoder capability options: */
 
-//#define C_ARITH_CODING_SUPPORTED    /* Arithmetic coding back end? */
-//#define C_MULTISCAN_FILES_SUPPORTED /* Multiple-scan JPEG files? */
-//#define C_PROGRESSIVE_SUPPORTED	    /* Progressive JPEG? (Requires MULTISCAN)*/
+#define C_ARITH_CODING_SUPPORTED    /* Arithmetic coding back end? */
+#define C_MULTISCAN_FILES_SUPPORTED /* Multiple-scan JPEG files? */
+#define C_PROGRESSIVE_SUPPORTED	    /* Progressive JPEG? (Requires MULTISCAN)*/
 //#define DCT_SCALING_SUPPORTED	    /* Input rescaling via DCT? (Requires DCT_ISLOW)*/
 #define ENTROPY_OPT_SUPPORTED	    /* Optimization of entropy coding parms? */
 /* Note: if you selected more than 8-bit data precision, it is dangerous to
@@ -367,6 +368,7 @@ typedef enum { FALSE = 0, TRUE = 1 } boolean;
  * don't work for progressive mode.  (This may get fixed, however.)
  */
 //#define INPUT_SMOOTHING_SUPPORTED   /* Input image smoothing option? */
+#define C_PARALLEL_SUPPORTED	    /* Threaded coding of restart intervals? */
 
 /* Decoder capability options: */
 
@@ -375,6 +377,7 @@ typedef enum { FALSE = 0, TRUE = 1 } boolean;
 #define D_PROGRESSIVE_SUPPORTED	    /* Progressive JPEG? (Requires MULTISCAN)*/
 //#define IDCT_SCALING_SUPPORTED	    /* Output rescaling via IDCT? (Requires DCT_ISLOW)*/
 #define SAVE_MARKERS_SUPPORTED	    /* jpeg_save_markers() needed? */
+#define D_PARALLEL_SUPPORTED	    /* Threaded decoding of noninterleaved scans? */
 //#define BLOCK_SMOOTHING_SUPPORTED   /* Block smoothing? (Progressive only) */
 #undef  UPSAMPLE_SCALING_SUPPORTED  /* Output rescaling at upsample stage? */
 //#define UPSAMPLE_MERGING_SUPPORTED  /* Fast path for sloppy upsampling? */
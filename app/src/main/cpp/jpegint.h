@@ -112,11 +112,44 @@ struct jpeg_forward_dct {
   forward_DCT_ptr forward_DCT[MAX_COMPONENTS];
 };
 
+/* Added for ajpegtran
+ *  A run of whole restart intervals, entropy-coded on its own thread into
+ *  a private malloc'ed buffer.  The coefficient controller fills in the MCU
+ *  range and get_MCU; the entropy encoder fills in the output fields.
+ *  The data begins with the RSTn marker when first_MCU is not 0.
+ */
+typedef struct jpeg_mcu_segment * jpeg_mcu_segment_ptr;
+
+struct jpeg_mcu_segment {
+  JDIMENSION first_MCU;		/* index of first MCU within the scan */
+  JDIMENSION num_MCUs;		/* # of MCUs to code */
+  JMETHOD(void, get_MCU, (j_compress_ptr cinfo, jpeg_mcu_segment_ptr seg,
+			  JDIMENSION MCU_index, JBLOCKROW *MCU_data));
+  JBLOCKROW dummy_buffer[C_MAX_BLOCKS_IN_MCU]; /* private dummy blocks */
+
+  JOCTET * buffer;		/* coded data, malloc'ed */
+  size_t bufsize;		/* allocated size of buffer */
+  size_t datasize;		/* # of bytes of coded data */
+  int error_code;		/* JERR_xxx if coding failed, else 0 */
+};
+
 /* Entropy encoding */
 struct jpeg_entropy_encoder {
   JMETHOD(void, start_pass, (j_compress_ptr cinfo, boolean gather_statistics));
   JMETHOD(boolean, encode_mcu, (j_compress_ptr cinfo, JBLOCKROW *MCU_data));
   JMETHOD(void, finish_pass, (j_compress_ptr cinfo));
+  /* Added for ajpegtran
+   *  Code a segment without touching cinfo or the destination; safe to call
+   *  from worker threads.  Returns FALSE with seg->error_code set on error.
+   *  NULL if the current pass can't be coded in segments.
+   */
+  JMETHOD(boolean, encode_segment, (j_compress_ptr cinfo,
+				    jpeg_mcu_segment_ptr seg));
+  /* Added for ajpegtran
+   *  TRUE if encode_mcu of this pass codes the symbols recorded at the
+   *  gather pass and ignores MCU_data.
+   */
+  boolean replay_symbols;
 };
 
 /* Marker writing */
@@ -174,6 +207,11 @@ struct jpeg_d_coef_controller {
 				 JSAMPIMAGE output_buf));
   /* Pointer to array of coefficient virtual arrays, or NULL if none */
   jvirt_barray_ptr *coef_arrays;
+  /* Added for ajpegtran
+   *  Decode the scans whose data was only stored while reading the file.
+   *  Called by jpeg_read_coefficients at EOI; NULL if not supported.
+   */
+  JMETHOD(void, decode_pending, (j_decompress_ptr cinfo));
 };
 
 /* Decompression postprocessing (color quantization buffer control) */
@@ -213,6 +251,11 @@ struct jpeg_entropy_decoder {
   JMETHOD(void, start_pass, (j_decompress_ptr cinfo));
   JMETHOD(boolean, decode_mcu, (j_decompress_ptr cinfo, JBLOCKROW *MCU_data));
   JMETHOD(void, finish_pass, (j_decompress_ptr cinfo));
+  /* Added for ajpegtran
+   *  Skip the current restart interval without decoding (NULL if the
+   *  decoder can't do it).
+   */
+  JMETHOD(boolean, skip_interval, (j_decompress_ptr cinfo));
 };
 
 /* Inverse DCT (also performs dequantization) */
@@ -337,6 +380,7 @@ struct jpeg_color_quantizer {
 #define jzero_far		jZeroFar
 #define jcopy_sample_rows	jCopySamples
 #define jcopy_block_row		jCopyBlocks
+#define jpeg_nbits		jNBits
 #define jpeg_zigzag_order	jZIGTable
 #define jpeg_natural_order	jZAGTable
 #define jpeg_natural_order7	jZAG7Table
@@ -346,6 +390,19 @@ struct jpeg_color_quantizer {
 #define jpeg_natural_order3	jZAG3Table
 #define jpeg_natural_order2	jZAG2Table
 #define jpeg_aritab		jAriTab
+#define jpeg_std_huff_bits	jStdHBits
+#define jpeg_std_huff_val	jStdHVal
+#define jpeg_std_d_maxcode	jStdDMaxCode
+#define jpeg_std_d_valoffset	jStdDValOff
+#define jpeg_std_d_look_nbits	jStdDLookNB
+#define jpeg_std_d_look_sym	jStdDLookSym
+#define jpeg_std_c_ehufco	jStdCHufCo
+#define jpeg_std_c_ehufsi	jStdCHufSi
+#define jpeg_std_huff_index	jStdHIndex
+#define jpeg_huff_cache_get	jHCacheGet
+#define jpeg_huff_cache_put	jHCachePut
+#define jpeg_gen_optimal_table	jGenOptTbl
+#define jsearch_scan_script	jSearchScans
 #endif /* NEED_SHORT_EXTERNAL_NAMES */
 
 
@@ -414,6 +471,23 @@ EXTERN(void) jcopy_sample_rows JPP((JSAMPARRAY input_array, int source_row,
 				    int num_rows, JDIMENSION num_cols));
 EXTERN(void) jcopy_block_row JPP((JBLOCKROW input_row, JBLOCKROW output_row,
 				  JDIMENSION num_blocks));
+/* Added for ajpegtran
+ * Number of bits needed for a nonnegative value below 2^16, e.g. the
+ * magnitude of a coefficient, which is its category in sections F.1.2
+ * and G.1.2.  JPEG_NBITS(0) is 0; JPEG_NBITS_NONZERO needs x > 0.
+ * With count-leading-zeros this takes neither loop nor branch:
+ * 2x+1 is never 0 and has one more bit than x.
+ */
+#ifdef HAVE_BUILTIN_CLZ
+#define JPEG_NBITS_NONZERO(x)  \
+	((int) (SIZEOF(unsigned int) * 8) - __builtin_clz((unsigned int) (x)))
+#define JPEG_NBITS(x)  \
+	(JPEG_NBITS_NONZERO(((unsigned int) (x) << 1) | 1) - 1)
+#else
+#define JPEG_NBITS_NONZERO(x)  jpeg_nbits((int) (x))
+#define JPEG_NBITS(x)  jpeg_nbits((int) (x))
+#endif
+EXTERN(int) jpeg_nbits JPP((int value));
 /* Constant tables in jutils.c */
 #if 0				/* This table is not actually needed in v6a */
 extern const int jpeg_zigzag_order[]; /* natural coef order to zigzag order */
@@ -429,6 +503,49 @@ extern const int jpeg_natural_order2[]; /* zz to natural order for 2x2 block */
 /* Arithmetic coding probability estimation tables in jaricom.c */
 extern const INT32 jpeg_aritab[];
 
+/* Added for ajpegtran
+ *  Standard Huffman tables and their derived forms in jstdhuff.c
+ */
+#define STD_HUFF_DC_LUMINANCE	0
+#define STD_HUFF_DC_CHROMINANCE	1
+#define STD_HUFF_AC_LUMINANCE	2
+#define STD_HUFF_AC_CHROMINANCE	3
+#define NUM_STD_HUFF_TBLS	4
+extern const UINT8 jpeg_std_huff_bits[NUM_STD_HUFF_TBLS][17];
+extern const UINT8 jpeg_std_huff_val[NUM_STD_HUFF_TBLS][256];
+extern const INT32 jpeg_std_d_maxcode[NUM_STD_HUFF_TBLS][18];
+extern const INT32 jpeg_std_d_valoffset[NUM_STD_HUFF_TBLS][17];
+extern const UINT8 jpeg_std_d_look_nbits[NUM_STD_HUFF_TBLS][1<<8];
+extern const UINT8 jpeg_std_d_look_sym[NUM_STD_HUFF_TBLS][1<<8];
+extern const UINT16 jpeg_std_c_ehufco[NUM_STD_HUFF_TBLS][256];
+extern const UINT8 jpeg_std_c_ehufsi[NUM_STD_HUFF_TBLS][256];
+EXTERN(int) jpeg_std_huff_index JPP((JHUFF_TBL * htbl, boolean isDC));
+
+/* Added for ajpegtran
+ *  Process-wide cache of derived Huffman tables in jhuffcache.c
+ */
+#ifdef HUFF_CACHE_SUPPORTED
+#define HUFF_CACHE_D_DC		0	/* kinds of derived tables */
+#define HUFF_CACHE_D_AC		1
+#define HUFF_CACHE_C_DC		2
+#define HUFF_CACHE_C_AC		3
+EXTERN(boolean) jpeg_huff_cache_get JPP((JHUFF_TBL * htbl, int kind,
+					 void * dtbl, size_t size));
+EXTERN(void) jpeg_huff_cache_put JPP((JHUFF_TBL * htbl, int kind,
+				      const void * dtbl, size_t size));
+#endif
+
+/* Added for ajpegtran
+ *  Optimal Huffman table generation in jchuff.c, and the search for
+ *  a progressive scan script of minimal size in jcscans.c
+ */
+EXTERN(void) jpeg_gen_optimal_table JPP((j_compress_ptr cinfo,
+					 JHUFF_TBL * htbl, long freq[]));
+#ifdef C_PROGRESSIVE_SUPPORTED
+EXTERN(void) jsearch_scan_script JPP((j_compress_ptr cinfo,
+				      jvirt_barray_ptr * coef_arrays));
+#endif
+
 /* Suppress undefined-structure complaints if necessary. */
 
 #ifdef INCOMPLETE_TYPES_BROKEN
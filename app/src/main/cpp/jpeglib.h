@@ -458,6 +458,19 @@ struct jpeg_compress_struct {
   boolean remove_orientation_info;
   boolean remove_thumbnail;
   boolean remove_geotag;
+  boolean rebuild_thumbnail;	/* make new thumbnail from output image */
+
+  /* Added for ajpegtran
+   *  Number of threads for entropy coding restart intervals in parallel.
+   *  1 (default) codes serially.  Takes effect only with restart markers.
+   */
+  int num_threads;
+
+  /* Added for ajpegtran
+   *  TRUE = replace a progressive Huffman scan script by the one of minimal
+   *  size for the data (transcoding only, see jcscans.c).
+   */
+  boolean optimize_scans;
 };
 
 
@@ -693,6 +706,21 @@ struct jpeg_decompress_struct {
   struct jpeg_upsampler * upsample;
   struct jpeg_color_deconverter * cconvert;
   struct jpeg_color_quantizer * cquantize;
+
+  /* Added for ajpegtran
+   *  Area of the image needed from jpeg_read_coefficients, in pixels.
+   *  Restart intervals entirely outside of it are skipped without decoding
+   *  and their blocks are left zero.  read_area_width = 0 reads all.
+   */
+  JDIMENSION read_area_x, read_area_y;
+  JDIMENSION read_area_width, read_area_height;
+
+  /* Added for ajpegtran
+   *  Number of threads for decoding the noninterleaved scans of a
+   *  sequential multi-scan file in parallel (jpeg_read_coefficients only).
+   *  0 or 1 (default) decodes serially.
+   */
+  int num_threads;
 };
 
 
@@ -942,6 +970,8 @@ typedef JMETHOD(boolean, jpeg_marker_parser_method, (j_decompress_ptr cinfo));
 #define jpeg_set_marker_processor	jSetMarker
 #define jpeg_read_coefficients	jReadCoefs
 #define jpeg_write_coefficients	jWrtCoefs
+#define jpeg_start_coefficient_rows	jStrtCoefRows
+#define jpeg_write_coefficients_stream	jWrtCoefStream
 #define jpeg_copy_critical_parameters	jCopyCrit
 #define jpeg_abort_compress	jAbrtCompress
 #define jpeg_abort_decompress	jAbrtDecompress
@@ -1105,6 +1135,14 @@ EXTERN(void) jpeg_write_coefficients JPP((j_compress_ptr cinfo,
 					  jvirt_barray_ptr * coef_arrays));
 EXTERN(void) jpeg_copy_critical_parameters JPP((j_decompress_ptr srcinfo,
 						j_compress_ptr dstinfo));
+/* Added for ajpegtran
+ *  Streaming transcoding of single-scan files, one iMCU row at a time.
+ */
+EXTERN(void) jpeg_start_coefficient_rows JPP((j_decompress_ptr cinfo,
+					      JBLOCKARRAY * rows));
+EXTERN(void) jpeg_write_coefficients_stream
+	JPP((j_compress_ptr cinfo, j_decompress_ptr srcinfo,
+	     JMETHOD(void, rewind_src, (j_decompress_ptr srcinfo))));
 
 /* If you choose to abort compression or decompression before completing
  * jpeg_finish_(de)compress, then you need to clean up to release memory,
@@ -139,6 +139,25 @@ jround_up (long a, long b)
 }
 
 
+/* Added for ajpegtran
+ * Portable version of JPEG_NBITS (jpegint.h).
+ */
+
+GLOBAL(int)
+jpeg_nbits (int value)
+/* Compute # of bits needed for value, ie, its magnitude category */
+/* Assumes value >= 0 */
+{
+  int nbits = 0;
+
+  while (value) {
+    nbits++;
+    value >>= 1;
+  }
+  return nbits;
+}
+
+
 /* On normal machines we can apply MEMCOPY() and MEMZERO() to sample arrays
  * and coefficient-block arrays.  This won't work on 80x86 because the arrays
  * are FAR and we're assuming a small-pointer memory model.  However, some
@@ -9,7 +9,7 @@
  * This file contains routines to process some of cjpeg's more complicated
  * command-line switches.  Switches processed here are:
  *	-qtables file		Read quantization tables from text file
- *	-scans file		Read scan script from text file
+ *	-scans script		Read scan script from string (Modified for ajpegtran)
  *	-quality N[,N,...]	Set quality ratings
  *	-qslots N[,N,...]	Set component quantization table selectors
  *	-sample HxV[,HxV,...]	Set component sampling factors
@@ -131,22 +131,70 @@ read_quant_tables (j_compress_ptr cinfo, char * filename, boolean force_baseline
 
 #ifdef C_MULTISCAN_FILES_SUPPORTED
 
+/* Modified for ajpegtran
+ *  An Android application can't pass a file path, so the scan script is
+ *  given as a string in the option instead of a file.  The following
+ *  routines read the script from the string with the same syntax.
+ */
+
+LOCAL(int)
+script_getc (const char ** script)
+/* Read next char of the script, skipping over any comments (# to end of line) */
+/* A comment/newline sequence is returned as a newline */
+{
+  register int ch;
+
+  ch = (unsigned char) *(*script)++;
+  if (ch == '#') {
+    do {
+      ch = (unsigned char) *(*script)++;
+    } while (ch != '\n' && ch != '\0');
+  }
+  if (ch == '\0') {
+    (*script)--;		/* stay at end of string */
+    ch = EOF;
+  }
+  return ch;
+}
+
+
 LOCAL(boolean)
-read_scan_integer (FILE * file, long * result, int * termchar)
-/* Variant of read_text_integer that always looks for a non-space termchar;
+read_scan_integer (const char ** script, long * result, int * termchar)
+/* Read an unsigned decimal integer from the script, store it in result.
+ * Always looks for a non-space termchar and returns it in termchar;
  * this simplifies parsing of punctuation in scan scripts.
  */
 {
   register int ch;
+  register long val;
+
+  /* Skip any leading whitespace, detect end of script */
+  do {
+    ch = script_getc(script);
+    if (ch == EOF) {
+      *termchar = ch;
+      return FALSE;
+    }
+  } while (isspace(ch));
 
-  if (! read_text_integer(file, result, termchar))
+  if (! isdigit(ch)) {
+    *termchar = ch;
     return FALSE;
-  ch = *termchar;
+  }
+
+  val = ch - '0';
+  while ((ch = script_getc(script)) != EOF) {
+    if (! isdigit(ch))
+      break;
+    val *= 10;
+    val += ch - '0';
+  }
+  *result = val;
+
   while (ch != EOF && isspace(ch))
-    ch = text_getc(file);
+    ch = script_getc(script);
   if (isdigit(ch)) {		/* oops, put it back */
-    if (ungetc(ch, file) == EOF)
-      return FALSE;
+    (*script)--;
     ch = ' ';
   } else {
     /* Any separators other than ';' and ':' are ignored;
@@ -161,70 +209,59 @@ read_scan_integer (FILE * file, long * result, int * termchar)
 
 
 GLOBAL(boolean)
-read_scan_script (j_compress_ptr cinfo, char * filename)
-/* Read a scan script from the specified text file.
- * Each entry in the file defines one scan to be emitted.
+read_scan_script (j_compress_ptr cinfo, char * script)
+/* Read a scan script from the specified string.
+ * Each entry in the script defines one scan to be emitted.
  * Entries are separated by semicolons ';'.
  * An entry contains one to four component indexes,
  * optionally followed by a colon ':' and four progressive-JPEG parameters.
  * The component indexes denote which component(s) are to be transmitted
  * in the current scan.  The first component has index 0.
  * Sequential JPEG is used if the progressive-JPEG parameters are omitted.
- * The file is free format text: any whitespace may appear between numbers
+ * The script is free format text: any whitespace may appear between numbers
  * and the ':' and ';' punctuation marks.  Also, other punctuation (such
  * as commas or dashes) can be placed between numbers if desired.
- * Comments preceded by '#' may be included in the file.
+ * Comments preceded by '#' may be included in the script.
  * Note: we do very little validity checking here;
  * jcmaster.c will validate the script parameters.
  */
 {
-  FILE * fp;
+  const char * sp = script;
   int scanno, ncomps, termchar;
   long val;
   jpeg_scan_info * scanptr;
 #define MAX_SCANS  100		/* quite arbitrary limit */
   jpeg_scan_info scans[MAX_SCANS];
 
-  if ((fp = fopen(filename, "r")) == NULL) {
-    fprintf(stderr, "Can't open scan definition file %s\n", filename);
-    return FALSE;
-  }
   scanptr = scans;
   scanno = 0;
 
-  while (read_scan_integer(fp, &val, &termchar)) {
-    if (scanno >= MAX_SCANS) {
-      fprintf(stderr, "Too many scans defined in file %s\n", filename);
-      fclose(fp);
-      return FALSE;
-    }
+  while (read_scan_integer(&sp, &val, &termchar)) {
+    if (scanno >= MAX_SCANS)
+      return FALSE;		/* Too many scans defined */
     scanptr->component_index[0] = (int) val;
     ncomps = 1;
     while (termchar == ' ') {
-      if (ncomps >= MAX_COMPS_IN_SCAN) {
-	fprintf(stderr, "Too many components in one scan in file %s\n",
-		filename);
-	fclose(fp);
+      if (ncomps >= MAX_COMPS_IN_SCAN)
+	return FALSE;		/* Too many components in one scan */
+      if (! read_scan_integer(&sp, &val, &termchar))
 	return FALSE;
-      }
-      if (! read_scan_integer(fp, &val, &termchar))
-	goto bogus;
       scanptr->component_index[ncomps] = (int) val;
       ncomps++;
     }
     scanptr->comps_in_scan = ncomps;
     if (termchar == ':') {
-      if (! read_scan_integer(fp, &val, &termchar) || termchar != ' ')
-	goto bogus;
+      if (! read_scan_integer(&sp, &val, &termchar) || termchar != ' ')
+	return FALSE;
       scanptr->Ss = (int) val;
-      if (! read_scan_integer(fp, &val, &termchar) || termchar != ' ')
-	goto bogus;
+      if (! read_scan_integer(&sp, &val, &termchar) || termchar != ' ')
+	return FALSE;
       scanptr->Se = (int) val;
-      if (! read_scan_integer(fp, &val, &termchar) || termchar != ' ')
-	goto bogus;
+      if (! read_scan_integer(&sp, &val, &termchar) || termchar != ' ')
+	return FALSE;
       scanptr->Ah = (int) val;
-      if (! read_scan_integer(fp, &val, &termchar))
-	goto bogus;
+      if (! read_scan_integer(&sp, &val, &termchar))
+	return FALSE;
       scanptr->Al = (int) val;
     } else {
       /* set non-progressive parameters */
@@ -233,20 +270,13 @@ read_scan_script (j_compress_ptr cinfo, char * filename)
       scanptr->Ah = 0;
       scanptr->Al = 0;
     }
-    if (termchar != ';' && termchar != EOF) {
-bogus:
-      fprintf(stderr, "Invalid scan entry format in file %s\n", filename);
-      fclose(fp);
-      return FALSE;
-    }
+    if (termchar != ';' && termchar != EOF)
+      return FALSE;		/* Invalid scan entry format */
     scanptr++, scanno++;
   }
 
-  if (termchar != EOF) {
-    fprintf(stderr, "Non-numeric data in file %s\n", filename);
-    fclose(fp);
-    return FALSE;
-  }
+  if (termchar != EOF)
+    return FALSE;		/* Non-numeric data in script */
 
   if (scanno > 0) {
     /* Stash completed scan list in cinfo structure.
@@ -261,7 +291,6 @@ bogus:
     cinfo->num_scans = scanno;
   }
 
-  fclose(fp);
   return TRUE;
 }
 
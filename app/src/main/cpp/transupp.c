@@ -21,6 +21,7 @@
 #include "jpeglib.h"
 #include "transupp.h"		/* My own external interface */
 #include <ctype.h>		/* to declare isdigit() */
+#include <setjmp.h>		/* Added for ajpegtran (thumbnail errors) */
 
 
 #if TRANSFORMS_SUPPORTED
@@ -276,37 +277,570 @@ do_flatten (j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
 /* Added for ajpegtran
  *  This function perform pixelize.
  *  Based on do_wipe() function above.
- *  This fucntion clear AC coefficients only, whereas do_wipe() clear all coefficient.
+ *  This fucntion clear AC coefficients, whereas do_wipe() clear all coefficient.
+ *  Modified for ajpegtran
+ *   The area is divided into cells of cell_size x cell_size pixels from
+ *   its upper left corner, and the DC coefficients of the blocks in a cell
+ *   are replaced by their average.  A cell of a subsampled component has
+ *   fewer blocks, but at least one.  The padding blocks at the right and
+ *   bottom edges are not counted, and their DC is left as it is.
+ *   With cell_size 8, each block is a cell and only AC coefficients are
+ *   cleared as before.
+ *   The helpers below are shared with do_redact().
  */
+
+LOCAL(JDIMENSION)
+pixelize_cell_blocks (int samp_factor, int max_samp_factor,
+		      int DCT_scaled_size, int cell_size)
+/* Size of a pixelize cell in blocks of a component, at least 1 */
+{
+  int blocks = cell_size * samp_factor / (max_samp_factor * DCT_scaled_size);
+
+  return (JDIMENSION) (blocks < 1 ? 1 : blocks);
+}
+
+
+LOCAL(void)
+average_cells (long * sums, JDIMENSION num_cells, JDIMENSION x_wipe_blocks,
+	       JDIMENSION cell_width, JDIMENSION real_right, long count_y)
+/* Convert the DC sums of a row of cells to averages, rounded */
+{
+  JDIMENSION cell;
+  long count_x;
+
+  for (cell = 0; cell < num_cells; cell++) {
+    count_x = (long) MIN(x_wipe_blocks + (cell + 1) * cell_width, real_right)
+      - (long) (x_wipe_blocks + cell * cell_width);
+    if (count_x <= 0 || count_y <= 0)
+      continue;			/* only padding blocks */
+    if (sums[cell] >= 0)
+      sums[cell] = (sums[cell] + count_x * count_y / 2) / (count_x * count_y);
+    else
+      sums[cell] = -((-sums[cell] + count_x * count_y / 2) /
+		     (count_x * count_y));
+  }
+}
+
+
+LOCAL(void)
+fill_cells (j_decompress_ptr srcinfo, jvirt_barray_ptr coef_array,
+	    JDIMENSION cell_top, JDIMENSION cell_bottom, JDIMENSION real_bottom,
+	    JDIMENSION x_wipe_blocks, JDIMENSION wipe_right,
+	    JDIMENSION real_right, JDIMENSION cell_width, long * averages)
+/* Fill the blocks of a row of cells with the averages */
+{
+  JDIMENSION blk_x, blk_y;
+  JBLOCKARRAY buffer;
+  JCOEF *blktop;
+
+  for (blk_y = cell_top; blk_y < cell_bottom; blk_y++) {
+    buffer = (*srcinfo->mem->access_virt_barray)
+      ((j_common_ptr) srcinfo, coef_array, blk_y, (JDIMENSION) 1, TRUE);
+    for (blk_x = x_wipe_blocks; blk_x < wipe_right; blk_x++) {
+      blktop = buffer[0][blk_x];
+      FMEMZERO(blktop+1, (DCTSIZE2-1) * SIZEOF(JCOEF));
+      if (blk_x < real_right && blk_y < real_bottom)
+	blktop[0] = (JCOEF) averages[(blk_x - x_wipe_blocks) / cell_width];
+    }
+  }
+}
+
+
+LOCAL(void)
+pixelize_area (j_decompress_ptr srcinfo, jvirt_barray_ptr coef_array,
+	       JDIMENSION x_wipe_blocks, JDIMENSION wipe_right,
+	       JDIMENSION real_right, JDIMENSION y_wipe_blocks,
+	       JDIMENSION wipe_bottom, JDIMENSION real_bottom,
+	       JDIMENSION cell_width, JDIMENSION cell_height, long * sums)
+/* Pixelize an area of a component, a row of cells at a time */
+{
+  JDIMENSION num_cells, cell_bottom, blk_x, blk_y;
+  JBLOCKARRAY buffer;
+
+  num_cells = (wipe_right - x_wipe_blocks + cell_width - 1) / cell_width;
+  for (; y_wipe_blocks < wipe_bottom; y_wipe_blocks = cell_bottom) {
+    cell_bottom = MIN(y_wipe_blocks + cell_height, wipe_bottom);
+    /* Sum up DC values of each cell in this row of cells */
+    MEMZERO(sums, num_cells * SIZEOF(long));
+    for (blk_y = y_wipe_blocks; blk_y < MIN(cell_bottom, real_bottom);
+	 blk_y++) {
+      buffer = (*srcinfo->mem->access_virt_barray)
+	((j_common_ptr) srcinfo, coef_array, blk_y, (JDIMENSION) 1, FALSE);
+      for (blk_x = x_wipe_blocks; blk_x < real_right; blk_x++)
+	sums[(blk_x - x_wipe_blocks) / cell_width] += buffer[0][blk_x][0];
+    }
+    average_cells(sums, num_cells, x_wipe_blocks, cell_width, real_right,
+		  (long) MIN(cell_bottom, real_bottom) - (long) y_wipe_blocks);
+    fill_cells(srcinfo, coef_array, y_wipe_blocks, cell_bottom,
+	       real_bottom, x_wipe_blocks, wipe_right, real_right,
+	       cell_width, sums);
+  }
+}
+
+
 LOCAL(void)
 do_pixelize (j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
 	 JDIMENSION x_crop_offset, JDIMENSION y_crop_offset,
 	 jvirt_barray_ptr *src_coef_arrays,
-	 JDIMENSION drop_width, JDIMENSION drop_height)
-/* Wipe - drop content of specified area, fill with zero (neutral gray) */
+	 JDIMENSION drop_width, JDIMENSION drop_height, int cell_size)
+/* Pixelize - drop details of specified area, fill cells with average */
 {
-  JDIMENSION x_wipe_blocks, wipe_width;
-  JDIMENSION y_wipe_blocks, wipe_bottom;
-  int ci, offset_y,offset_x;
-  JBLOCKARRAY buffer;
+  JDIMENSION x_wipe_blocks, wipe_right, real_right;
+  JDIMENSION y_wipe_blocks, wipe_bottom, real_bottom;
+  JDIMENSION cell_width, cell_height, num_cells;
+  int ci;
+  long * sums;
   jpeg_component_info *compptr;
 
   for (ci = 0; ci < dstinfo->num_components; ci++) {
     compptr = dstinfo->comp_info + ci;
+    cell_width = pixelize_cell_blocks(compptr->h_samp_factor,
+      dstinfo->max_h_samp_factor, dstinfo->min_DCT_h_scaled_size, cell_size);
+    cell_height = pixelize_cell_blocks(compptr->v_samp_factor,
+      dstinfo->max_v_samp_factor, dstinfo->min_DCT_v_scaled_size, cell_size);
     x_wipe_blocks = x_crop_offset * compptr->h_samp_factor;
-    wipe_width = drop_width * compptr->h_samp_factor;
+    wipe_right = drop_width * compptr->h_samp_factor + x_wipe_blocks;
+    real_right = MIN(wipe_right, compptr->width_in_blocks);
     y_wipe_blocks = y_crop_offset * compptr->v_samp_factor;
     wipe_bottom = drop_height * compptr->v_samp_factor + y_wipe_blocks;
-    for (; y_wipe_blocks < wipe_bottom;
-	 y_wipe_blocks += compptr->v_samp_factor) {
-      buffer = (*srcinfo->mem->access_virt_barray)
-	((j_common_ptr) srcinfo, src_coef_arrays[ci], y_wipe_blocks,
+    real_bottom = MIN(wipe_bottom, compptr->height_in_blocks);
+    num_cells = (wipe_right - x_wipe_blocks + cell_width - 1) / cell_width;
+    sums = (long *) (*srcinfo->mem->alloc_small)
+      ((j_common_ptr) srcinfo, JPOOL_IMAGE, num_cells * SIZEOF(long));
+    pixelize_area(srcinfo, src_coef_arrays[ci], x_wipe_blocks, wipe_right,
+		  real_right, y_wipe_blocks, wipe_bottom, real_bottom,
+		  cell_width, cell_height, sums);
+  }
+}
+
+
+/* Added for ajpegtran
+ *  Redact all regions of info->regions of each component, with the same
+ *  result as applying them one by one in the given order.
+ *  Wipe and flatten change a block row only from the same row, so a run of
+ *  these regions in the list is done in one pass: the regions of the run
+ *  are sorted by their top row, and the block rows are visited from top to
+ *  bottom.  A region becomes active at its top row and is applied to each
+ *  row until its bottom, so rows without a region are not accessed at all.
+ *  Overlapping regions are applied in the given order at each row.
+ *  A pixelize cell depends on all rows of the cell, so a pixelize region
+ *  is done on its own between the runs, like do_pixelize().
+ */
+
+typedef struct {
+  JDIMENSION x_wipe_blocks, wipe_right, real_right; /* in blocks */
+  JDIMENSION y_wipe_blocks, wipe_bottom, real_bottom;
+  JDIMENSION cell_width, cell_height, num_cells; /* for pixelize */
+  long * sums;			/* DC sums of a row of cells */
+} redact_state;
+
+LOCAL(void)
+flatten_row (JBLOCKROW row, JDIMENSION x_wipe_blocks, JDIMENSION wipe_right,
+	     JDIMENSION width_in_blocks)
+/* Flatten a row of a region, same as do_flatten() */
+{
+  JDIMENSION blk_x;
+  int dc_left_value, dc_right_value, average;
+
+  FMEMZERO(row + x_wipe_blocks,
+	   (wipe_right - x_wipe_blocks) * SIZEOF(JBLOCK));
+  if (x_wipe_blocks > 0) {
+    dc_left_value = row[x_wipe_blocks - 1][0];
+    if (wipe_right < width_in_blocks) {
+      dc_right_value = row[wipe_right][0];
+      average = (dc_left_value + dc_right_value) >> 1;
+    } else {
+      average = dc_left_value;
+    }
+  } else if (wipe_right < width_in_blocks) {
+    average = row[wipe_right][0];
+  } else
+    return;
+  for (blk_x = x_wipe_blocks; blk_x < wipe_right; blk_x++)
+    row[blk_x][0] = (JCOEF) average;
+}
+
+LOCAL(void)
+do_redact (j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+	   jvirt_barray_ptr *src_coef_arrays, jpeg_transform_info *info)
+/* Redact - wipe, flatten or pixelize a list of regions */
+{
+  redact_state state[JMAX_REDACT_REGIONS];
+  int order[JMAX_REDACT_REGIONS], active[JMAX_REDACT_REGIONS];
+  int ci, i, j, first, last, num_active, next;
+  JDIMENSION blk_y;
+  JBLOCKARRAY buffer;
+  jpeg_component_info *compptr;
+  jpeg_redact_region *region;
+  redact_state *st;
+
+  for (ci = 0; ci < dstinfo->num_components; ci++) {
+    compptr = dstinfo->comp_info + ci;
+    /* Regions in blocks of this component */
+    for (i = 0; i < info->num_regions; i++) {
+      region = info->regions + i;
+      st = state + i;
+      st->x_wipe_blocks = region->x_crop_offset * compptr->h_samp_factor;
+      st->wipe_right = region->drop_width * compptr->h_samp_factor +
+		       st->x_wipe_blocks;
+      st->real_right = MIN(st->wipe_right, compptr->width_in_blocks);
+      st->y_wipe_blocks = region->y_crop_offset * compptr->v_samp_factor;
+      st->wipe_bottom = region->drop_height * compptr->v_samp_factor +
+			st->y_wipe_blocks;
+      st->real_bottom = MIN(st->wipe_bottom, compptr->height_in_blocks);
+      if (region->mode == JREDACT_WIPE || region->mode == JREDACT_FLATTEN)
+	continue;
+      st->cell_width = pixelize_cell_blocks(compptr->h_samp_factor,
+	dstinfo->max_h_samp_factor, dstinfo->min_DCT_h_scaled_size,
+	region->mode);
+      st->cell_height = pixelize_cell_blocks(compptr->v_samp_factor,
+	dstinfo->max_v_samp_factor, dstinfo->min_DCT_v_scaled_size,
+	region->mode);
+      st->num_cells = (st->wipe_right - st->x_wipe_blocks +
+		       st->cell_width - 1) / st->cell_width;
+      st->sums = (long *) (*srcinfo->mem->alloc_small)
+	((j_common_ptr) srcinfo, JPOOL_IMAGE,
+	 st->num_cells * SIZEOF(long));
+    }
+
+    for (first = 0; first < info->num_regions; first = last) {
+      if (info->regions[first].mode != JREDACT_WIPE &&
+	  info->regions[first].mode != JREDACT_FLATTEN) {
+	st = state + first;
+	pixelize_area(srcinfo, src_coef_arrays[ci], st->x_wipe_blocks,
+		      st->wipe_right, st->real_right, st->y_wipe_blocks,
+		      st->wipe_bottom, st->real_bottom, st->cell_width,
+		      st->cell_height, st->sums);
+	last = first + 1;
+	continue;
+      }
+
+      /* Index the run of wipe and flatten regions by their top row
+       * (stable insertion sort)
+       */
+      for (last = first; last < info->num_regions &&
+	   (info->regions[last].mode == JREDACT_WIPE ||
+	    info->regions[last].mode == JREDACT_FLATTEN); last++) {
+	for (j = last - first; j > 0 && info->regions[order[j-1]].y_crop_offset >
+				   info->regions[last].y_crop_offset; j--)
+	  order[j] = order[j-1];
+	order[j] = last;
+      }
+
+      num_active = 0;
+      next = 0;
+      blk_y = 0;
+      while (num_active > 0 || next < last - first) {
+	/* Skip rows without a region */
+	if (num_active == 0 && blk_y < state[order[next]].y_wipe_blocks)
+	  blk_y = state[order[next]].y_wipe_blocks;
+	/* Activate regions starting at this row, keeping the given order */
+	while (next < last - first &&
+	       state[order[next]].y_wipe_blocks <= blk_y) {
+	  i = order[next++];
+	  if (state[i].wipe_bottom <= blk_y)
+	    continue;		/* empty region */
+	  for (j = num_active++; j > 0 && active[j-1] > i; j--)
+	    active[j] = active[j-1];
+	  active[j] = i;
+	}
+	if (num_active > 0)
+	  buffer = (*srcinfo->mem->access_virt_barray)
+	    ((j_common_ptr) srcinfo, src_coef_arrays[ci], blk_y,
+	     (JDIMENSION) 1, TRUE);
+	for (j = 0; j < num_active; j++) {
+	  st = state + active[j];
+	  if (info->regions[active[j]].mode == JREDACT_WIPE)
+	    FMEMZERO(buffer[0] + st->x_wipe_blocks,
+		     (st->wipe_right - st->x_wipe_blocks) * SIZEOF(JBLOCK));
+	  else
+	    flatten_row(buffer[0], st->x_wipe_blocks, st->wipe_right,
+			compptr->width_in_blocks);
+	}
+	blk_y++;
+	/* Deactivate regions ending at this row */
+	for (i = j = 0; j < num_active; j++)
+	  if (state[active[j]].wipe_bottom > blk_y)
+	    active[i++] = active[j];
+	num_active = i;
+      }
+    }
+  }
+}
+
+
+LOCAL(void)
+requant_block_row (JBLOCKROW row, JDIMENSION num_blocks,
+		   JQUANT_TBL *src_qtbl, JQUANT_TBL *dst_qtbl)
+/* Added for ajpegtran
+ *  Rescale blocks quantized by src_qtbl to dst_qtbl, with rounding.
+ */
+{
+  JDIMENSION blk_x;
+  JCOEFPTR ptr;
+  long num, qval;
+  int k;
+
+  for (blk_x = 0; blk_x < num_blocks; blk_x++) {
+    ptr = row[blk_x];
+    for (k = 0; k < DCTSIZE2; k++) {
+      if (ptr[k] == 0 || src_qtbl->quantval[k] == dst_qtbl->quantval[k])
+	continue;
+      num = (long) ptr[k] * (long) src_qtbl->quantval[k];
+      qval = (long) dst_qtbl->quantval[k];
+      if (num >= 0)
+	ptr[k] = (JCOEF) ((num + (qval >> 1)) / qval);
+      else
+	ptr[k] = (JCOEF) -((-num + (qval >> 1)) / qval);
+    }
+  }
+}
+
+
+LOCAL(void)
+do_drop (j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+	 jvirt_barray_ptr *dst_coef_arrays, jpeg_transform_info *info)
+/* Added for ajpegtran
+ *  Drop - copy the blocks of other images into the output, in the given
+ *  order.  The blocks are requantized when the quantization tables differ.
+ *  The chroma of a grayscale image is filled with zero (neutral gray).
+ */
+{
+  JDIMENSION x_drop_blocks, y_drop_blocks, drop_width, drop_height;
+  JDIMENSION blk_y;
+  int di, ci, offset_y;
+  boolean requant;
+  JBLOCKARRAY dst_buffer, drop_buffer;
+  jpeg_component_info *compptr, *dropptr;
+  JQUANT_TBL *drop_qtbl, *dst_qtbl;
+  jpeg_drop_image *drop;
+  j_decompress_ptr dropinfo;
+
+  for (di = 0; di < info->num_drops; di++) {
+    drop = info->drops + di;
+    dropinfo = drop->drop_ptr;
+    if (drop->drop_width == 0 || drop->drop_height == 0)
+      continue;
+    for (ci = 0; ci < dstinfo->num_components; ci++) {
+      compptr = dstinfo->comp_info + ci;
+      x_drop_blocks = drop->x_crop_offset * compptr->h_samp_factor;
+      y_drop_blocks = drop->y_crop_offset * compptr->v_samp_factor;
+      drop_width = drop->drop_width * compptr->h_samp_factor;
+      drop_height = drop->drop_height * compptr->v_samp_factor;
+      dropptr = NULL;
+      drop_qtbl = dst_qtbl = NULL;
+      requant = FALSE;
+      if (ci < dropinfo->num_components) {
+	/* The last iMCU of the image may have fewer blocks */
+	dropptr = dropinfo->comp_info + ci;
+	drop_width = MIN(drop_width, dropptr->width_in_blocks);
+	drop_height = MIN(drop_height, dropptr->height_in_blocks);
+	drop_qtbl = dropptr->quant_table;
+	if (drop_qtbl == NULL)
+	  drop_qtbl = dropinfo->quant_tbl_ptrs[dropptr->quant_tbl_no];
+	dst_qtbl = dstinfo->quant_tbl_ptrs[compptr->quant_tbl_no];
+	if (drop_qtbl == NULL || dst_qtbl == NULL)
+	  ERREXIT1(srcinfo, JERR_NO_QUANT_TABLE, compptr->quant_tbl_no);
+	requant = (memcmp(drop_qtbl->quantval, dst_qtbl->quantval,
+			  SIZEOF(drop_qtbl->quantval)) != 0);
+      }
+      for (blk_y = 0; blk_y < drop_height; blk_y += compptr->v_samp_factor) {
+	dst_buffer = (*srcinfo->mem->access_virt_barray)
+	  ((j_common_ptr) srcinfo, dst_coef_arrays[ci], y_drop_blocks + blk_y,
+	   (JDIMENSION) compptr->v_samp_factor, TRUE);
+	for (offset_y = 0; offset_y < compptr->v_samp_factor &&
+	     blk_y + offset_y < drop_height; offset_y++) {
+	  if (dropptr == NULL) {
+	    FMEMZERO(dst_buffer[offset_y] + x_drop_blocks,
+		     drop_width * SIZEOF(JBLOCK));
+	    continue;
+	  }
+	  /* The sampling factors of the image may differ from the output,
+	   * so its rows are accessed one at a time.
+	   */
+	  drop_buffer = (*dropinfo->mem->access_virt_barray)
+	    ((j_common_ptr) dropinfo, drop->drop_coef_arrays[ci],
+	     blk_y + offset_y, (JDIMENSION) 1, FALSE);
+	  jcopy_block_row(drop_buffer[0], dst_buffer[offset_y] + x_drop_blocks,
+			  drop_width);
+	  if (requant)
+	    requant_block_row(dst_buffer[offset_y] + x_drop_blocks,
+			      drop_width, drop_qtbl, dst_qtbl);
+	}
+      }
+    }
+  }
+}
+
+
+/* Added for ajpegtran
+ *  Downscale by 1/2, 1/4 or 1/8 in the DCT domain.
+ *  A destination block covers scale x scale source blocks.  The lowest
+ *  8/scale x 8/scale coefficients of each source block are transformed
+ *  back to 8/scale x 8/scale samples (only the DC value at 1/8), and the
+ *  8x8 samples put together are transformed and quantized again.
+ *  This is the same as decoding with a scaled IDCT and encoding again,
+ *  but without color conversion and resampling.
+ *  Source blocks beyond the right and bottom edges are replicated.
+ */
+
+static const double cos_16[9] = {	/* cos(k*pi/16), k = 0..8 */
+  1.0, 0.98078528040323043, 0.92387953251128674, 0.83146961230254524,
+  0.70710678118654752, 0.55557023301960218, 0.38268343236508977,
+  0.19509032201612825, 0.0
+};
+
+LOCAL(double)
+dct_basis (int u, int k)
+/* Orthonormal 8-point DCT basis: a(u) * cos(k*pi/16) */
+{
+  double c;
+
+  k &= 31;
+  if (k > 16)
+    k = 32 - k;
+  c = (k > 8) ? -cos_16[16 - k] : cos_16[k];
+  return (u == 0) ? c * 0.35355339059327376 : c * 0.5;
+}
+
+LOCAL(void)
+init_fdct (double fdct[DCTSIZE][DCTSIZE])
+/* Matrix of the 8-point forward DCT */
+{
+  int u, i;
+
+  for (u = 0; u < DCTSIZE; u++)
+    for (i = 0; i < DCTSIZE; i++)
+      fdct[u][i] = dct_basis(u, (2*i+1) * u);
+}
+
+LOCAL(void)
+fdct_quantize (double fdct[DCTSIZE][DCTSIZE], const double * samples,
+	       JQUANT_TBL * qtbl, JCOEFPTR block)
+/* Transform 8x8 level-shifted samples and quantize them into block */
+{
+  double tmp[DCTSIZE2], sum;
+  int i, u, v;
+
+  for (i = 0; i < DCTSIZE; i++)
+    for (v = 0; v < DCTSIZE; v++) {
+      sum = 0.0;
+      for (u = 0; u < DCTSIZE; u++)
+	sum += samples[i*DCTSIZE+u] * fdct[v][u];
+      tmp[i*DCTSIZE+v] = sum;
+    }
+  for (u = 0; u < DCTSIZE; u++)
+    for (v = 0; v < DCTSIZE; v++) {
+      sum = 0.0;
+      for (i = 0; i < DCTSIZE; i++)
+	sum += fdct[u][i] * tmp[i*DCTSIZE+v];
+      sum /= (double) qtbl->quantval[u*DCTSIZE+v];
+      block[u*DCTSIZE+v] = (JCOEF)
+	((sum >= 0.0) ? (int) (sum + 0.5) : - (int) (0.5 - sum));
+    }
+}
+
+LOCAL(void)
+do_downscale (j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+	      JDIMENSION x_crop_offset, JDIMENSION y_crop_offset,
+	      jvirt_barray_ptr *src_coef_arrays,
+	      jvirt_barray_ptr *dst_coef_arrays, int scale,
+	      j_common_ptr dst_owner)
+/* Modified for ajpegtran
+ *  dst_owner is the object whose memory manager holds dst_coef_arrays,
+ *  the source object for '-downscale' and the tile object for '-tile'.
+ */
+{
+  JDIMENSION dst_blk_x, dst_blk_y, src_blk_x, src_blk_y;
+  JDIMENSION x_crop_blocks, y_crop_blocks, max_width;
+  int ci, offset_y, n, i, j, k, u, v;
+  double idct[DCTSIZE][DCTSIZE];	/* n-point inverse, scaled to 8-point */
+  double fdct[DCTSIZE][DCTSIZE];	/* 8-point forward */
+  double coef[DCTSIZE2], tmp[DCTSIZE2], sum, smin, smax;
+  double *samples, *sptr;
+  JBLOCKARRAY src_buffer, dst_buffer;
+  JCOEFPTR src_ptr;
+  JQUANT_TBL *src_qtbl, *dst_qtbl;
+  jpeg_component_info *compptr, *srcptr;
+
+  n = DCTSIZE / scale;
+  for (i = 0; i < n; i++)
+    for (u = 0; u < n; u++)
+      idct[i][u] = dct_basis(u, (2*i+1) * u * scale);
+  init_fdct(fdct);
+  smin = (double) -CENTERJSAMPLE;
+  smax = (double) (MAXJSAMPLE - CENTERJSAMPLE);
+
+  /* Samples of one destination block row */
+  max_width = 0;
+  for (ci = 0; ci < dstinfo->num_components; ci++)
+    max_width = MAX(max_width, dstinfo->comp_info[ci].width_in_blocks);
+  samples = (double *)
+    (*dst_owner->mem->alloc_large) (dst_owner, JPOOL_IMAGE,
+				    (size_t) max_width * DCTSIZE2 * SIZEOF(double));
+
+  for (ci = 0; ci < dstinfo->num_components; ci++) {
+    compptr = dstinfo->comp_info + ci;
+    srcptr = srcinfo->comp_info + ci;
+    x_crop_blocks = x_crop_offset * compptr->h_samp_factor;
+    y_crop_blocks = y_crop_offset * compptr->v_samp_factor;
+    src_qtbl = srcptr->quant_table;
+    if (src_qtbl == NULL)
+      src_qtbl = srcinfo->quant_tbl_ptrs[srcptr->quant_tbl_no];
+    dst_qtbl = dstinfo->quant_tbl_ptrs[compptr->quant_tbl_no];
+    if (src_qtbl == NULL || dst_qtbl == NULL)
+      ERREXIT1(dst_owner, JERR_NO_QUANT_TABLE, compptr->quant_tbl_no);
+    for (dst_blk_y = 0; dst_blk_y < compptr->height_in_blocks;
+	 dst_blk_y += compptr->v_samp_factor) {
+      dst_buffer = (*dst_owner->mem->access_virt_barray)
+	(dst_owner, dst_coef_arrays[ci], dst_blk_y,
 	 (JDIMENSION) compptr->v_samp_factor, TRUE);
       for (offset_y = 0; offset_y < compptr->v_samp_factor; offset_y++) {
-        for (offset_x = x_wipe_blocks; offset_x < x_wipe_blocks+wipe_width; offset_x++) {
-          JCOEF *blktop = buffer[offset_y][offset_x];
-          FMEMZERO(blktop+1, (DCTSIZE2-1) * SIZEOF(JCOEF));
-        }
+	/* Inverse transform the source blocks, a block row at a time */
+	for (k = 0; k < scale; k++) {
+	  src_blk_y = (dst_blk_y + offset_y + y_crop_blocks) * scale + k;
+	  if (src_blk_y >= srcptr->height_in_blocks)
+	    src_blk_y = srcptr->height_in_blocks - 1;
+	  src_buffer = (*srcinfo->mem->access_virt_barray)
+	    ((j_common_ptr) srcinfo, src_coef_arrays[ci], src_blk_y,
+	     (JDIMENSION) 1, FALSE);
+	  for (dst_blk_x = 0; dst_blk_x < compptr->width_in_blocks;
+	       dst_blk_x++) {
+	    for (j = 0; j < scale; j++) {
+	      src_blk_x = (dst_blk_x + x_crop_blocks) * scale + j;
+	      if (src_blk_x >= srcptr->width_in_blocks)
+		src_blk_x = srcptr->width_in_blocks - 1;
+	      src_ptr = src_buffer[0][src_blk_x];
+	      for (u = 0; u < n; u++)
+		for (v = 0; v < n; v++)
+		  coef[u*n+v] = (double) src_ptr[u*DCTSIZE+v] *
+				src_qtbl->quantval[u*DCTSIZE+v];
+	      for (i = 0; i < n; i++)
+		for (v = 0; v < n; v++) {
+		  sum = 0.0;
+		  for (u = 0; u < n; u++)
+		    sum += idct[i][u] * coef[u*n+v];
+		  tmp[i*n+v] = sum;
+		}
+	      sptr = samples + (size_t) dst_blk_x * DCTSIZE2 +
+		     (k * n) * DCTSIZE + j * n;
+	      for (i = 0; i < n; i++)
+		for (u = 0; u < n; u++) {
+		  sum = 0.0;
+		  for (v = 0; v < n; v++)
+		    sum += tmp[i*n+v] * idct[u][v];
+		  sptr[i*DCTSIZE+u] = (sum < smin) ? smin :
+				      (sum > smax) ? smax : sum;
+		}
+	    }
+	  }
+	}
+	/* Forward transform and quantize the destination blocks */
+	for (dst_blk_x = 0; dst_blk_x < compptr->width_in_blocks;
+	     dst_blk_x++) {
+	  fdct_quantize(fdct, samples + (size_t) dst_blk_x * DCTSIZE2,
+			dst_qtbl, dst_buffer[offset_y][dst_blk_x]);
+	}
       }
     }
   }
@@ -1033,6 +1567,120 @@ jtransform_parse_crop_spec (jpeg_transform_info *info, const char *spec)
 }
 
 
+/* Added for ajpegtran
+ * Parse a list of regions for JXFORM_REDACT, separated by commas.
+ * Each region is "WxH+X+Y" (offsets may be negative, like crop), followed
+ * by an optional mode ":wipe", ":flatten" or ":N" to pixelize with N x N
+ * pixel cells (N = 8, 16, 32 or 64).  The default is ":8".
+ * The regions are appended to info->regions.
+ * Returns TRUE if the list is valid, FALSE if not.
+ */
+
+GLOBAL(boolean)
+jtransform_parse_region_list (jpeg_transform_info *info, const char *spec)
+{
+  jpeg_redact_region *region;
+
+  for (;;) {
+    if (info->num_regions >= JMAX_REDACT_REGIONS)
+      return FALSE;
+    region = info->regions + info->num_regions;
+    /* fetch width and height, both are required */
+    if (! jt_read_integer(&spec, &region->width))
+      return FALSE;
+    if (*spec != 'x' && *spec != 'X')
+      return FALSE;
+    spec++;
+    if (! jt_read_integer(&spec, &region->height))
+      return FALSE;
+    region->xoffset = 0;
+    region->xoffset_set = JCROP_UNSET;
+    region->yoffset = 0;
+    region->yoffset_set = JCROP_UNSET;
+    if (*spec == '+' || *spec == '-') {
+      /* fetch xoffset */
+      region->xoffset_set = (*spec == '-') ? JCROP_NEG : JCROP_POS;
+      spec++;
+      if (! jt_read_integer(&spec, &region->xoffset))
+	return FALSE;
+    }
+    if (*spec == '+' || *spec == '-') {
+      /* fetch yoffset */
+      region->yoffset_set = (*spec == '-') ? JCROP_NEG : JCROP_POS;
+      spec++;
+      if (! jt_read_integer(&spec, &region->yoffset))
+	return FALSE;
+    }
+    /* fetch mode */
+    region->mode = 8;
+    if (*spec == ':') {
+      spec++;
+      if (strncmp(spec, "wipe", 4) == 0) {
+	region->mode = JREDACT_WIPE;
+	spec += 4;
+      } else if (strncmp(spec, "flatten", 7) == 0) {
+	region->mode = JREDACT_FLATTEN;
+	spec += 7;
+      } else {
+	JDIMENSION cell_size;
+	if (! jt_read_integer(&spec, &cell_size) ||
+	    (cell_size != 8 && cell_size != 16 &&
+	     cell_size != 32 && cell_size != 64))
+	  return FALSE;
+	region->mode = (int) cell_size;
+      }
+    }
+    info->num_regions++;
+    if (*spec == '\0')
+      return TRUE;
+    if (*spec++ != ',')
+      return FALSE;
+  }
+}
+
+
+/* Added for ajpegtran
+ * Parse a list of positions for JXFORM_DROP, separated by commas.
+ * Each position is "+X+Y:N", where N is the caller's number of the image
+ * (a file descriptor for ajpegtran).
+ * The positions are appended to info->drops.
+ * Returns TRUE if the list is valid, FALSE if not.
+ */
+
+GLOBAL(boolean)
+jtransform_parse_drop_list (jpeg_transform_info *info, const char *spec)
+{
+  jpeg_drop_image *drop;
+  JDIMENSION source;
+
+  for (;;) {
+    if (info->num_drops >= JMAX_DROP_IMAGES)
+      return FALSE;
+    drop = info->drops + info->num_drops;
+    /* fetch xoffset and yoffset, both are required */
+    if (*spec++ != '+')
+      return FALSE;
+    if (! jt_read_integer(&spec, &drop->xoffset))
+      return FALSE;
+    if (*spec++ != '+')
+      return FALSE;
+    if (! jt_read_integer(&spec, &drop->yoffset))
+      return FALSE;
+    /* fetch number of the image */
+    if (*spec++ != ':')
+      return FALSE;
+    if (! jt_read_integer(&spec, &source))
+      return FALSE;
+    drop->source = (int) source;
+    info->num_drops++;
+    if (*spec == '\0')
+      return TRUE;
+    if (*spec++ != ',')
+      return FALSE;
+  }
+}
+
+
 /* Trim off any partial iMCUs on the indicated destination edge */
 
 LOCAL(void)
@@ -1145,6 +1793,27 @@ jtransform_request_workspace (j_decompress_ptr srcinfo,
 	srcinfo->max_h_samp_factor * srcinfo->min_DCT_h_scaled_size;
     }
     break;
+  case JXFORM_DOWNSCALE:
+    /* Added for ajpegtran
+     *  The destination is the downscaled image.
+     */
+    if (srcinfo->block_size != DCTSIZE ||
+	(info->downscale != 2 && info->downscale != 4 && info->downscale != 8))
+      ERREXIT(srcinfo, JERR_NOTIMPL);
+    info->output_width = (JDIMENSION)
+      jdiv_round_up((long) srcinfo->output_width, (long) info->downscale);
+    info->output_height = (JDIMENSION)
+      jdiv_round_up((long) srcinfo->output_height, (long) info->downscale);
+    if (info->num_components == 1) {
+      info->iMCU_sample_width = srcinfo->min_DCT_h_scaled_size;
+      info->iMCU_sample_height = srcinfo->min_DCT_v_scaled_size;
+    } else {
+      info->iMCU_sample_width =
+	srcinfo->max_h_samp_factor * srcinfo->min_DCT_h_scaled_size;
+      info->iMCU_sample_height =
+	srcinfo->max_v_samp_factor * srcinfo->min_DCT_v_scaled_size;
+    }
+    break;
   default:
     info->output_width = srcinfo->output_width;
     info->output_height = srcinfo->output_height;
@@ -1177,7 +1846,9 @@ jtransform_request_workspace (j_decompress_ptr srcinfo,
       /* Check for crop extension */
       if (info->crop_width > info->output_width) {
 	/* Crop extension does not work when transforming! */
-	if (info->transform != JXFORM_NONE ||
+	/* Modified for ajpegtran : but it does with JXFORM_DROP */
+	if ((info->transform != JXFORM_NONE &&
+	     info->transform != JXFORM_DROP) ||
 	    info->crop_xoffset >= info->crop_width ||
 	    info->crop_xoffset > info->crop_width - info->output_width)
 	  ERREXIT(srcinfo, JERR_BAD_CROP_SPEC);
@@ -1196,7 +1867,9 @@ jtransform_request_workspace (j_decompress_ptr srcinfo,
       /* Check for crop extension */
       if (info->crop_height > info->output_height) {
 	/* Crop extension does not work when transforming! */
-	if (info->transform != JXFORM_NONE ||
+	/* Modified for ajpegtran : but it does with JXFORM_DROP */
+	if ((info->transform != JXFORM_NONE &&
+	     info->transform != JXFORM_DROP) ||
 	    info->crop_yoffset >= info->crop_height ||
 	    info->crop_yoffset > info->crop_height - info->output_height)
 	  ERREXIT(srcinfo, JERR_BAD_CROP_SPEC);
@@ -1252,12 +1925,138 @@ jtransform_request_workspace (j_decompress_ptr srcinfo,
     info->y_crop_offset = 0;
   }
 
+  /* Added for ajpegtran
+   *  Compute the redaction regions in iMCUs, like the wipe area above.
+   *  The regions are clipped to the image; one outside becomes empty.
+   */
+  if (info->transform == JXFORM_REDACT) {
+    jpeg_redact_region *region;
+    long left, right, top, bottom;
+
+    if (info->crop)
+      ERREXIT(srcinfo, JERR_BAD_CROP_SPEC);
+    for (ci = 0; ci < info->num_regions; ci++) {
+      region = info->regions + ci;
+      if (region->xoffset_set == JCROP_NEG)
+	right = (long) info->output_width - (long) region->xoffset;
+      else
+	right = (long) region->xoffset + (long) region->width;
+      left = MAX(right - (long) region->width, 0L);
+      right = MIN(right, (long) info->output_width);
+      if (region->yoffset_set == JCROP_NEG)
+	bottom = (long) info->output_height - (long) region->yoffset;
+      else
+	bottom = (long) region->yoffset + (long) region->height;
+      top = MAX(bottom - (long) region->height, 0L);
+      bottom = MIN(bottom, (long) info->output_height);
+      if (right <= left || bottom <= top) {
+	region->x_crop_offset = region->y_crop_offset = 0;
+	region->drop_width = region->drop_height = 0;
+	continue;
+      }
+      region->x_crop_offset = (JDIMENSION) (left / info->iMCU_sample_width);
+      region->y_crop_offset = (JDIMENSION) (top / info->iMCU_sample_height);
+      region->drop_width = (JDIMENSION) jdiv_round_up
+	(right - left + left % info->iMCU_sample_width,
+	 (long) info->iMCU_sample_width);
+      region->drop_height = (JDIMENSION) jdiv_round_up
+	(bottom - top + top % info->iMCU_sample_height,
+	 (long) info->iMCU_sample_height);
+    }
+  }
+
+  /* Added for ajpegtran
+   *  Compute the positions of the images to drop in iMCUs of the output
+   *  (after the crop), and check that their blocks fit the output.
+   *  The images are clipped to the output; one outside is ignored.
+   */
+  if (info->transform == JXFORM_DROP) {
+    jpeg_drop_image *drop;
+    j_decompress_ptr dropinfo;
+    int di, max_h, max_v, drop_h, drop_v, drop_max_h, drop_max_v;
+    boolean src_luma, drop_luma;
+
+    width_in_iMCUs = (JDIMENSION)
+      jdiv_round_up((long) info->output_width,
+		    (long) info->iMCU_sample_width);
+    height_in_iMCUs = (JDIMENSION)
+      jdiv_round_up((long) info->output_height,
+		    (long) info->iMCU_sample_height);
+    src_luma = (srcinfo->jpeg_color_space == JCS_GRAYSCALE ||
+		srcinfo->jpeg_color_space == JCS_YCbCr ||
+		srcinfo->jpeg_color_space == JCS_BG_YCC);
+    for (di = 0; di < info->num_drops; di++) {
+      drop = info->drops + di;
+      dropinfo = drop->drop_ptr;
+      if (dropinfo->block_size != srcinfo->block_size)
+	ERREXIT2(srcinfo, JERR_BAD_DCTSIZE,
+		 dropinfo->block_size, dropinfo->block_size);
+      /* A grayscale image can be dropped into a YCbCr image, and the Y of
+       * a YCbCr image into a grayscale one.  Otherwise the color spaces
+       * must be the same.
+       */
+      drop_luma = (dropinfo->jpeg_color_space == JCS_GRAYSCALE ||
+		   dropinfo->jpeg_color_space == JCS_YCbCr ||
+		   dropinfo->jpeg_color_space == JCS_BG_YCC);
+      if ((dropinfo->num_components > 1 && info->num_components > 1) ?
+	  (dropinfo->jpeg_color_space != srcinfo->jpeg_color_space ||
+	   dropinfo->num_components != info->num_components) :
+	  ! (src_luma && drop_luma))
+	ERREXIT(srcinfo, JERR_CONVERSION_NOTIMPL);
+      /* Each component must have the same blocks per pixel */
+      for (ci = 0; ci < info->num_components &&
+		   ci < dropinfo->num_components; ci++) {
+	if (info->num_components == 1) {
+	  h_samp_factor = v_samp_factor = max_h = max_v = 1;
+	} else {
+	  h_samp_factor = srcinfo->comp_info[ci].h_samp_factor;
+	  v_samp_factor = srcinfo->comp_info[ci].v_samp_factor;
+	  max_h = srcinfo->max_h_samp_factor;
+	  max_v = srcinfo->max_v_samp_factor;
+	}
+	if (dropinfo->num_components == 1) {
+	  drop_h = drop_v = drop_max_h = drop_max_v = 1;
+	} else {
+	  drop_h = dropinfo->comp_info[ci].h_samp_factor;
+	  drop_v = dropinfo->comp_info[ci].v_samp_factor;
+	  drop_max_h = dropinfo->max_h_samp_factor;
+	  drop_max_v = dropinfo->max_v_samp_factor;
+	}
+	if (h_samp_factor * drop_max_h != drop_h * max_h)
+	  ERREXIT6(srcinfo, JERR_BAD_DROP_SAMPLING, ci,
+		   max_h, h_samp_factor, drop_max_h, drop_h, 'h');
+	if (v_samp_factor * drop_max_v != drop_v * max_v)
+	  ERREXIT6(srcinfo, JERR_BAD_DROP_SAMPLING, ci,
+		   max_v, v_samp_factor, drop_max_v, drop_v, 'v');
+      }
+      /* The upper left corner is moved to an iMCU boundary */
+      drop->x_crop_offset = drop->xoffset / info->iMCU_sample_width;
+      drop->y_crop_offset = drop->yoffset / info->iMCU_sample_height;
+      if (drop->x_crop_offset >= width_in_iMCUs ||
+	  drop->y_crop_offset >= height_in_iMCUs) {
+	drop->drop_width = drop->drop_height = 0;
+	continue;
+      }
+      drop->drop_width = (JDIMENSION)
+	jdiv_round_up((long) dropinfo->image_width,
+		      (long) info->iMCU_sample_width);
+      drop->drop_width = MIN(drop->drop_width,
+			     width_in_iMCUs - drop->x_crop_offset);
+      drop->drop_height = (JDIMENSION)
+	jdiv_round_up((long) dropinfo->image_height,
+		      (long) info->iMCU_sample_height);
+      drop->drop_height = MIN(drop->drop_height,
+			      height_in_iMCUs - drop->y_crop_offset);
+    }
+  }
+
   /* Figure out whether we need workspace arrays,
    * and if so whether they are transposed relative to the source.
    */
   need_workspace = FALSE;
   transpose_it = FALSE;
   switch (info->transform) {
+  case JXFORM_DROP:		/* Added for ajpegtran : crop like JXFORM_NONE */
   case JXFORM_NONE:
     if (info->x_crop_offset != 0 || info->y_crop_offset != 0 ||
 	info->output_width > srcinfo->output_width ||
@@ -1317,6 +2116,11 @@ jtransform_request_workspace (j_decompress_ptr srcinfo,
     break;
   case JXFORM_WIPE:
   case JXFORM_PIXELIZE:
+  case JXFORM_REDACT:
+    break;
+  case JXFORM_DOWNSCALE:
+    /* Need workspace arrays having downscaled dimensions. */
+    need_workspace = TRUE;
     break;
   }
 
@@ -2021,6 +2825,7 @@ jtransform_execute_transform (j_decompress_ptr srcinfo,
    * in jtransform_request_workspace()
    */
   switch (info->transform) {
+  case JXFORM_DROP:		/* Added for ajpegtran : crop like JXFORM_NONE */
   case JXFORM_NONE:
     if (info->output_width > srcinfo->output_width ||
 	info->output_height > srcinfo->output_height)
@@ -2029,6 +2834,12 @@ jtransform_execute_transform (j_decompress_ptr srcinfo,
     else if (info->x_crop_offset != 0 || info->y_crop_offset != 0)
       do_crop(srcinfo, dstinfo, info->x_crop_offset, info->y_crop_offset,
 	      src_coef_arrays, dst_coef_arrays);
+    /* Added for ajpegtran
+     *  Then drop the images into the output.
+     */
+    if (info->transform == JXFORM_DROP)
+      do_drop(srcinfo, dstinfo, dst_coef_arrays != NULL ?
+	      dst_coef_arrays : src_coef_arrays, info);
     break;
   case JXFORM_FLIP_H:
     if (info->y_crop_offset != 0)
@@ -2075,11 +2886,75 @@ jtransform_execute_transform (j_decompress_ptr srcinfo,
    */
   case JXFORM_PIXELIZE:
     do_pixelize(srcinfo, dstinfo, info->x_crop_offset, info->y_crop_offset,
-	      src_coef_arrays, info->drop_width, info->drop_height);
+	      src_coef_arrays, info->drop_width, info->drop_height,
+	      info->pixelize_size);
+    break;
+  case JXFORM_DOWNSCALE:
+    do_downscale(srcinfo, dstinfo, info->x_crop_offset, info->y_crop_offset,
+		 src_coef_arrays, dst_coef_arrays, info->downscale,
+		 (j_common_ptr) srcinfo);
+    break;
+  case JXFORM_REDACT:
+    do_redact(srcinfo, dstinfo, src_coef_arrays, info);
     break;
   }
 }
 
+
+/* Added for ajpegtran
+ *  Fill the coefficient arrays of one tile for '-tile'.
+ *
+ * dstinfo is the compression object of the tile, after jpeg_write_coefficients,
+ * and dst_coef_arrays are requested from its own memory manager.
+ * The tile is at x_offset, y_offset (in iMCUs) of the source image
+ * downscaled by scale (1, 2, 4 or 8).  The source arrays are only read,
+ * and errors go to dstinfo, so several tiles can be made on threads.
+ */
+
+GLOBAL(void)
+jtransform_execute_tile (j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+			 jvirt_barray_ptr *src_coef_arrays,
+			 jvirt_barray_ptr *dst_coef_arrays,
+			 JDIMENSION x_offset, JDIMENSION y_offset, int scale)
+{
+  JDIMENSION dst_blk_y, x_crop_blocks, y_crop_blocks;
+  int ci, offset_y;
+  JBLOCKARRAY src_buffer, dst_buffer;
+  jpeg_component_info *compptr;
+
+  if (scale > 1) {
+    if (srcinfo->block_size != DCTSIZE ||
+	(scale != 2 && scale != 4 && scale != 8))
+      ERREXIT(dstinfo, JERR_NOTIMPL);
+    do_downscale(srcinfo, dstinfo, x_offset, y_offset,
+		 src_coef_arrays, dst_coef_arrays, scale,
+		 (j_common_ptr) dstinfo);
+    return;
+  }
+
+  /* Same as do_crop, but the destination is accessed through dstinfo */
+  for (ci = 0; ci < dstinfo->num_components; ci++) {
+    compptr = dstinfo->comp_info + ci;
+    x_crop_blocks = x_offset * compptr->h_samp_factor;
+    y_crop_blocks = y_offset * compptr->v_samp_factor;
+    for (dst_blk_y = 0; dst_blk_y < compptr->height_in_blocks;
+	 dst_blk_y += compptr->v_samp_factor) {
+      dst_buffer = (*dstinfo->mem->access_virt_barray)
+	((j_common_ptr) dstinfo, dst_coef_arrays[ci], dst_blk_y,
+	 (JDIMENSION) compptr->v_samp_factor, TRUE);
+      src_buffer = (*srcinfo->mem->access_virt_barray)
+	((j_common_ptr) srcinfo, src_coef_arrays[ci],
+	 dst_blk_y + y_crop_blocks,
+	 (JDIMENSION) compptr->v_samp_factor, FALSE);
+      for (offset_y = 0; offset_y < compptr->v_samp_factor; offset_y++) {
+	jcopy_block_row(src_buffer[offset_y] + x_crop_blocks,
+			dst_buffer[offset_y],
+			compptr->width_in_blocks);
+      }
+    }
+  }
+}
+
 /* jtransform_perfect_transform
  *
  * Determine whether lossless transformation is perfectly
@@ -2133,6 +3008,398 @@ jtransform_perfect_transform(JDIMENSION image_width, JDIMENSION image_height,
   return result;
 }
 
+
+/* Added for ajpegtran
+ *  Rebuild the Exif thumbnail from the DC coefficients of the output image.
+ *
+ *  Each thumbnail pixel is the average of the DC values of the blocks it
+ *  covers, so no IDCT is needed.  The thumbnail is transformed and coded
+ *  by a compression object of its own (baseline, 1x1 sampling, default
+ *  quality, optimized tables) into memory, and spliced into the APP1
+ *  marker saved in the source object, which jcopy_markers_execute writes.
+ *  If the old thumbnail is at the end of the Exif data, as usual, it is
+ *  replaced in place.  Otherwise the old IFD1 is cleared and a new IFD1
+ *  with the thumbnail is appended.  Errors of the thumbnail are not
+ *  reported; the marker is left as it was then.
+ */
+
+#define THUMB_MAX_SIZE  160	/* longer side of the thumbnail in pixels */
+#define THUMB_BUF_SIZE  65000	/* max size of APP1 data, roughly */
+
+typedef struct {
+  struct jpeg_error_mgr pub;	/* "public" fields */
+  jmp_buf setjmp_buffer;	/* for return from a failed thumbnail */
+} thumb_error_mgr;
+
+METHODDEF(noreturn_t)
+thumb_error_exit (j_common_ptr cinfo)
+{
+  thumb_error_mgr * err = (thumb_error_mgr *) cinfo->err;
+
+  longjmp(err->setjmp_buffer, 1);
+}
+
+METHODDEF(void)
+thumb_output_message (j_common_ptr cinfo)
+{
+  /* Warnings of the thumbnail are not reported */
+}
+
+
+LOCAL(void)
+dc_thumbnail_samples (j_decompress_ptr srcinfo, jpeg_component_info *compptr,
+		      jvirt_barray_ptr coef_array, JQUANT_TBL *qtbl,
+		      JDIMENSION width, JDIMENSION height,
+		      double *samples, JDIMENSION row_stride, double *sums)
+/* Average the DC values of a component into width x height samples */
+{
+  JDIMENSION x, y, x0, x1, y0, y1, blk_x, blk_y;
+  JBLOCKARRAY buffer;
+  double scale, value, count;
+
+  /* A DC value is 8 times the average of the level-shifted samples */
+  scale = (double) qtbl->quantval[0] / (double) DCTSIZE;
+  for (y = 0; y < height; y++) {
+    y0 = y * compptr->height_in_blocks / height;
+    y1 = (y + 1) * compptr->height_in_blocks / height;
+    if (y1 <= y0)
+      y1 = y0 + 1;
+    for (x = 0; x < width; x++)
+      sums[x] = 0.0;
+    for (blk_y = y0; blk_y < y1; blk_y++) {
+      buffer = (*srcinfo->mem->access_virt_barray)
+	((j_common_ptr) srcinfo, coef_array, blk_y, (JDIMENSION) 1, FALSE);
+      for (x = 0; x < width; x++) {
+	x0 = x * compptr->width_in_blocks / width;
+	x1 = (x + 1) * compptr->width_in_blocks / width;
+	if (x1 <= x0)
+	  x1 = x0 + 1;
+	for (blk_x = x0; blk_x < x1; blk_x++)
+	  sums[x] += (double) buffer[0][blk_x][0];
+      }
+    }
+    for (x = 0; x < width; x++) {
+      x0 = x * compptr->width_in_blocks / width;
+      x1 = (x + 1) * compptr->width_in_blocks / width;
+      if (x1 <= x0)
+	x1 = x0 + 1;
+      count = (double) (x1 - x0) * (double) (y1 - y0);
+      value = sums[x] / count * scale;
+      if (value < (double) -CENTERJSAMPLE)
+	value = (double) -CENTERJSAMPLE;
+      else if (value > (double) (MAXJSAMPLE - CENTERJSAMPLE))
+	value = (double) (MAXJSAMPLE - CENTERJSAMPLE);
+      samples[y * row_stride + x] = value;
+    }
+  }
+}
+
+
+LOCAL(boolean)
+compress_thumbnail (j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+		    jvirt_barray_ptr *coef_arrays,
+		    JOCTET FAR * thumbbuf, unsigned long * thumbsize)
+/* Code the thumbnail into thumbbuf; return FALSE if not possible */
+{
+  struct jpeg_compress_struct thumb;
+  thumb_error_mgr jerr;
+  jvirt_barray_ptr thumb_arrays[MAX_COMPONENTS];
+  double fdct[DCTSIZE][DCTSIZE];
+  double block[DCTSIZE2];
+  double *samples, *sums;
+  unsigned char * outbuffer;
+  JDIMENSION width, height, wblocks, hblocks, stride, x, y, blk_x, blk_y;
+  JBLOCKARRAY buffer;
+  JQUANT_TBL *qtbl;
+  jpeg_component_info *compptr;
+  int ci, i, j, num_components;
+
+  if ((dstinfo->jpeg_color_space == JCS_YCbCr &&
+       dstinfo->num_components == 3) ||
+      (dstinfo->jpeg_color_space == JCS_GRAYSCALE &&
+       dstinfo->num_components == 1))
+    num_components = dstinfo->num_components;
+  else
+    return FALSE;
+
+  /* The longer side is THUMB_MAX_SIZE, or a pixel per block if smaller */
+  if (dstinfo->jpeg_width >= dstinfo->jpeg_height) {
+    width = (JDIMENSION) jdiv_round_up((long) dstinfo->jpeg_width, DCTSIZE);
+    if (width > THUMB_MAX_SIZE)
+      width = THUMB_MAX_SIZE;
+    height = (JDIMENSION) (((double) dstinfo->jpeg_height * width) /
+			   dstinfo->jpeg_width + 0.5);
+  } else {
+    height = (JDIMENSION) jdiv_round_up((long) dstinfo->jpeg_height, DCTSIZE);
+    if (height > THUMB_MAX_SIZE)
+      height = THUMB_MAX_SIZE;
+    width = (JDIMENSION) (((double) dstinfo->jpeg_width * height) /
+			  dstinfo->jpeg_height + 0.5);
+  }
+  if (width < 1)
+    width = 1;
+  if (height < 1)
+    height = 1;
+  wblocks = (JDIMENSION) jdiv_round_up((long) width, DCTSIZE);
+  hblocks = (JDIMENSION) jdiv_round_up((long) height, DCTSIZE);
+  stride = wblocks * DCTSIZE;
+
+  thumb.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = thumb_error_exit;
+  jerr.pub.output_message = thumb_output_message;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_compress(&thumb);
+    return FALSE;
+  }
+  jpeg_create_compress(&thumb);
+  thumb.in_color_space = dstinfo->jpeg_color_space;
+  thumb.input_components = num_components;
+  jpeg_set_defaults(&thumb);
+  jpeg_set_colorspace(&thumb, dstinfo->jpeg_color_space);
+  for (ci = 0; ci < num_components; ci++) {
+    thumb.comp_info[ci].h_samp_factor = 1;
+    thumb.comp_info[ci].v_samp_factor = 1;
+  }
+  thumb.jpeg_width = width;
+  thumb.jpeg_height = height;
+  thumb.min_DCT_h_scaled_size = DCTSIZE;
+  thumb.min_DCT_v_scaled_size = DCTSIZE;
+  thumb.optimize_coding = TRUE;
+  thumb.write_JFIF_header = FALSE;
+
+  for (ci = 0; ci < num_components; ci++)
+    thumb_arrays[ci] = (*thumb.mem->request_virt_barray)
+      ((j_common_ptr) &thumb, JPOOL_IMAGE, FALSE, wblocks, hblocks,
+       (JDIMENSION) 1);
+  (*thumb.mem->realize_virt_arrays) ((j_common_ptr) &thumb);
+  samples = (double *)
+    (*thumb.mem->alloc_large) ((j_common_ptr) &thumb, JPOOL_IMAGE,
+			       (size_t) stride * hblocks * DCTSIZE *
+			       SIZEOF(double));
+  sums = (double *)
+    (*thumb.mem->alloc_small) ((j_common_ptr) &thumb, JPOOL_IMAGE,
+			       (size_t) width * SIZEOF(double));
+  init_fdct(fdct);
+
+  for (ci = 0; ci < num_components; ci++) {
+    compptr = dstinfo->comp_info + ci;
+    qtbl = dstinfo->quant_tbl_ptrs[compptr->quant_tbl_no];
+    if (qtbl == NULL)
+      ERREXIT1(&thumb, JERR_NO_QUANT_TABLE, compptr->quant_tbl_no);
+    dc_thumbnail_samples(srcinfo, compptr, coef_arrays[ci], qtbl,
+			 width, height, samples, stride, sums);
+    /* Replicate the last column and row into the padding */
+    for (y = 0; y < height; y++)
+      for (x = width; x < stride; x++)
+	samples[y * stride + x] = samples[y * stride + width - 1];
+    for (y = height; y < hblocks * DCTSIZE; y++)
+      for (x = 0; x < stride; x++)
+	samples[y * stride + x] = samples[(height - 1) * stride + x];
+    qtbl = thumb.quant_tbl_ptrs[thumb.comp_info[ci].quant_tbl_no];
+    for (blk_y = 0; blk_y < hblocks; blk_y++) {
+      buffer = (*thumb.mem->access_virt_barray)
+	((j_common_ptr) &thumb, thumb_arrays[ci], blk_y, (JDIMENSION) 1, TRUE);
+      for (blk_x = 0; blk_x < wblocks; blk_x++) {
+	for (i = 0; i < DCTSIZE; i++)
+	  for (j = 0; j < DCTSIZE; j++)
+	    block[i*DCTSIZE+j] =
+	      samples[(blk_y * DCTSIZE + i) * stride + blk_x * DCTSIZE + j];
+	fdct_quantize(fdct, block, qtbl, buffer[0][blk_x]);
+      }
+    }
+  }
+
+  /* Code into the given buffer; it is not enlarged by jpeg_mem_dest
+   * unless the thumbnail doesn't fit, which is an error for us.
+   */
+  outbuffer = (unsigned char *) thumbbuf;
+  *thumbsize = THUMB_BUF_SIZE;
+  jpeg_mem_dest(&thumb, &outbuffer, thumbsize);
+  jpeg_write_coefficients(&thumb, thumb_arrays);
+  jpeg_finish_compress(&thumb);
+  jpeg_destroy_compress(&thumb);
+  if (outbuffer != (unsigned char *) thumbbuf) {
+    free(outbuffer);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+LOCAL(unsigned int)
+exif_get16 (JOCTET FAR * p, boolean is_motorola)
+{
+  if (is_motorola)
+    return ((unsigned int) GETJOCTET(p[0]) << 8) | GETJOCTET(p[1]);
+  return ((unsigned int) GETJOCTET(p[1]) << 8) | GETJOCTET(p[0]);
+}
+
+LOCAL(unsigned int)
+exif_get32 (JOCTET FAR * p, boolean is_motorola)
+{
+  if (is_motorola)
+    return (exif_get16(p, TRUE) << 16) | exif_get16(p + 2, TRUE);
+  return (exif_get16(p + 2, FALSE) << 16) | exif_get16(p, FALSE);
+}
+
+LOCAL(void)
+exif_put16 (JOCTET FAR * p, unsigned int value, boolean is_motorola)
+{
+  if (is_motorola) {
+    p[0] = (JOCTET) ((value >> 8) & 0xFF);
+    p[1] = (JOCTET) (value & 0xFF);
+  } else {
+    p[0] = (JOCTET) (value & 0xFF);
+    p[1] = (JOCTET) ((value >> 8) & 0xFF);
+  }
+}
+
+LOCAL(void)
+exif_put32 (JOCTET FAR * p, unsigned int value, boolean is_motorola)
+{
+  if (is_motorola) {
+    exif_put16(p, value >> 16, TRUE);
+    exif_put16(p + 2, value & 0xFFFF, TRUE);
+  } else {
+    exif_put16(p, value & 0xFFFF, FALSE);
+    exif_put16(p + 2, value >> 16, FALSE);
+  }
+}
+
+LOCAL(void)
+exif_put_entry (JOCTET FAR * p, unsigned int tagnum, unsigned int datatype,
+		unsigned int value, boolean is_motorola)
+/* Write an IFD entry of one SHORT (3) or LONG (4) value */
+{
+  exif_put16(p, tagnum, is_motorola);
+  exif_put16(p + 2, datatype, is_motorola);
+  exif_put32(p + 4, 1, is_motorola);
+  if (datatype == 3) {
+    exif_put16(p + 8, value, is_motorola);
+    exif_put16(p + 10, 0, is_motorola);
+  } else
+    exif_put32(p + 8, value, is_motorola);
+}
+
+
+GLOBAL(void)
+jtransform_rebuild_thumbnail (j_decompress_ptr srcinfo,
+			      j_compress_ptr dstinfo,
+			      jvirt_barray_ptr *coef_arrays)
+{
+  jpeg_saved_marker_ptr marker;
+  JOCTET FAR * data;
+  JOCTET FAR * newdata;
+  JOCTET FAR * thumbbuf;
+  unsigned long thumbsize;
+  unsigned int length, ifd0, next_ptr, ifd1, number_of_tags, entry;
+  unsigned int offset_entry, length_entry, jpeg_offset, jpeg_len;
+  unsigned int pos, thumbpos, newlength;
+  boolean is_motorola, in_place;
+
+  /* Find the Exif marker */
+  for (marker = srcinfo->marker_list; marker != NULL; marker = marker->next) {
+    if (marker->marker == JPEG_APP0+1 &&
+	marker->data_length >= 6 + 12 &&
+	GETJOCTET(marker->data[0]) == 0x45 &&
+	GETJOCTET(marker->data[1]) == 0x78 &&
+	GETJOCTET(marker->data[2]) == 0x69 &&
+	GETJOCTET(marker->data[3]) == 0x66 &&
+	GETJOCTET(marker->data[4]) == 0 &&
+	GETJOCTET(marker->data[5]) == 0)
+      break;
+  }
+  if (marker == NULL)
+    return;
+  data = marker->data + 6;
+  length = marker->data_length - 6;
+
+  /* Discover byte order and find the link from IFD0 to IFD1 */
+  if (GETJOCTET(data[0]) == 0x49 && GETJOCTET(data[1]) == 0x49)
+    is_motorola = FALSE;
+  else if (GETJOCTET(data[0]) == 0x4D && GETJOCTET(data[1]) == 0x4D)
+    is_motorola = TRUE;
+  else
+    return;
+  if (exif_get16(data + 2, is_motorola) != 0x2A)
+    return;
+  ifd0 = exif_get32(data + 4, is_motorola);
+  if (ifd0 < 8 || ifd0 > length - 2)
+    return;
+  number_of_tags = exif_get16(data + ifd0, is_motorola);
+  next_ptr = ifd0 + 2 + number_of_tags * 12;
+  if (number_of_tags > (length - ifd0 - 2) / 12 || next_ptr > length - 4)
+    return;
+
+  /* Look for the thumbnail in IFD1 */
+  ifd1 = exif_get32(data + next_ptr, is_motorola);
+  offset_entry = length_entry = 0;
+  if (ifd1 >= 8 && ifd1 <= length - 2) {
+    number_of_tags = exif_get16(data + ifd1, is_motorola);
+    for (entry = ifd1 + 2; number_of_tags > 0 && entry <= length - 12;
+	 number_of_tags--, entry += 12) {
+      if (exif_get16(data + entry + 2, is_motorola) != 4 ||
+	  exif_get32(data + entry + 4, is_motorola) != 1)
+	continue;
+      if (exif_get16(data + entry, is_motorola) == 513)
+	offset_entry = entry;	/* JPEGInterchangeFormat */
+      else if (exif_get16(data + entry, is_motorola) == 514)
+	length_entry = entry;	/* JPEGInterchangeFormatLength */
+    }
+  }
+  in_place = FALSE;
+  if (offset_entry != 0 && length_entry != 0) {
+    jpeg_offset = exif_get32(data + offset_entry + 8, is_motorola);
+    jpeg_len = exif_get32(data + length_entry + 8, is_motorola);
+    in_place = (jpeg_offset >= 8 && jpeg_offset <= length &&
+		jpeg_len == length - jpeg_offset);
+  }
+
+  /* Code the new thumbnail */
+  thumbbuf = (JOCTET FAR *)
+    (*srcinfo->mem->alloc_large) ((j_common_ptr) srcinfo, JPOOL_IMAGE,
+				  (size_t) THUMB_BUF_SIZE);
+  if (! compress_thumbnail(srcinfo, dstinfo, coef_arrays,
+			   thumbbuf, &thumbsize))
+    return;
+
+  /* Replace the old thumbnail at the end, or append IFD1 and thumbnail */
+  if (in_place) {
+    pos = jpeg_offset;
+    thumbpos = pos;
+  } else {
+    pos = (length + 1) & ~1U;	/* IFD must be at a word boundary */
+    thumbpos = pos + 2 + 3 * 12 + 4;
+  }
+  newlength = thumbpos + (unsigned int) thumbsize;
+  if (6 + (unsigned long) newlength > 65533)
+    return;			/* doesn't fit in a marker */
+  newdata = (JOCTET FAR *)
+    (*srcinfo->mem->alloc_large) ((j_common_ptr) srcinfo, JPOOL_IMAGE,
+				  (size_t) newlength + 6);
+  if (! in_place && ifd1 >= 8 && ifd1 <= length - 2)
+    /* The old IFD1 and its thumbnail are not used any more */
+    clear_exif_parameters_IFD(data, length, ifd1, is_motorola, TRUE);
+  MEMCOPY(newdata, marker->data, (size_t) MIN(pos, length) + 6);
+  data = newdata + 6;
+  if (in_place) {
+    exif_put32(data + length_entry + 8, (unsigned int) thumbsize, is_motorola);
+  } else {
+    if (pos > length)
+      data[length] = 0;		/* padding byte */
+    exif_put32(data + next_ptr, pos, is_motorola);
+    exif_put16(data + pos, 3, is_motorola);
+    exif_put_entry(data + pos + 2, 259, 3, 6, is_motorola); /* Compression */
+    exif_put_entry(data + pos + 14, 513, 4, thumbpos, is_motorola);
+    exif_put_entry(data + pos + 26, 514, 4, (unsigned int) thumbsize,
+		   is_motorola);
+    exif_put32(data + pos + 38, 0, is_motorola); /* no next IFD */
+  }
+  MEMCOPY(data + thumbpos, thumbbuf, (size_t) thumbsize);
+  marker->data = newdata;
+  marker->data_length = newlength + 6;
+}
+
 #endif /* TRANSFORMS_SUPPORTED */
 
 
@@ -84,10 +84,14 @@
 
 #ifdef NEED_SHORT_EXTERNAL_NAMES
 #define jtransform_parse_crop_spec	jTrParCrop
+#define jtransform_parse_region_list	jTrParRegion
+#define jtransform_parse_drop_list	jTrParDrop
 #define jtransform_request_workspace	jTrRequest
 #define jtransform_adjust_parameters	jTrAdjust
 #define jtransform_execute_transform	jTrExec
 #define jtransform_perfect_transform	jTrPerfect
+#define jtransform_rebuild_thumbnail	jTrThumb
+#define jtransform_execute_tile		jTrTile
 #define jcopy_markers_setup		jCMrkSetup
 #define jcopy_markers_execute		jCMrkExec
 #endif /* NEED_SHORT_EXTERNAL_NAMES */
@@ -107,7 +111,10 @@ typedef enum {
 	JXFORM_ROT_180,		/* 180-degree rotation */
 	JXFORM_ROT_270,		/* 270-degree clockwise (or 90 ccw) */
 	JXFORM_WIPE,		/* wipe */
-	JXFORM_PIXELIZE		/* Added for ajpegtran : pixelize */
+	JXFORM_PIXELIZE,	/* Added for ajpegtran : pixelize */
+	JXFORM_DOWNSCALE,	/* Added for ajpegtran : downscale */
+	JXFORM_REDACT,		/* Added for ajpegtran : list of regions */
+	JXFORM_DROP		/* Added for ajpegtran : drop other images */
 } JXFORM_CODE;
 
 /*
@@ -123,6 +130,56 @@ typedef enum {
         JCROP_FORCE
 } JCROP_CODE;
 
+/* Added for ajpegtran
+ * A region of JXFORM_REDACT, filled in by jtransform_parse_region_list().
+ * mode is JREDACT_WIPE, JREDACT_FLATTEN, or the cell size in pixels
+ * (8, 16, 32 or 64) to pixelize.
+ */
+
+#define JMAX_REDACT_REGIONS	64	/* max number of regions */
+#define JREDACT_WIPE		0
+#define JREDACT_FLATTEN		1
+
+typedef struct {
+  int mode;			/* how to redact the region */
+  JDIMENSION width;		/* Width of the region */
+  JDIMENSION height;		/* Height of the region */
+  JDIMENSION xoffset;		/* X offset of the region */
+  JCROP_CODE xoffset_set;	/* (negative measures from right edge) */
+  JDIMENSION yoffset;		/* Y offset of the region */
+  JCROP_CODE yoffset_set;	/* (negative measures from bottom edge) */
+
+  /* Internal workspace: caller should not touch these */
+  JDIMENSION x_crop_offset;	/* region offsets measured in iMCUs */
+  JDIMENSION y_crop_offset;
+  JDIMENSION drop_width;	/* region dimensions measured in iMCUs */
+  JDIMENSION drop_height;
+} jpeg_redact_region;
+
+/* Added for ajpegtran
+ * An image of JXFORM_DROP, placed into the output at (xoffset,yoffset).
+ * The position is filled in by jtransform_parse_drop_list(), with the
+ * caller's number of the image in 'source'.  The caller reads the image
+ * header into drop_ptr before jtransform_request_workspace(), and the
+ * coefficients into drop_coef_arrays before jtransform_execute_transform().
+ */
+
+#define JMAX_DROP_IMAGES	16	/* max number of images to drop */
+
+typedef struct {
+  JDIMENSION xoffset;		/* X offset in the output image */
+  JDIMENSION yoffset;		/* Y offset in the output image */
+  int source;			/* caller's number of the image */
+  j_decompress_ptr drop_ptr;	/* the image to drop */
+  jvirt_barray_ptr * drop_coef_arrays;
+
+  /* Internal workspace: caller should not touch these */
+  JDIMENSION x_crop_offset;	/* offsets measured in iMCUs */
+  JDIMENSION y_crop_offset;
+  JDIMENSION drop_width;	/* dimensions measured in iMCUs */
+  JDIMENSION drop_height;
+} jpeg_drop_image;
+
 /*
  * Transform parameters struct.
  * NB: application must not change any elements of this struct after
@@ -136,6 +193,14 @@ typedef struct {
   boolean trim;			/* if TRUE, trim partial MCUs as needed */
   boolean force_grayscale;	/* if TRUE, convert color image to grayscale */
   boolean crop;			/* if TRUE, crop or wipe source image */
+  int downscale;		/* Added for ajpegtran : 2, 4 or 8 for
+				 * JXFORM_DOWNSCALE (1/2, 1/4 or 1/8) */
+  int pixelize_size;		/* Added for ajpegtran : cell size in pixels
+				 * for JXFORM_PIXELIZE (8, 16, 32 or 64) */
+  int num_regions;		/* Added for ajpegtran : regions of */
+  jpeg_redact_region regions[JMAX_REDACT_REGIONS]; /* JXFORM_REDACT */
+  int num_drops;		/* Added for ajpegtran : images of */
+  jpeg_drop_image drops[JMAX_DROP_IMAGES]; /* JXFORM_DROP */
 
   /* Crop parameters: application need not set these unless crop is TRUE.
    * These can be filled in by jtransform_parse_crop_spec().
@@ -168,6 +233,12 @@ typedef struct {
 /* Parse a crop specification (written in X11 geometry style) */
 EXTERN(boolean) jtransform_parse_crop_spec
 	JPP((jpeg_transform_info *info, const char *spec));
+/* Added for ajpegtran : parse a list of regions for JXFORM_REDACT */
+EXTERN(boolean) jtransform_parse_region_list
+	JPP((jpeg_transform_info *info, const char *spec));
+/* Added for ajpegtran : parse a list of positions for JXFORM_DROP */
+EXTERN(boolean) jtransform_parse_drop_list
+	JPP((jpeg_transform_info *info, const char *spec));
 /* Request any required workspace */
 EXTERN(boolean) jtransform_request_workspace
 	JPP((j_decompress_ptr srcinfo, jpeg_transform_info *info));
@@ -188,6 +259,22 @@ EXTERN(boolean) jtransform_perfect_transform
 	JPP((JDIMENSION image_width, JDIMENSION image_height,
 	     int MCU_width, int MCU_height,
 	     JXFORM_CODE transform));
+/* Added for ajpegtran
+ *  Replace the Exif thumbnail in the saved APP1 marker with one made from
+ *  the DC coefficients of the output image.
+ */
+EXTERN(void) jtransform_rebuild_thumbnail
+	JPP((j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+	     jvirt_barray_ptr *coef_arrays));
+/* Added for ajpegtran
+ *  Fill the arrays of a tile object with a part of the source image,
+ *  optionally downscaled.
+ */
+EXTERN(void) jtransform_execute_tile
+	JPP((j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+	     jvirt_barray_ptr *src_coef_arrays,
+	     jvirt_barray_ptr *dst_coef_arrays,
+	     JDIMENSION x_offset, JDIMENSION y_offset, int scale));
 
 /* jtransform_execute_transform used to be called
  * jtransform_execute_transformation, but some compilers complain about
@@ -55,6 +55,9 @@ public class MainActivity extends AppCompatActivity {
     // JNI for ajpegtran
     public native String ajpegtran(int rfd,int wfd,String optionstr);
     public native String ajpegtranhead(int fd,int []retarry);
+    public native String ajpegtranpreview(int fd,java.nio.ByteBuffer buffer,int []sizearray);
+    public native String ajpegtranhash(int fd,long []hasharray);
+    public native String ajpegtranhashbatch(int []fds,long []hasharray);
     static {
         System.loadLibrary("ajpegtran");
     }